@@ -2,6 +2,10 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "isa.h"
 
 
@@ -136,34 +140,938 @@ instr_ptr bad_instr()
 }
 
 
+/* Page table: a tree of tables of PT_SIZE entries, indexed by page
+   number PT_BITS bits at a time.  The last level points to pages */
+#define PT_BITS 9
+#define PT_SIZE (1 << PT_BITS)
+/* Enough levels for any nonnegative address */
+#define PT_LEVELS ((63 - MEM_PAGE_SHIFT + PT_BITS - 1) / PT_BITS)
+
+/* A page beyond the contents is followed by its generation */
+#define PAGE_ALLOC (MEM_PAGE_SIZE + sizeof(word_t))
+
 mem_t init_mem(int len)
 {
+    return init_sparse_mem(len, len);
+}
 
+mem_t init_sparse_mem(int len, word_t size)
+{
     mem_t result = (mem_t) malloc(sizeof(mem_rec));
+    size = ((size+BPL-1)/BPL)*BPL;
+    if (len > size)
+	len = size;
     len = ((len+BPL-1)/BPL)*BPL;
     result->len = len;
     result->contents = (byte_t *) calloc(len, 1);
+    result->icache = NULL;
+    result->icache_blocks = NULL;
+    result->page_gen = (word_t *) calloc(CONTENTS_PAGES(len), sizeof(word_t));
+    result->gen = 1;
+    result->snaps = NULL;
+    result->mapped = 0;
+    result->anon = 0;
+    result->port = NULL;
+    result->size = size;
+    result->pages = NULL;
+    result->tlb_tag = -1;
+    result->tlb_page = NULL;
+    result->hashing = FALSE;
+    result->hash = 0;
+    return result;
+}
+
+/* Entry for page number tag in the page table at *root.  NULL if there
+   is none, unless alloc is set, in which case any missing tables are
+   allocated */
+static void **page_slot(void ***root, word_t tag, bool_t alloc)
+{
+    void **table;
+    int level, i;
+
+    if (!*root) {
+	if (!alloc)
+	    return NULL;
+	*root = (void **) calloc(PT_SIZE, sizeof(void *));
+    }
+    table = *root;
+    for (level = PT_LEVELS-1; level > 0; level--) {
+	i = (tag >> (level * PT_BITS)) & (PT_SIZE-1);
+	if (!table[i]) {
+	    if (!alloc)
+		return NULL;
+	    table[i] = calloc(PT_SIZE, sizeof(void *));
+	}
+	table = (void **) table[i];
+    }
+    return &table[tag & (PT_SIZE-1)];
+}
+
+byte_t *find_page(mem_t m, word_t pos, bool_t alloc)
+{
+    word_t tag = pos >> MEM_PAGE_SHIFT;
+    void **slot = page_slot(&m->pages, tag, alloc);
+
+    if (!slot || (!*slot && !alloc))
+	return NULL;
+    if (!*slot)
+	*slot = calloc(PAGE_ALLOC, 1);
+    m->tlb_tag = tag;
+    m->tlb_page = (byte_t *) *slot;
+    return m->tlb_page;
+}
+
+/* Free table, at the given level of the page table, and all below it */
+static void free_pages(void **table, int level)
+{
+    int i;
+    if (!table)
+	return;
+    if (level > 0)
+	for (i = 0; i < PT_SIZE; i++)
+	    free_pages((void **) table[i], level-1);
+    else
+	for (i = 0; i < PT_SIZE; i++)
+	    free(table[i]);
+    free((void *) table);
+}
+
+static void **copy_pages(void **table, int level)
+{
+    void **result;
+    int i;
+    if (!table)
+	return NULL;
+    result = (void **) calloc(PT_SIZE, sizeof(void *));
+    for (i = 0; i < PT_SIZE; i++) {
+	if (!table[i])
+	    continue;
+	if (level > 0)
+	    result[i] = copy_pages((void **) table[i], level-1);
+	else {
+	    result[i] = malloc(PAGE_ALLOC);
+	    memcpy(result[i], table[i], PAGE_ALLOC);
+	}
+    }
     return result;
 }
 
+/* Bytes of contents in page p */
+static int page_len(mem_t m, word_t p)
+{
+    word_t left = m->len - (p << MEM_PAGE_SHIFT);
+    return left < MEM_PAGE_SIZE ? left : MEM_PAGE_SIZE;
+}
+
+static void touch_page(mem_t m, word_t pos);
+static uword_t hash_mem(mem_t m);
+
+/* Prepare each page below page table, at the given level and covering
+   page numbers beginning with prefix, for writing */
+static void prepare_pages(mem_t m, void **table, int level, word_t prefix)
+{
+    int i;
+    if (!table)
+	return;
+    for (i = 0; i < PT_SIZE; i++) {
+	word_t tag = (prefix << PT_BITS) | i;
+	word_t pos = tag << MEM_PAGE_SHIFT;
+	if (!table[i])
+	    continue;
+	if (level > 0)
+	    prepare_pages(m, (void **) table[i], level-1, tag);
+	else
+	    touch_page(m, pos > m->len ? pos : m->len);
+    }
+}
+
 void clear_mem(mem_t m)
 {
-    memset(m->contents, 0, m->len);
+    word_t p;
+    /* Only written pages need clearing */
+    for (p = 0; p < CONTENTS_PAGES(m->len); p++)
+	if (m->page_gen[p]) {
+	    touch_page(m, p << MEM_PAGE_SHIFT);
+	    memset(m->contents + (p << MEM_PAGE_SHIFT), 0,
+		   page_len(m, p));
+	    m->page_gen[p] = 0;
+	}
+    flush_icache(m);
+    /* Snapshots may still need the pages */
+    if (m->snaps)
+	prepare_pages(m, m->pages, PT_LEVELS-1, 0);
+    free_pages(m->pages, PT_LEVELS-1);
+    m->pages = NULL;
+    m->tlb_tag = -1;
+    m->hash = 0;
 }
 
 void free_mem(mem_t m)
 {
-    free((void *) m->contents);
+    if (m->port) {
+	flush_port(m);
+	free((void *) m->port);
+    }
+    while (m->snaps)
+	free_mem_snap(m->snaps);
+    if (m->mapped)
+	munmap(m->contents, m->mapped);
+    else {
+	free((void *) m->icache);
+	free((void *) m->icache_blocks);
+	if (m->anon)
+	    munmap(m->contents, m->anon);
+	else
+	    free((void *) m->contents);
+    }
+    free((void *) m->page_gen);
+    free_pages(m->pages, PT_LEVELS-1);
     free((void *) m);
 }
 
 mem_t copy_mem(mem_t oldm)
 {
-    mem_t newm = init_mem(oldm->len);
-    memcpy(newm->contents, oldm->contents, oldm->len);
+    mem_t newm = init_sparse_mem(oldm->len, oldm->size);
+    word_t p;
+    /* Pages never written are already zero in the new memory */
+    for (p = 0; p < CONTENTS_PAGES(oldm->len); p++)
+	if (oldm->page_gen[p])
+	    memcpy(newm->contents + (p << MEM_PAGE_SHIFT),
+		   oldm->contents + (p << MEM_PAGE_SHIFT), page_len(oldm, p));
+    memcpy(newm->page_gen, oldm->page_gen,
+	   CONTENTS_PAGES(oldm->len) * sizeof(word_t));
+    newm->gen = oldm->gen;
+    newm->pages = copy_pages(oldm->pages, PT_LEVELS-1);
+    newm->hashing = oldm->hashing;
+    newm->hash = oldm->hash;
     return newm;
 }
 
+/************** Snapshots *****************/
+
+/* Entry in snapshot s for the saved copy of the page holding pos.  NULL
+   if there is none, unless alloc is set */
+static byte_t **snap_slot(mem_snap_t s, word_t pos, bool_t alloc)
+{
+    if (pos < s->m->len)
+	return &s->saved[pos >> MEM_PAGE_SHIFT];
+    return (byte_t **) page_slot(&s->pages, pos >> MEM_PAGE_SHIFT, alloc);
+}
+
+/* Copy of the page holding pos as it was when s was taken, or NULL if
+   the memory still has it */
+static byte_t *snap_page(mem_snap_t s, word_t pos)
+{
+    for (; s; s = s->newer) {
+	byte_t **slot = snap_slot(s, pos, FALSE);
+	if (slot && *slot)
+	    return *slot;
+    }
+    return NULL;
+}
+
+/* Generation of the page holding pos, 0 if it has none */
+static word_t gen_at(mem_t m, word_t pos)
+{
+    byte_t *page;
+    if (pos < 0 || pos >= m->size)
+	return 0;
+    if (pos < m->len)
+	return m->page_gen[pos >> MEM_PAGE_SHIFT];
+    page = find_page(m, pos, FALSE);
+    return page ? *PAGE_GEN(page) : 0;
+}
+
+bool_t mem_read_only(mem_t m, word_t pos, int len)
+{
+    return gen_at(m, pos) == GEN_READ_ONLY ||
+	gen_at(m, pos + len - 1) == GEN_READ_ONLY;
+}
+
+/* prepare_write for pages that may be read-only */
+static void touch_page(mem_t m, word_t pos)
+{
+    mem_snap_t s = m->snaps;
+    byte_t *page;
+    word_t *genp;
+    int len;
+
+    if (pos < m->len) {
+	word_t p = pos >> MEM_PAGE_SHIFT;
+	page = m->contents + (p << MEM_PAGE_SHIFT);
+	genp = &m->page_gen[p];
+	len = page_len(m, p);
+    } else {
+	page = find_page(m, pos, TRUE);
+	genp = PAGE_GEN(page);
+	len = MEM_PAGE_SIZE;
+    }
+    /* Not written since the newest snapshot was taken */
+    if (s && *genp <= s->gen) {
+	byte_t **slot = snap_slot(s, pos, TRUE);
+	if (!*slot) {
+	    *slot = (byte_t *) malloc(MEM_PAGE_SIZE);
+	    memcpy(*slot, page, len);
+	}
+    }
+    *genp = m->gen;
+}
+
+bool_t prepare_write(mem_t m, word_t pos)
+{
+    if (gen_at(m, pos) == GEN_READ_ONLY)
+	return FALSE;
+    touch_page(m, pos);
+    return TRUE;
+}
+
+mem_snap_t snapshot_mem(mem_t m)
+{
+    mem_snap_t s = (mem_snap_t) malloc(sizeof(mem_snap_rec));
+    s->m = m;
+    s->gen = m->gen++;
+    s->older = m->snaps;
+    s->newer = NULL;
+    s->saved = (byte_t **) calloc(CONTENTS_PAGES(m->len), sizeof(byte_t *));
+    s->pages = NULL;
+    s->hashed = m->hashing;
+    s->hash = m->hash;
+    if (m->snaps)
+	m->snaps->newer = s;
+    m->snaps = s;
+    return s;
+}
+
+/* Write copy back to the page holding pos */
+static void restore_page(mem_t m, word_t pos, byte_t *copy)
+{
+    touch_page(m, pos);
+    if (pos < m->len)
+	memcpy(m->contents + pos, copy, page_len(m, pos >> MEM_PAGE_SHIFT));
+    else
+	memcpy(find_page(m, pos, TRUE), copy, MEM_PAGE_SIZE);
+    if (m->icache && pos - (MAX_INSTR_LEN-1) < m->len)
+	invalidate_icache(m, pos, MEM_PAGE_SIZE);
+}
+
+/* Restore the pages saved below page table of a snapshot, at the given
+   level and covering page numbers beginning with prefix */
+static void restore_pages(mem_t m, void **table, int level, word_t prefix)
+{
+    int i;
+    if (!table)
+	return;
+    for (i = 0; i < PT_SIZE; i++) {
+	word_t tag = (prefix << PT_BITS) | i;
+	word_t pos = tag << MEM_PAGE_SHIFT;
+	if (!table[i])
+	    continue;
+	if (level > 0)
+	    restore_pages(m, (void **) table[i], level-1, tag);
+	else
+	    restore_page(m, pos > m->len ? pos : m->len, (byte_t *) table[i]);
+    }
+}
+
+void restore_mem(mem_snap_t s)
+{
+    mem_t m = s->m;
+    mem_snap_t t;
+    word_t p;
+    /* Only pages saved by s or newer snapshots have changed.  Going
+       from the newest back to s leaves each page as s finds it */
+    for (t = m->snaps; t != s->older; t = t->older) {
+	for (p = 0; p < CONTENTS_PAGES(m->len); p++)
+	    if (t->saved[p])
+		restore_page(m, p << MEM_PAGE_SHIFT, t->saved[p]);
+	restore_pages(m, t->pages, PT_LEVELS-1, 0);
+    }
+    if (m->hashing)
+	m->hash = s->hashed ? s->hash : hash_mem(m);
+}
+
+/* Hand the pages below page table of a snapshot being freed to older
+   snapshot o, where it has none of its own, and free the rest */
+static void pass_pages(mem_snap_t o, void **table, int level, word_t prefix)
+{
+    int i;
+    if (!table)
+	return;
+    for (i = 0; i < PT_SIZE; i++) {
+	word_t tag = (prefix << PT_BITS) | i;
+	void **slot;
+	if (!table[i])
+	    continue;
+	if (level > 0) {
+	    pass_pages(o, (void **) table[i], level-1, tag);
+	    continue;
+	}
+	slot = o ? page_slot(&o->pages, tag, TRUE) : NULL;
+	if (slot && !*slot)
+	    *slot = table[i];
+	else
+	    free(table[i]);
+    }
+    free((void *) table);
+}
+
+void free_mem_snap(mem_snap_t s)
+{
+    mem_t m = s->m;
+    mem_snap_t o = s->older;
+    word_t p;
+
+    /* The next older snapshot looks here for pages it did not save */
+    for (p = 0; p < CONTENTS_PAGES(m->len); p++) {
+	if (!s->saved[p])
+	    continue;
+	if (o && !o->saved[p])
+	    o->saved[p] = s->saved[p];
+	else
+	    free((void *) s->saved[p]);
+    }
+    pass_pages(o, s->pages, PT_LEVELS-1, 0);
+
+    if (s->newer)
+	s->newer->older = o;
+    else
+	m->snaps = o;
+    if (o)
+	o->newer = s->newer;
+    free((void *) s->saved);
+    free((void *) s);
+}
+
+/* Sum of hash_word over the words of the pages below page table, at the
+   given level and covering page numbers beginning with prefix */
+static uword_t hash_pages(mem_t m, void **table, int level, word_t prefix)
+{
+    uword_t h = 0;
+    int i, j;
+    if (!table)
+	return 0;
+    for (i = 0; i < PT_SIZE; i++) {
+	word_t tag = (prefix << PT_BITS) | i;
+	word_t pos = tag << MEM_PAGE_SHIFT;
+	word_t *words = (word_t *) table[i];
+	if (!table[i])
+	    continue;
+	if (level > 0) {
+	    h += hash_pages(m, (void **) table[i], level-1, tag);
+	    continue;
+	}
+	/* Words below len are in the contents */
+	for (j = 0; j < MEM_PAGE_SIZE / 8; j++)
+	    if (pos + 8*j >= m->len)
+		h += hash_word(pos + 8*j, words[j]);
+    }
+    return h;
+}
+
+/* Hash of the whole of m */
+static uword_t hash_mem(mem_t m)
+{
+    uword_t h = 0;
+    word_t p, pos;
+    word_t w;
+    /* Pages never written hold only zeros, which add nothing */
+    for (p = 0; p < CONTENTS_PAGES(m->len); p++) {
+	word_t end = (p << MEM_PAGE_SHIFT) + page_len(m, p);
+	if (!m->page_gen[p])
+	    continue;
+	for (pos = p << MEM_PAGE_SHIFT; pos < end; pos += 8) {
+	    get_word_val(m, pos, &w);
+	    h += hash_word(pos, w);
+	}
+    }
+    return h + hash_pages(m, m->pages, PT_LEVELS-1, 0);
+}
+
+void start_mem_hash(mem_t m)
+{
+    m->hash = hash_mem(m);
+    m->hashing = TRUE;
+}
+
+word_t parse_mem_size(char *str)
+{
+    char *end;
+    uword_t size = strtoull(str, &end, 0);
+    int shift = 0;
+    switch (*end) {
+    case 'k': case 'K':
+	shift = 10;
+	break;
+    case 'm': case 'M':
+	shift = 20;
+	break;
+    case 'g': case 'G':
+	shift = 30;
+	break;
+    case 't': case 'T':
+	shift = 40;
+	break;
+    case '\0':
+	break;
+    default:
+	return 0;
+    }
+    if (shift && end[1] != '\0')
+	return 0;
+    /* Addresses are nonnegative words */
+    if (end == str || size == 0 || size > ((uword_t) 1 << (62 - shift)))
+	return 0;
+    return size << shift;
+}
+
+dinstr_ptr icache_entry(mem_t m, word_t pos)
+{
+    if (pos < 0 || pos >= m->len)
+	return NULL;
+    if (!m->icache) {
+	m->icache = (dinstr_ptr) calloc(m->len, sizeof(dinstr_rec));
+	m->icache_blocks =
+	    (byte_t *) calloc((m->len >> ICACHE_BLOCK_SHIFT) + 1, 1);
+    }
+    /* An instruction spans at most two blocks */
+    m->icache_blocks[pos >> ICACHE_BLOCK_SHIFT] = 1;
+    m->icache_blocks[(pos + MAX_INSTR_LEN-1) >> ICACHE_BLOCK_SHIFT] = 1;
+    return &m->icache[pos];
+}
+
+void invalidate_icache(mem_t m, word_t pos, int cnt)
+{
+    /* An instruction starting up to MAX_INSTR_LEN-1 bytes before pos
+       can extend into the written range */
+    word_t lo = pos - (MAX_INSTR_LEN-1);
+    word_t hi = pos + cnt;
+    if (!m->icache)
+	return;
+    if (lo < 0)
+	lo = 0;
+    if (hi > m->len)
+	hi = m->len;
+    if (lo >= hi)
+	return;
+    /* Every entry marks the block it starts in, so blocks that were
+       never filled can be skipped */
+    while (lo < hi) {
+	word_t end = ((lo >> ICACHE_BLOCK_SHIFT) + 1) << ICACHE_BLOCK_SHIFT;
+	if (end > hi)
+	    end = hi;
+	if (m->icache_blocks[lo >> ICACHE_BLOCK_SHIFT]) {
+	    for (; lo < end; lo++) {
+		m->icache[lo].valid = FALSE;
+		m->icache[lo].handler = NULL;
+	    }
+	}
+	lo = end;
+    }
+}
+
+void flush_icache(mem_t m)
+{
+    if (!m->icache)
+	return;
+    memset(m->icache, 0, m->len * sizeof(dinstr_rec));
+    memset(m->icache_blocks, 0, (m->len >> ICACHE_BLOCK_SHIFT) + 1);
+}
+
+/* Round n up to a whole number of pages */
+static size_t page_round(size_t n)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (n + page - 1) / page * page;
+}
+
+/*
+  An image file holds, each starting on a page boundary, the memory
+  contents, the decode cache and the decode cache block flags
+*/
+static size_t icache_offset(int len)
+{
+    return page_round(len);
+}
+
+static size_t blocks_offset(int len)
+{
+    return icache_offset(len) + page_round(len * sizeof(dinstr_rec));
+}
+
+mem_image_t save_mem_image(mem_t m, word_t code_end)
+{
+    mem_image_t img;
+    size_t nblocks = (m->len >> ICACHE_BLOCK_SHIFT) + 1;
+    word_t pos;
+
+    icache_entry(m, 0);
+    if (code_end > m->len)
+	code_end = m->len;
+    for (pos = 0; pos < code_end; pos++)
+	decode_instr(m, pos);
+
+    img = (mem_image_t) malloc(sizeof(mem_image_rec));
+    img->len = m->len;
+    img->size = blocks_offset(m->len) + page_round(nblocks);
+    img->mem_size = m->size;
+    img->gen = m->gen;
+    img->page_gen = (word_t *) malloc(CONTENTS_PAGES(m->len) * sizeof(word_t));
+    memcpy(img->page_gen, m->page_gen,
+	   CONTENTS_PAGES(m->len) * sizeof(word_t));
+    img->pages = copy_pages(m->pages, PT_LEVELS-1);
+    img->file = tmpfile();
+    if (!img->file ||
+	ftruncate(fileno(img->file), img->size) != 0 ||
+	pwrite(fileno(img->file), m->contents, m->len, 0) != m->len ||
+	pwrite(fileno(img->file), m->icache, m->len * sizeof(dinstr_rec),
+	       icache_offset(m->len)) != m->len * sizeof(dinstr_rec) ||
+	pwrite(fileno(img->file), m->icache_blocks, nblocks,
+	       blocks_offset(m->len)) != nblocks) {
+	free_mem_image(img);
+	return NULL;
+    }
+    return img;
+}
+
+mem_t map_mem_image(mem_image_t img)
+{
+    byte_t *base = mmap(NULL, img->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE, fileno(img->file), 0);
+    mem_t m;
+    if (base == MAP_FAILED)
+	return NULL;
+    m = (mem_t) malloc(sizeof(mem_rec));
+    m->len = img->len;
+    m->contents = base;
+    m->icache = (dinstr_ptr) (base + icache_offset(img->len));
+    m->icache_blocks = base + blocks_offset(img->len);
+    m->gen = img->gen;
+    m->page_gen = (word_t *) malloc(CONTENTS_PAGES(img->len) * sizeof(word_t));
+    memcpy(m->page_gen, img->page_gen,
+	   CONTENTS_PAGES(img->len) * sizeof(word_t));
+    m->snaps = NULL;
+    m->mapped = img->size;
+    m->anon = 0;
+    m->port = NULL;
+    m->size = img->mem_size;
+    m->pages = copy_pages(img->pages, PT_LEVELS-1);
+    m->tlb_tag = -1;
+    m->tlb_page = NULL;
+    m->hashing = FALSE;
+    m->hash = 0;
+    return m;
+}
+
+void free_mem_image(mem_image_t img)
+{
+    if (img->file)
+	fclose(img->file);
+    free((void *) img->page_gen);
+    free_pages(img->pages, PT_LEVELS-1);
+    free((void *) img);
+}
+
+/* Contents of a page that was never written */
+static byte_t zero_page[MEM_PAGE_SIZE];
+
+/************** Host files *****************/
+
+/* Split arg of the form "file@addr" or, if lenp is nonnull,
+   "file@addr:len", where len is a size as for parse_mem_size.  Return
+   the file name, which the caller frees, or NULL if arg is malformed */
+static char *split_mem_file(char *arg, word_t *addrp, word_t *lenp)
+{
+    char *at = strrchr(arg, '@');
+    char *end;
+    char *name;
+
+    if (!at || at == arg)
+	return NULL;
+    *addrp = strtoll(at + 1, &end, 0);
+    if (end == at + 1)
+	return NULL;
+    if (lenp) {
+	if (*end != ':' || !(*lenp = parse_mem_size(end + 1)))
+	    return NULL;
+    } else if (*end != '\0')
+	return NULL;
+    name = (char *) malloc(at - arg + 1);
+    memcpy(name, arg, at - arg);
+    name[at - arg] = '\0';
+    return name;
+}
+
+/* Move the contents into an anonymous mapping, so that files can be
+   mapped over it.  Return FALSE if that is not possible */
+static bool_t anon_contents(mem_t m)
+{
+    size_t size = page_round(m->len);
+    byte_t *base;
+    word_t p;
+
+    if (m->anon)
+	return TRUE;
+    if (m->mapped || size == 0)
+	return FALSE;
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+	return FALSE;
+    /* Pages never written are already zero */
+    for (p = 0; p < CONTENTS_PAGES(m->len); p++)
+	if (m->page_gen[p])
+	    memcpy(base + (p << MEM_PAGE_SHIFT),
+		   m->contents + (p << MEM_PAGE_SHIFT), page_len(m, p));
+    free((void *) m->contents);
+    m->contents = base;
+    m->anon = size;
+    return TRUE;
+}
+
+bool_t map_mem_file(mem_t m, char *arg, bool_t writable)
+{
+    word_t addr, end, pos;
+    struct stat st;
+    char *name = split_mem_file(arg, &addr, NULL);
+    int fd = -1;
+
+    if (!name) {
+	fprintf(stderr, "Invalid file mapping '%s'\n", arg);
+	return FALSE;
+    }
+    fd = open(name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+	fprintf(stderr, "Can't open file '%s'\n", name);
+	goto fail;
+    }
+    end = addr + st.st_size;
+    if (addr < 0 || addr % page_round(1) || addr % MEM_PAGE_SIZE ||
+	end > m->size) {
+	fprintf(stderr, "Can't map file '%s' at 0x%llx\n", name, addr);
+	goto fail;
+    }
+
+    /* The part within the contents is mapped in place */
+    if (addr < m->len && end > addr) {
+	word_t cend = end < m->len ? end : m->len;
+	if (!anon_contents(m)) {
+	    fprintf(stderr, "Can't map file '%s' into memory\n", name);
+	    goto fail;
+	}
+	for (pos = addr; pos < cend; pos += MEM_PAGE_SIZE)
+	    touch_page(m, pos);
+	if (mmap(m->contents + addr, cend - addr, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+	    fprintf(stderr, "Can't map file '%s' into memory\n", name);
+	    goto fail;
+	}
+	if (!writable)
+	    for (pos = addr; pos < cend; pos += MEM_PAGE_SIZE)
+		m->page_gen[pos >> MEM_PAGE_SHIFT] = GEN_READ_ONLY;
+	if (m->icache)
+	    invalidate_icache(m, addr, cend - addr);
+    }
+
+    /* Beyond the contents it is read into pages */
+    for (pos = addr > m->len ? addr : m->len; pos < end;
+	 pos = (pos | (MEM_PAGE_SIZE-1)) + 1) {
+	word_t off = pos & (MEM_PAGE_SIZE-1);
+	word_t n = MEM_PAGE_SIZE - off;
+	byte_t *page;
+	if (n > end - pos)
+	    n = end - pos;
+	touch_page(m, pos);
+	page = find_page(m, pos, TRUE);
+	if (pread(fd, page + off, n, pos - addr) != n) {
+	    fprintf(stderr, "Can't read file '%s'\n", name);
+	    goto fail;
+	}
+	memset(page + off + n, 0, MEM_PAGE_SIZE - off - n);
+	if (!writable)
+	    *PAGE_GEN(page) = GEN_READ_ONLY;
+	if (m->icache && pos - (MAX_INSTR_LEN-1) < m->len)
+	    invalidate_icache(m, pos, n);
+    }
+    close(fd);
+    free((void *) name);
+    if (m->hashing)
+	m->hash = hash_mem(m);
+    return TRUE;
+
+ fail:
+    if (m->hashing)
+	m->hash = hash_mem(m);
+    if (fd >= 0)
+	close(fd);
+    free((void *) name);
+    return FALSE;
+}
+
+bool_t save_mem_file(mem_t m, char *arg)
+{
+    word_t addr, len, pos;
+    char *name = split_mem_file(arg, &addr, &len);
+    FILE *f;
+
+    if (!name) {
+	fprintf(stderr, "Invalid output file '%s'\n", arg);
+	return FALSE;
+    }
+    if (addr < 0 || addr > m->size - len) {
+	fprintf(stderr, "Can't save 0x%llx bytes at 0x%llx\n", len, addr);
+	free((void *) name);
+	return FALSE;
+    }
+    f = fopen(name, "w");
+    if (!f) {
+	fprintf(stderr, "Can't write file '%s'\n", name);
+	free((void *) name);
+	return FALSE;
+    }
+    for (pos = addr; pos < addr + len; ) {
+	word_t n;
+	byte_t *src;
+	if (pos < m->len) {
+	    n = m->len - pos;
+	    src = m->contents + pos;
+	} else {
+	    byte_t *page = find_page(m, pos, FALSE);
+	    word_t off = pos & (MEM_PAGE_SIZE-1);
+	    n = MEM_PAGE_SIZE - off;
+	    src = page ? page + off : zero_page;
+	}
+	if (n > addr + len - pos)
+	    n = addr + len - pos;
+	if (fwrite(src, 1, n, f) != n)
+	    break;
+	pos += n;
+    }
+    if (fclose(f) != 0 || pos < addr + len) {
+	fprintf(stderr, "Can't write file '%s'\n", name);
+	free((void *) name);
+	return FALSE;
+    }
+    free((void *) name);
+    return TRUE;
+}
+
+/************** Output port *****************/
+
+void attach_port(mem_t m, FILE *out)
+{
+    if (!m->port)
+	m->port = (out_port_t) malloc(sizeof(out_port_rec));
+    m->port->out = out;
+    m->port->len = 0;
+}
+
+void flush_port(mem_t m)
+{
+    if (!m->port || m->port->len == 0)
+	return;
+    if (m->port->out) {
+	fwrite(m->port->buf, 1, m->port->len, m->port->out);
+	fflush(m->port->out);
+    }
+    m->port->len = 0;
+}
+
+/*
+  Compare memory a block of CMP_BLOCK bytes at a time.  With GCC on
+  x86-64, same_prefix is compiled for AVX2 and for the baseline SSE2
+  instruction set, and the version to use is chosen from the CPUID
+  flags when the program starts.
+*/
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) && \
+    defined(__linux__)
+#define CMP_TARGETS __attribute__ ((target_clones("avx2", "default")))
+#else
+#define CMP_TARGETS
+#endif
+
+#define CMP_BLOCK 64
+
+typedef uword_t cmp_vec_t __attribute__ ((vector_size (32)));
+
+/* Return number of leading bytes of a and b, up to len, that are the
+   same, counted in whole blocks */
+CMP_TARGETS
+static word_t same_prefix(byte_t *a, byte_t *b, word_t len)
+{
+    word_t pos;
+    for (pos = 0; pos + CMP_BLOCK <= len; pos += CMP_BLOCK) {
+	cmp_vec_t a0, a1, b0, b1, d;
+	memcpy(&a0, a + pos, sizeof(a0));
+	memcpy(&a1, a + pos + sizeof(a0), sizeof(a1));
+	memcpy(&b0, b + pos, sizeof(b0));
+	memcpy(&b1, b + pos + sizeof(b0), sizeof(b1));
+	d = (a0 ^ b0) | (a1 ^ b1);
+	if (d[0] | d[1] | d[2] | d[3])
+	    break;
+    }
+    return pos;
+}
+
+/* Print the differences, from address start on, between the words of
+   oldm and newm in the pages below page tables ot and nt.  The tables
+   are at the given level, and cover page numbers beginning with
+   prefix */
+static bool_t diff_pages(mem_t oldm, mem_t newm, void **ot, void **nt,
+			 int level, word_t prefix, word_t start,
+			 FILE *outfile)
+{
+    bool_t diff = FALSE;
+    int i;
+    for (i = 0; (!diff || outfile) && i < PT_SIZE; i++) {
+	void **o = ot ? (void **) ot[i] : NULL;
+	void **n = nt ? (void **) nt[i] : NULL;
+	word_t tag = (prefix << PT_BITS) | i;
+	word_t pos = tag << MEM_PAGE_SHIFT;
+	word_t checked = pos;	/* Blocks below here were compared */
+	byte_t *ob = o ? (byte_t *) o : zero_page;
+	byte_t *nb = n ? (byte_t *) n : zero_page;
+	if (!o && !n)
+	    continue;
+	if (level > 0) {
+	    if (diff_pages(oldm, newm, o, n, level-1, tag, start, outfile))
+		diff = TRUE;
+	    continue;
+	}
+	if (pos < start)
+	    pos += (start - pos + 7) & ~7;
+	for (; (!diff || outfile) && pos < (tag+1) << MEM_PAGE_SHIFT;
+	     pos += 8) {
+	    word_t ov = 0;  word_t nv = 0;
+	    if (pos >= checked) {
+		word_t off = pos & (MEM_PAGE_SIZE-1);
+		word_t same = same_prefix(ob + off, nb + off,
+					  MEM_PAGE_SIZE - off);
+		if (same) {
+		    pos += same - 8;
+		    continue;
+		}
+		checked = pos + CMP_BLOCK;
+	    }
+	    get_word_val(oldm, pos, &ov);
+	    get_word_val(newm, pos, &nv);
+	    if (nv != ov) {
+		diff = TRUE;
+		if (outfile)
+		    fprintf(outfile, "0x%.4llx:\t0x%.16llx\t0x%.16llx\n",
+			    pos, ov, nv);
+	    }
+	}
+    }
+    return diff;
+}
+
+/* Has either memory written the page of contents holding pos? */
+static bool_t page_dirty(mem_t oldm, mem_t newm, word_t pos)
+{
+    return oldm->page_gen[pos >> MEM_PAGE_SHIFT] ||
+	newm->page_gen[pos >> MEM_PAGE_SHIFT];
+}
+
 #ifdef SNU
 bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile, word_t start_addr)
 #else
@@ -171,16 +1079,36 @@ bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile)
 #endif
 {
     word_t pos;
+    word_t checked = 0;	/* Blocks below here were compared */
     int len = oldm->len;
     bool_t diff = FALSE;
+#ifndef SNU
+    word_t start_addr = 0;
+#endif
     if (newm->len < len)
 	len = newm->len;
-#ifdef SNU
     for (pos = start_addr; (!diff || outfile) && pos < len; pos += 8) {
-#else
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8) {
-#endif
         word_t ov = 0;  word_t nv = 0;
+	if (pos >= checked && pos + 7 < len) {
+	    /* Skip the words in this page that lie within bytes known to
+	       be the same */
+	    word_t end = (pos | (MEM_PAGE_SIZE-1)) + 1;
+	    word_t same;
+	    if (end > len)
+		end = len;
+	    if (!page_dirty(oldm, newm, pos) &&
+		!page_dirty(oldm, newm, pos + 7))
+		/* Both memories are zero here */
+		same = end - pos;
+	    else
+		same = same_prefix(oldm->contents + pos,
+				   newm->contents + pos, end - pos);
+	    if (same >= 8) {
+		pos += (same - 8) & ~7;
+		continue;
+	    }
+	    checked = pos + CMP_BLOCK;
+	}
 	get_word_val(oldm, pos, &ov);
 	get_word_val(newm, pos, &nv);
 	if (nv != ov) {
@@ -189,6 +1117,146 @@ bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile)
 		fprintf(outfile, "0x%.4llx:\t0x%.16llx\t0x%.16llx\n", pos, ov, nv);
 	}
     }
+    if ((!diff || outfile) && (oldm->pages || newm->pages) &&
+	diff_pages(oldm, newm, oldm->pages, newm->pages, PT_LEVELS-1, 0,
+		   start_addr > len ? start_addr : len, outfile))
+	diff = TRUE;
+    return diff;
+}
+
+/* Positions of pages saved in snapshots */
+typedef struct {
+    word_t *pos;
+    int cnt;
+    int size;
+} pos_list;
+
+static void add_pos(pos_list *l, word_t pos)
+{
+    if (l->cnt == l->size) {
+	l->size = l->size ? 2 * l->size : 64;
+	l->pos = (word_t *) realloc(l->pos, l->size * sizeof(word_t));
+    }
+    l->pos[l->cnt++] = pos;
+}
+
+/* Add the first address held in each page below page table of a
+   snapshot of m, at the given level and covering page numbers beginning
+   with prefix */
+static void add_page_pos(pos_list *l, mem_t m, void **table, int level,
+			 word_t prefix)
+{
+    int i;
+    if (!table)
+	return;
+    for (i = 0; i < PT_SIZE; i++) {
+	word_t tag = (prefix << PT_BITS) | i;
+	word_t pos = tag << MEM_PAGE_SHIFT;
+	if (!table[i])
+	    continue;
+	if (level > 0)
+	    add_page_pos(l, m, (void **) table[i], level-1, tag);
+	else
+	    add_pos(l, pos > m->len ? pos : m->len);
+    }
+}
+
+static int cmp_pos(const void *a, const void *b)
+{
+    word_t x = *(const word_t *) a;
+    word_t y = *(const word_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Get word at pos as it was when s was taken */
+static bool_t snap_word(mem_snap_t s, word_t pos, word_t *dest)
+{
+    word_t val = 0;
+    int i;
+    if (pos < 0 || pos > s->m->size - 8)
+	return FALSE;
+    for (i = 7; i >= 0; i--) {
+	byte_t *copy = snap_page(s, pos+i);
+	byte_t b;
+	if (copy)
+	    b = copy[(pos+i) & (MEM_PAGE_SIZE-1)];
+	else
+	    get_byte_val(s->m, pos+i, &b);
+	val = (val << 8) | b;
+    }
+    *dest = val;
+    return TRUE;
+}
+
+bool_t diff_mem_snap(mem_snap_t s, FILE *outfile, word_t start_addr,
+		     bool_t reverse)
+{
+    mem_t m = s->m;
+    pos_list l = { NULL, 0, 0 };
+    mem_snap_t t;
+    word_t next = start_addr;	/* Next word of contents to compare */
+    bool_t diff = FALSE;
+    int k;
+
+    /* Only pages saved by s or newer snapshots can differ */
+    for (t = s; t; t = t->newer) {
+	word_t p;
+	for (p = 0; p < CONTENTS_PAGES(m->len); p++)
+	    if (t->saved[p])
+		add_pos(&l, p << MEM_PAGE_SHIFT);
+	add_page_pos(&l, m, t->pages, PT_LEVELS-1, 0);
+    }
+    qsort(l.pos, l.cnt, sizeof(word_t), cmp_pos);
+
+    /* Compare the same words as diff_mem would, in the same order */
+    for (k = 0; (!diff || outfile) && k < l.cnt; k++) {
+	word_t a = l.pos[k];
+	word_t base = a & ~(word_t) (MEM_PAGE_SIZE-1);
+	word_t b, pos, checked;
+	byte_t *old, *cur;
+	if (k > 0 && a == l.pos[k-1])
+	    continue;
+	old = snap_page(s, a);
+	if (a < m->len) {
+	    /* Words of contents from start_addr on that overlap the page */
+	    b = base + page_len(m, a >> MEM_PAGE_SHIFT);
+	    cur = m->contents + base;
+	    pos = next;
+	    if (pos < a - 7)
+		pos += (a - pos) & ~7;
+	} else {
+	    b = base + MEM_PAGE_SIZE;
+	    cur = find_page(m, a, FALSE);
+	    if (!cur)
+		cur = zero_page;
+	    pos = a;
+	    if (pos < start_addr)
+		pos += (start_addr - pos + 7) & ~7;
+	}
+	for (checked = pos; (!diff || outfile) && pos < b; pos += 8) {
+	    word_t ov = 0;  word_t nv = 0;
+	    if (pos >= checked && pos >= a && pos + 8 <= b) {
+		word_t same = same_prefix(old + (pos - base), cur + (pos - base),
+					  b - pos);
+		if (same) {
+		    pos += same - 8;
+		    continue;
+		}
+		checked = pos + CMP_BLOCK;
+	    }
+	    snap_word(s, pos, &ov);
+	    get_word_val(m, pos, &nv);
+	    if (nv != ov) {
+		diff = TRUE;
+		if (outfile)
+		    fprintf(outfile, "0x%.4llx:\t0x%.16llx\t0x%.16llx\n", pos,
+			    reverse ? nv : ov, reverse ? ov : nv);
+	    }
+	}
+	if (a < m->len)
+	    next = pos;
+    }
+    free((void *) l.pos);
     return diff;
 }
 
@@ -203,114 +1271,384 @@ int hex2dig(char c)
 }
 
 #define LINELEN 4096
-int load_mem(mem_t m, FILE *infile, int report_error)
+
+/* Copy n bytes from src to memory starting at pos, a page at a time.
+   Return the number copied, which is less than n if a page is
+   read-only */
+static word_t copy_to_mem(mem_t m, word_t pos, byte_t *src, word_t n)
+{
+    word_t done = 0;
+    while (done < n) {
+	word_t off = pos & (MEM_PAGE_SIZE-1);
+	word_t cnt = MEM_PAGE_SIZE - off;
+	byte_t *dest;
+	if (cnt > n - done)
+	    cnt = n - done;
+	if (pos < m->len) {
+	    if (cnt > m->len - pos)
+		cnt = m->len - pos;
+	    if (!PAGE_READY(m, pos) && !prepare_write(m, pos))
+		break;
+	    dest = m->contents + pos;
+	} else {
+	    dest = (pos >> MEM_PAGE_SHIFT) == m->tlb_tag ? m->tlb_page :
+		find_page(m, pos, TRUE);
+	    if (*PAGE_GEN(dest) != m->gen && !prepare_write(m, pos))
+		break;
+	    dest += off;
+	}
+	memcpy(dest, src + done, cnt);
+	if (m->icache)
+	    invalidate_icache(m, pos, cnt);
+	pos += cnt;
+	done += cnt;
+    }
+    return done;
+}
+
+/* The whole of infile, mapped when it is a regular file and read in
+   otherwise.  Set *sizep, and *mappedp to tell how to release it */
+static char *map_input(FILE *infile, size_t *sizep, bool_t *mappedp)
+{
+    struct stat st;
+    char *base;
+    size_t size = 0, cap = 0, n;
+
+    if (fstat(fileno(infile), &st) == 0 && S_ISREG(st.st_mode) &&
+	st.st_size > 0) {
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		    fileno(infile), 0);
+	if (base != MAP_FAILED) {
+	    *sizep = st.st_size;
+	    *mappedp = TRUE;
+	    return base;
+	}
+    }
+    base = NULL;
+    do {
+	if (size == cap) {
+	    cap = cap ? 2 * cap : 16 * LINELEN;
+	    base = (char *) realloc(base, cap);
+	}
+	n = fread(base + size, 1, cap - size, infile);
+	size += n;
+    } while (n > 0);
+    *sizep = size;
+    *mappedp = FALSE;
+    return base;
+}
+
+static void unmap_input(char *base, size_t size, bool_t mapped)
 {
-    /* Read contents of .yo file */
-    char buf[LINELEN];
-    char c, ch, cl;
+    if (mapped)
+	munmap(base, size);
+    else
+	free((void *) base);
+}
+
+/* Load the binary object of the given size at base */
+static int load_ybo(mem_t m, char *base, size_t size, int report_error)
+{
+    ybo_header_rec *h = (ybo_header_rec *) base;
+    word_t off, i, done;
+    int byte_cnt = 0;
+
+    if (size < sizeof(ybo_header_rec) ||
+	memcmp(h->magic, YBO_MAGIC, sizeof(h->magic)) ||
+	h->version != YBO_VERSION) {
+	if (report_error)
+	    fprintf(stderr, "Error reading file. Bad binary object header\n");
+	return 0;
+    }
+    if (h->flags & YBO_RELOC) {
+	if (report_error)
+	    fprintf(stderr,
+		    "Error reading file. Relocatable object must be linked with yld\n");
+	return 0;
+    }
+    off = sizeof(ybo_header_rec);
+    for (i = 0; i < h->seg_cnt; i++) {
+	ybo_seg_rec *s = (ybo_seg_rec *) (base + off);
+	if (size - off < sizeof(ybo_seg_rec) || s->len < 0 ||
+	    s->len > size - off - sizeof(ybo_seg_rec)) {
+	    if (report_error)
+		fprintf(stderr,
+			"Error reading file. Truncated segment %lld\n", i);
+	    return 0;
+	}
+	off += sizeof(ybo_seg_rec);
+	if (s->addr < 0 || s->addr > m->size - s->len) {
+	    if (report_error)
+		fprintf(stderr,
+			"Error reading file. Invalid address. 0x%llx\n",
+			s->addr);
+	    return 0;
+	}
+	done = copy_to_mem(m, s->addr, (byte_t *) base + off, s->len);
+	if (done < s->len) {
+	    if (report_error)
+		fprintf(stderr,
+			"Error reading file. Read-only address. 0x%llx\n",
+			s->addr + done);
+	    return 0;
+	}
+	byte_cnt += s->len;
+	off += YBO_PAD(s->len);
+	if (off > size)
+	    off = size;
+    }
+#ifdef HAS_GUI
+    if (gui_mode) {
+	char hexcode[21];
+	char line[LINELEN];
+	for (i = 0; i < h->line_cnt; i++) {
+	    ybo_line_rec *l = (ybo_line_rec *) (base + off);
+	    int index = 0;
+	    word_t len;
+	    if (size - off < sizeof(ybo_line_rec))
+		break;
+	    off += sizeof(ybo_line_rec);
+	    len = l->text_len;
+	    if (len < 0 || len > size - off)
+		break;
+	    for (; index < 2 * l->cnt && index < 20; index += 2) {
+		byte_t b = 0;
+		get_byte_val(m, l->addr + index / 2, &b);
+		sprintf(hexcode + index, "%.2x", b);
+	    }
+	    for (; index < 20; index++)
+		hexcode[index] = ' ';
+	    hexcode[index] = '\0';
+	    if (len >= LINELEN)
+		len = LINELEN-1;
+	    memcpy(line, base + off, len);
+	    line[len] = '\0';
+	    report_line(i, l->addr, hexcode, line);
+	    off += YBO_PAD(l->text_len);
+	    if (off > size)
+		off = size;
+	}
+    }
+#endif /* HAS_GUI */
+    return byte_cnt;
+}
+
+/* Value of each character as a hex digit, or -1 */
+static signed char hex_table[256];
+
+#define HEX_VAL(c) hex_table[(byte_t) (c)]
+
+static void init_hex_table()
+{
+    static bool_t ready = FALSE;
+    int c;
+    if (ready)
+	return;
+    for (c = 0; c < 256; c++)
+	hex_table[c] = isxdigit(c) ? hex2dig(c) : -1;
+    ready = TRUE;
+}
+
+/* Is c white space other than the end of a line? */
+#define LINE_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || \
+		       (c) == '\f' || (c) == '\v')
+
+typedef byte_t hex_vec_t __attribute__ ((vector_size (16)));
+
+/* Decode the 16 hex digits at s into 8 bytes at dest.  Return FALSE,
+   leaving dest alone, unless all 16 characters are hex digits */
+static bool_t decode_hex16(char *s, byte_t *dest)
+{
+    hex_vec_t v, lower, digit, alpha, val;
+    uword_t bad[2];
+    int i;
+
+    memcpy(&v, s, sizeof(v));
+    lower = v | 0x20;
+    digit = (hex_vec_t) ((v >= '0') & (v <= '9'));
+    alpha = (hex_vec_t) ((lower >= 'a') & (lower <= 'f'));
+    val = ~(digit | alpha);
+    memcpy(bad, &val, sizeof(bad));
+    if (bad[0] | bad[1])
+	return FALSE;
+    val = ((v - '0') & digit) | ((lower - ('a' - 10)) & alpha);
+    for (i = 0; i < 8; i++)
+	dest[i] = (val[2*i] << 4) | val[2*i+1];
+    return TRUE;
+}
+
+/* Bytes of code decoded from one line before they are stored */
+#define CODE_BUF LINELEN
+
+/* Store the cnt bytes at code to memory at bytepos.  Return FALSE after
+   reporting the error if that fails */
+static bool_t store_code(mem_t m, word_t bytepos, byte_t *code, int cnt,
+			 int report_error, int lineno, char *line, int len)
+{
+    word_t done;
+    if (bytepos < 0 || bytepos > m->size - cnt) {
+	/* Bytes up to the end of memory are still stored */
+	if (bytepos >= 0 && bytepos < m->size)
+	    copy_to_mem(m, bytepos, code, m->size - bytepos);
+	if (report_error) {
+	    fprintf(stderr, "Error reading file. Invalid address. 0x%llx\n",
+		    bytepos < 0 || bytepos >= m->size ? bytepos : m->size);
+	    fprintf(stderr, "Line %d:%.*s\n", lineno, len, line);
+	}
+	return FALSE;
+    }
+    done = copy_to_mem(m, bytepos, code, cnt);
+    if (done < cnt) {
+	if (report_error) {
+	    fprintf(stderr,
+		    "Error reading file. Read-only address. 0x%llx\n",
+		    bytepos + done);
+	    fprintf(stderr, "Line %d:%.*s\n", lineno, len, line);
+	}
+	return FALSE;
+    }
+    return TRUE;
+}
+
+/* Load the .yo text of the given size at text.  Each line is parsed in
+   place, with hex digits looked up in hex_table and the code decoded 16
+   digits at a time where possible */
+static int load_yo(mem_t m, char *text, size_t size, int report_error)
+{
+    char *end = text + size;
+    char *p = text;
+    byte_t code[CODE_BUF];
     int byte_cnt = 0;
     int lineno = 0;
-    word_t bytepos = 0;
 #ifdef HAS_GUI
-    int empty_line = 1;
-    int addr = 0;
-    char hexcode[21];
-    /* For display */
     int line_no = 0;
-    char line[LINELEN];
-    int index = 0;
-#endif /* HAS_GUI */   
-    while (fgets(buf, LINELEN, infile)) {
-	int cpos = 0;
-#ifdef HAS_GUI
-	empty_line = 1;
 #endif
-	lineno++;
-	/* Skip white space */
-	while (isspace((int)buf[cpos]))
-	    cpos++;
 
-	if (buf[cpos] != '0' ||
-	    (buf[cpos+1] != 'x' && buf[cpos+1] != 'X'))
-	    continue; /* Skip this line */      
-	cpos+=2;
+    init_hex_table();
+    while (p < end) {
+	char *line = p;
+	char *eol = memchr(p, '\n', end - p);
+	char *next = eol ? eol + 1 : end;
+	word_t bytepos = 0;
+	int cnt = 0, line_cnt = 0;
+#ifdef HAS_GUI
+	word_t addr;
+	char *code_text;
+#endif
 
-	/* Get address */
-	bytepos = 0;
-	while (isxdigit((int)(c=buf[cpos]))) {
-	    cpos++;
-	    bytepos = bytepos*16 + hex2dig(c);
+	if (!eol)
+	    eol = end;
+	lineno++;
+	while (p < eol && LINE_SPACE(*p))
+	    p++;
+	if (eol - p < 2 || p[0] != '0' || (p[1] != 'x' && p[1] != 'X')) {
+	    p = next;
+	    continue; /* Skip this line */
 	}
+	p += 2;
 
-	while (isspace((int)buf[cpos]))
-	    cpos++;
-
-	if (buf[cpos++] != ':') {
+	/* Get address */
+	while (p < eol && HEX_VAL(*p) >= 0)
+	    bytepos = bytepos*16 + HEX_VAL(*p++);
+	while (p < eol && LINE_SPACE(*p))
+	    p++;
+	if (p == eol || *p++ != ':') {
 	    if (report_error) {
 		fprintf(stderr, "Error reading file. Expected colon\n");
-		fprintf(stderr, "Line %d:%s\n", lineno, buf);
-		fprintf(stderr,
-			"Reading '%c' at position %d\n", buf[cpos], cpos);
+		fprintf(stderr, "Line %d:%.*s\n", lineno,
+			(int) (next - line), line);
+		fprintf(stderr, "Reading '%c' at position %d\n",
+			p < eol ? *p : '\0', (int) (p - line));
 	    }
 	    return 0;
 	}
-
+	while (p < eol && LINE_SPACE(*p))
+	    p++;
 #ifdef HAS_GUI
 	addr = bytepos;
-	index = 0;
+	code_text = p;
 #endif
 
-	while (isspace((int)buf[cpos]))
-	    cpos++;
-
 	/* Get code */
-	while (isxdigit((int)(ch=buf[cpos++])) && 
-	       isxdigit((int)(cl=buf[cpos++]))) {
-	    byte_t byte = 0;
-	    if (bytepos >= m->len) {
-		if (report_error) {
-		    fprintf(stderr,
-			    "Error reading file. Invalid address. 0x%llx\n",
-			    bytepos);
-		    fprintf(stderr, "Line %d:%s\n", lineno, buf);
-		}
-		return 0;
+	for (;;) {
+	    if (cnt + 8 > CODE_BUF) {
+		if (!store_code(m, bytepos, code, cnt, report_error,
+				lineno, line, next - line))
+		    return 0;
+		bytepos += cnt;
+		cnt = 0;
 	    }
-	    byte = hex2dig(ch)*16+hex2dig(cl);
-	    m->contents[bytepos++] = byte;
-	    byte_cnt++;
-#ifdef HAS_GUI
-	    empty_line = 0;
-	    hexcode[index++] = ch;
-	    hexcode[index++] = cl;
-#endif
+	    if (eol - p >= 16 && decode_hex16(p, code + cnt)) {
+		p += 16;
+		cnt += 8;
+		line_cnt += 8;
+		continue;
+	    }
+	    /* The last few digits of the line go one byte at a time */
+	    if (p < eol && HEX_VAL(p[0]) >= 0 &&
+		p + 1 < eol && HEX_VAL(p[1]) >= 0) {
+		code[cnt++] = HEX_VAL(p[0])*16 + HEX_VAL(p[1]);
+		line_cnt++;
+		p += 2;
+		continue;
+	    }
+	    /* Step past the character that ended the code */
+	    p += (p < eol && HEX_VAL(p[0]) >= 0) ? 2 : 1;
+	    break;
 	}
+	if (cnt && !store_code(m, bytepos, code, cnt, report_error,
+			       lineno, line, next - line))
+	    return 0;
+	byte_cnt += line_cnt;
 #ifdef HAS_GUI
-	/* Fill rest of hexcode with blanks.
-	   Needs to be 2x longest instruction */
-	for (; index < 20; index++)
-	    hexcode[index] = ' ';
-	hexcode[index] = '\0';
-
-	if (gui_mode) {
-	    /* Now get the rest of the line */
-	    while (isspace((int)buf[cpos]))
-		cpos++;
-	    cpos++; /* Skip over '|' */
-	    
-	    index = 0;
-	    while ((c = buf[cpos++]) != '\0' && c != '\n') {
-		line[index++] = c;
-	    }
-	    line[index] = '\0';
-	    if (!empty_line)
-		report_line(line_no++, addr, hexcode, line);
+	if (gui_mode && line_cnt) {
+	    char hexcode[21];
+	    char buf[LINELEN];
+	    int index = 2 * line_cnt < 20 ? 2 * line_cnt : 20;
+	    int len;
+
+	    /* Fill rest of hexcode with blanks.
+	       Needs to be 2x longest instruction */
+	    memcpy(hexcode, code_text, index);
+	    for (; index < 20; index++)
+		hexcode[index] = ' ';
+	    hexcode[index] = '\0';
+
+	    /* Now get the rest of the line, after the '|' */
+	    while (p < eol && LINE_SPACE(*p))
+		p++;
+	    p++;
+	    len = p < eol ? eol - p : 0;
+	    if (len >= LINELEN)
+		len = LINELEN-1;
+	    memcpy(buf, p, len);
+	    buf[len] = '\0';
+	    report_line(line_no++, addr, hexcode, buf);
 	}
-#endif /* HAS_GUI */ 
+#endif /* HAS_GUI */
+	p = next;
     }
     return byte_cnt;
 }
 
+int load_mem(mem_t m, FILE *infile, int report_error)
+{
+    size_t size;
+    bool_t mapped;
+    char *base = map_input(infile, &size, &mapped);
+    int byte_cnt;
+
+    if (size >= sizeof(YBO_MAGIC)-1 &&
+	!memcmp(base, YBO_MAGIC, sizeof(YBO_MAGIC)-1))
+	byte_cnt = load_ybo(m, base, size, report_error);
+    else
+	byte_cnt = load_yo(m, base, size, report_error);
+    unmap_input(base, size, mapped);
+    if (m->hashing)
+	m->hash = hash_mem(m);
+    return byte_cnt;
+}
+
 void dump_memory(FILE *outfile, mem_t m, word_t pos, int len)
 {
     int i, j;
@@ -334,74 +1672,86 @@ void dump_memory(FILE *outfile, mem_t m, word_t pos, int len)
     }
 }
 
-mem_t init_reg()
+reg_t init_reg()
 {
-    return init_mem(128);
+    return (reg_t) calloc(1, sizeof(reg_rec));
 }
 
-void free_reg(mem_t r)
+void free_reg(reg_t r)
 {
-    free_mem(r);
+    free((void *) r);
 }
 
-mem_t copy_reg(mem_t oldr)
+void clear_reg(reg_t r)
 {
-    return copy_mem(oldr);
+    memset(r->regs, 0, sizeof(r->regs));
+    r->hash = 0;
 }
 
-bool_t diff_reg(mem_t oldr, mem_t newr, FILE *outfile)
+reg_t copy_reg(reg_t oldr)
 {
-    word_t pos;
-    int len = oldr->len;
+    reg_t newr = init_reg();
+    *newr = *oldr;
+    return newr;
+}
+
+bool_t diff_reg(reg_t oldr, reg_t newr, FILE *outfile)
+{
+    /* Registers in leading blocks that are the same can be skipped */
+    reg_id_t id = same_prefix((byte_t *) oldr->regs, (byte_t *) newr->regs,
+			      REG_NONE * sizeof(word_t)) / sizeof(word_t);
     bool_t diff = FALSE;
-    if (newr->len < len)
-	len = newr->len;
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8) {
-        word_t ov = 0;
-        word_t nv = 0;
-	get_word_val(oldr, pos, &ov);
-	get_word_val(newr, pos, &nv);
+    for (; (!diff || outfile) && id < REG_NONE; id++) {
+	word_t ov = oldr->regs[id];
+	word_t nv = newr->regs[id];
 	if (nv != ov) {
 	    diff = TRUE;
 	    if (outfile)
 		fprintf(outfile, "%s:\t0x%.16llx\t0x%.16llx\n",
-			reg_table[pos/8].name, ov, nv);
+			reg_table[id].name, ov, nv);
 	}
     }
     return diff;
 }
 
-word_t get_reg_val(mem_t r, reg_id_t id)
+word_t get_reg_val(reg_t r, reg_id_t id)
 {
-    word_t val = 0;
     if (id >= REG_NONE)
 	return 0;
-    get_word_val(r,id*8, &val);
-    return val;
+    return r->regs[id];
 }
 
-void set_reg_val(mem_t r, reg_id_t id, word_t val)
+void set_reg_val(reg_t r, reg_id_t id, word_t val)
 {
-    if (id < REG_NONE) {
-	set_word_val(r,id*8,val);
+    /* A write to REG_NONE lands in the sink entry */
+    if (id < REG_NONE)
+	r->hash += hash_word(HASH_REG_KEY(id), val) -
+	    hash_word(HASH_REG_KEY(id), r->regs[id]);
+    if (id <= REG_NONE)
+	r->regs[id] = val;
 #ifdef HAS_GUI
-	if (gui_mode) {
-	    signal_register_update(id, val);
-	}
-#endif /* HAS_GUI */
+    if (gui_mode && id < REG_NONE) {
+	signal_register_update(id, val);
     }
+#endif /* HAS_GUI */
 }
      
-void dump_reg(FILE *outfile, mem_t r) {
+void rehash_reg(reg_t r)
+{
+    reg_id_t id;
+    r->hash = 0;
+    for (id = REG_RAX; id < REG_NONE; id++)
+	r->hash += hash_word(HASH_REG_KEY(id), r->regs[id]);
+}
+
+void dump_reg(FILE *outfile, reg_t r) {
     reg_id_t id;
     for (id = 0; reg_valid(id); id++) {
 	fprintf(outfile, "   %s  ", reg_table[id].name);
     }
     fprintf(outfile, "\n");
     for (id = 0; reg_valid(id); id++) {
-	word_t val = 0;
-	get_word_val(r, id*8, &val);
-	fprintf(outfile, " %llx", val);
+	fprintf(outfile, " %llx", r->regs[id]);
     }
     fprintf(outfile, "\n");
 }
@@ -466,12 +1816,18 @@ state_ptr new_state(int memlen)
     result->pc = 0;
     result->r = init_reg();
     result->m = init_mem(memlen);
-    result->cc = DEFAULT_CC;
+    SET_CC(result->cc, DEFAULT_CC);
+    result->snaps = NULL;
+    result->undo = NULL;
+    result->trace = NULL;
     return result;
 }
 
 void free_state(state_ptr s)
 {
+    while (s->snaps)
+	free_snapshot(s, s->snaps);
+    stop_undo(s);
     free_reg(s->r);
     free_mem(s->m);
     free((void *) s);
@@ -483,9 +1839,20 @@ state_ptr copy_state(state_ptr s) {
     result->r = copy_reg(s->r);
     result->m = copy_mem(s->m);
     result->cc = s->cc;
+    result->snaps = NULL;
+    result->undo = NULL;
+    result->trace = NULL;
     return result;
 }
 
+uword_t state_hash(state_ptr s)
+{
+    if (!s->m->hashing)
+	start_mem_hash(s->m);
+    return s->m->hash + s->r->hash + hash_word(HASH_PC_KEY, s->pc) +
+	hash_word(HASH_CC_KEY, get_cc(&s->cc));
+}
+
 bool_t diff_state(state_ptr olds, state_ptr news, FILE *outfile) {
     bool_t diff = FALSE;
 
@@ -495,10 +1862,11 @@ bool_t diff_state(state_ptr olds, state_ptr news, FILE *outfile) {
 	    fprintf(outfile, "pc:\t0x%.16llx\t0x%.16llx\n", olds->pc, news->pc);
 	}
     }
-    if (olds->cc != news->cc) {
+    if (get_cc(&olds->cc) != get_cc(&news->cc)) {
 	diff = TRUE;
 	if (outfile) {
-	    fprintf(outfile, "cc:\t%s\t%s\n", cc_name(olds->cc), cc_name(news->cc));
+	    fprintf(outfile, "cc:\t%s\t%s\n", cc_name(get_cc(&olds->cc)),
+		    cc_name(get_cc(&news->cc)));
 	}
     }
     if (diff_reg(olds->r, news->r, outfile))
@@ -512,3 +1880,71 @@ bool_t diff_state(state_ptr olds, state_ptr news, FILE *outfile) {
     return diff;
 }
 
+state_snap_t snapshot_state(state_ptr s, char *name)
+{
+    state_snap_t snap = find_snapshot(s, name);
+    if (snap)
+	free_snapshot(s, snap);
+    snap = (state_snap_t) malloc(sizeof(state_snap_rec));
+    snap->name = strdup(name);
+    snap->pc = s->pc;
+    snap->r = *s->r;
+    snap->cc = s->cc;
+    snap->m = snapshot_mem(s->m);
+    snap->next = s->snaps;
+    s->snaps = snap;
+    return snap;
+}
+
+state_snap_t find_snapshot(state_ptr s, char *name)
+{
+    state_snap_t snap;
+    for (snap = s->snaps; snap; snap = snap->next)
+	if (!strcmp(snap->name, name))
+	    return snap;
+    return NULL;
+}
+
+void restore_state(state_ptr s, state_snap_t snap)
+{
+    s->pc = snap->pc;
+    *s->r = snap->r;
+    s->cc = snap->cc;
+    restore_mem(snap->m);
+}
+
+void free_snapshot(state_ptr s, state_snap_t snap)
+{
+    state_snap_t *p;
+    for (p = &s->snaps; *p != snap; p = &(*p)->next)
+	;
+    *p = snap->next;
+    free_mem_snap(snap->m);
+    free((void *) snap->name);
+    free((void *) snap);
+}
+
+bool_t diff_snapshot(state_snap_t snap, state_ptr s, FILE *outfile)
+{
+    bool_t diff = FALSE;
+
+    if (snap->pc != s->pc) {
+	diff = TRUE;
+	if (outfile) {
+	    fprintf(outfile, "pc:\t0x%.16llx\t0x%.16llx\n", snap->pc, s->pc);
+	}
+    }
+    if (get_cc(&snap->cc) != get_cc(&s->cc)) {
+	diff = TRUE;
+	if (outfile) {
+	    fprintf(outfile, "cc:\t%s\t%s\n", cc_name(get_cc(&snap->cc)),
+		    cc_name(get_cc(&s->cc)));
+	}
+    }
+    if (diff_reg(&snap->r, s->r, outfile))
+	diff = TRUE;
+    if (diff_mem_snap(snap->m, outfile, (word_t) 0, FALSE))
+	diff = TRUE;
+    return diff;
+}
+
@@ -97,15 +97,128 @@ typedef unsigned char byte_t;
 typedef long long int word_t;
 typedef long long unsigned uword_t;
 
-/* Represent a memory as an array of bytes */
+/* Longest instruction encoding, in bytes */
+#define MAX_INSTR_LEN 10
+
+/* Instruction fetched and decoded once, then reused by step_state */
 typedef struct {
-  int len;
+  byte_t valid;    /* Entry holds a decoded instruction */
+  byte_t byte0;    /* Raw icode:ifun byte */
+  byte_t icode;
+  byte_t ifun;
+  byte_t ra;
+  byte_t rb;
+  byte_t len;      /* Number of bytes fetched */
+  byte_t ok1;      /* Register specifier byte was fetchable */
+  byte_t okc;      /* Constant word was fetchable */
+  byte_t noloop;   /* Jump does not close a loop fast_forward can skip */
+  word_t valc;
+  word_t valp;     /* Address of following instruction */
+  void *handler;   /* Threaded-code handler (NULL until assigned) */
+} dinstr_rec, *dinstr_ptr;
+
+/* Represent a memory as an array of bytes, followed by a sparse set of
+   pages allocated when first written */
+typedef struct {
+  int len;         /* Bytes held in contents, starting at address 0 */
   word_t maxaddr;
   byte_t *contents;
+  /* Decode cache for contents, indexed by PC.  Allocated on first
+     instruction fetch */
+  dinstr_ptr icache;
+  /* Nonzero for each 256-byte block that may hold bytes of a decoded
+     instruction */
+  byte_t *icache_blocks;
+  /* Generation in which each page of contents was last written, or 0
+     if it never was.  Pages never written hold only zeros.  Pages
+     beyond the contents keep their generation after their data */
+  word_t *page_gen;
+  /* Current generation.  Taking a snapshot starts a new one */
+  word_t gen;
+  struct mem_snap_rec *snaps;	/* Snapshots, newest first */
+  /* Nonzero if contents and decode cache are a private mapping of a
+     memory image, of this many bytes */
+  size_t mapped;
+  /* Nonzero if contents alone is an anonymous mapping of this many
+     bytes, into which host files can be mapped */
+  size_t anon;
+  struct out_port_rec *port;	/* Output port, or NULL */
+  /* Addresses from len up to size are held in pages */
+  word_t size;
+  void **pages;		/* Page table, NULL while there are no pages */
+  word_t tlb_tag;	/* Page number of tlb_page, or -1 */
+  byte_t *tlb_page;	/* Page accessed last */
+  /* While hashing is set, hash is the sum of hash_word(addr, word) over
+     the aligned words of memory.  See start_mem_hash */
+  bool_t hashing;
+  uword_t hash;
 } mem_rec, *mem_t;
 
+#define ICACHE_BLOCK_SHIFT 8
+
+/* Pages beyond the flat contents, and the unit of write tracking */
+#define MEM_PAGE_SHIFT 12
+#define MEM_PAGE_SIZE (1 << MEM_PAGE_SHIFT)
+
+/* Number of pages in len bytes of contents */
+#define CONTENTS_PAGES(len) (((len) + MEM_PAGE_SIZE-1) >> MEM_PAGE_SHIFT)
+
+/* Generation of a page beyond the contents */
+#define PAGE_GEN(page) ((word_t *) ((page) + MEM_PAGE_SIZE))
+
+/* Can the page of contents holding byte pos be written directly?  If
+   not, prepare_write must be called first.  Code that stores into the
+   contents without set_byte_val or set_word_val must check this too */
+#define PAGE_READY(m, pos) ((m)->page_gen[(pos) >> MEM_PAGE_SHIFT] == (m)->gen)
+
+/* Generation of a page of a host file mapped read-only.  Such a page is
+   never ready, and prepare_write refuses it */
+#define GEN_READ_ONLY ((word_t) -1)
+
+/* Make the page holding pos, which must lie within memory, ready to
+   write in the current generation, saving its old contents for the
+   newest snapshot first if that needs them.  Return FALSE if the page
+   is read-only */
+bool_t prepare_write(mem_t m, word_t pos);
+
+/* Is any of the len bytes at pos in a read-only page? */
+bool_t mem_read_only(mem_t m, word_t pos, int len);
+
+/*
+  Snapshot of a memory.  Taking one only starts a new generation.  The
+  first write to a page after that saves a copy of the page in the
+  newest snapshot, so until then the page is shared.  Older snapshots
+  find pages they did not save themselves in newer ones, or else in the
+  memory.
+*/
+typedef struct mem_snap_rec {
+  mem_t m;			/* Memory it is a snapshot of */
+  word_t gen;			/* Last generation it covers */
+  struct mem_snap_rec *older;
+  struct mem_snap_rec *newer;
+  byte_t **saved;		/* Saved pages of contents, or NULL */
+  void **pages;			/* Page table of saved pages beyond them */
+  bool_t hashed;		/* Whether m was hashing when it was taken */
+  uword_t hash;			/* Its hash then */
+} mem_snap_rec, *mem_snap_t;
+
+/* Take a snapshot of m */
+mem_snap_t snapshot_mem(mem_t m);
+/* Return m to its contents when snapshot s was taken.  Takes time in
+   proportion to the pages written since */
+void restore_mem(mem_snap_t s);
+void free_mem_snap(mem_snap_t s);
+/* Print the differences between the memory as it was when snapshot s
+   was taken and as it is now, in the same form as diff_mem.  If
+   reverse, they are printed as if the memory now was the old one */
+bool_t diff_mem_snap(mem_snap_t s, FILE *outfile, word_t start_addr,
+		     bool_t reverse);
+
 /* Create a memory with len bytes */
 mem_t init_mem(int len);
+/* Create a memory with size bytes.  Up to len of them are allocated at
+   once, the rest a page at a time when first written */
+mem_t init_sparse_mem(int len, word_t size);
 void free_mem(mem_t m);
 
 /* Set contents of memory to 0 */
@@ -132,11 +245,128 @@ bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile);
 #endif
 
 
+/* Parse a memory size such as 65536, 64K, 16M or 1G.  Return 0 if the
+   string is not a valid size */
+word_t parse_mem_size(char *str);
+
+/*
+  Map a host file into memory, as given by arg of the form "file@addr".
+  addr must be a multiple of the host page size.  The part of the file
+  within the contents is mapped in place; the rest is read into pages.
+  If writable, stores go to private copies of the pages and the file is
+  never changed.  If not, stores to the pages fail.  The mapping covers
+  whole pages, and the rest of the last page reads as zero.  Return
+  FALSE, after printing a message, on error.
+*/
+bool_t map_mem_file(mem_t m, char *arg, bool_t writable);
+
+/* Write memory to a host file, as given by arg of the form
+   "file@addr:len".  Return FALSE, after printing a message, on error */
+bool_t save_mem_file(mem_t m, char *arg);
+
+/*
+  Output port.  Once a port is attached to a memory, stores to these
+  addresses, which lie beyond any memory, append to a host-side buffer
+  instead.  The buffer is written out when it fills, and by flush_port.
+  Loads from them fail.
+*/
+#define IO_BASE ((word_t) 1 << 62)
+#define IO_PUT_BYTE IO_BASE		/* Appends the low byte */
+#define IO_PUT_WORD (IO_BASE + 8)	/* Appends the word, low byte first */
+#define IO_PUT_DEC (IO_BASE + 16)	/* Appends the word in decimal and a
+					   newline */
+
+#define OUT_BUF_SIZE (64 * 1024)
+
+typedef struct out_port_rec {
+  FILE *out;
+  size_t len;
+  char buf[OUT_BUF_SIZE];
+} out_port_rec, *out_port_t;
+
+/* Is pos the address of a port of m? */
+#define IS_PORT(m, pos) ((m)->port && (pos) >= IO_BASE && \
+			 (pos) <= IO_PUT_DEC && ((pos) & 7) == 0)
+
+/* Send stores to the ports of m to out.  If out is NULL they are
+   dropped */
+void attach_port(mem_t m, FILE *out);
+/* Write out what is buffered for the ports of m */
+void flush_port(mem_t m);
+
+/* Page holding address pos, which lies between m->len and m->size.
+   NULL if that page was never written, unless alloc is set.  The page
+   becomes m->tlb_page */
+byte_t *find_page(mem_t m, word_t pos, bool_t alloc);
+
 /*** In the following functions, a return value of 1 means success ***/
 
-/* Load memory from .yo file.  Return number of bytes read */
+/* Load memory from .yo file, or from a binary object if the file starts
+   with YBO_MAGIC.  Return number of bytes read */
 int load_mem(mem_t m, FILE *infile, int report_error);
 
+/*
+  Binary object (.ybo) files, as written by yas -b or -c and by yld.  The
+  header is followed by seg_cnt segments, each a ybo_seg_rec and its len
+  bytes of code, then line_cnt line table entries, each a ybo_line_rec
+  and its source text, then sym_cnt symbols, each a ybo_sym_rec and its
+  name, then rel_cnt relocations.  Every record starts on a YBO_ALIGN
+  boundary and words are in host byte order.
+
+  In a relocatable object (YBO_RELOC) all addresses are offsets from a
+  base that yld chooses, aligned to align, and the object covers size
+  bytes from there
+*/
+#define YBO_MAGIC "\177YBO"
+#define YBO_VERSION 2
+#define YBO_ALIGN 8
+#define YBO_PAD(n) (((n) + YBO_ALIGN-1) & ~(word_t) (YBO_ALIGN-1))
+
+/* Header flags */
+#define YBO_RELOC 0x1
+
+typedef struct {
+    char magic[4];
+    int version;
+    word_t flags;
+    word_t seg_cnt;
+    word_t line_cnt;
+    word_t sym_cnt;
+    word_t rel_cnt;
+    word_t size;
+    word_t align;
+} ybo_header_rec;
+
+typedef struct {
+    word_t addr;
+    word_t len;
+} ybo_seg_rec;
+
+/* A source line that generated cnt bytes of code at addr */
+typedef struct {
+    word_t addr;
+    word_t cnt;
+    word_t text_len;
+} ybo_line_rec;
+
+/* Symbol flags.  Only exported symbols are seen by other objects, and
+   an imported one is defined by some other object */
+#define YBO_SYM_EXPORT 0x1
+#define YBO_SYM_IMPORT 0x2
+
+typedef struct {
+    word_t pos;
+    word_t flags;
+    word_t name_len;
+} ybo_sym_rec;
+
+/* The size bytes at addr hold the address of symbol number sym */
+typedef struct {
+    word_t addr;
+    word_t sym;
+    word_t size;
+} ybo_rel_rec;
+
 /* Get byte from memory */
 bool_t get_byte_val(mem_t m, word_t pos, byte_t *dest);
 
@@ -152,20 +382,94 @@ bool_t set_word_val(mem_t m, word_t pos, word_t val);
 /* Print contents of memory */
 void dump_memory(FILE *outfile, mem_t m, word_t pos, int cnt);
 
+/* Return the decode cache entry for pos, allocating the cache if needed.
+   Return NULL if pos is outside of memory */
+dinstr_ptr icache_entry(mem_t m, word_t pos);
+
+/* Discard decoded instructions overlapping bytes [pos, pos+cnt),
+   which must lie within memory */
+void invalidate_icache(mem_t m, word_t pos, int cnt);
+
+/* Discard all decoded instructions */
+void flush_icache(mem_t m);
+
+/* Memory contents and decode cache saved to a temporary file.  Memories
+   mapped from it share its pages until they write to them.  Pages
+   beyond the flat contents are copied into each memory instead */
+typedef struct {
+  FILE *file;
+  int len;
+  size_t size;		/* Size of the file */
+  word_t mem_size;
+  word_t gen;
+  word_t *page_gen;
+  void **pages;
+} mem_image_rec, *mem_image_t;
+
+/* Save memory as an image, decoding the instructions at addresses below
+   code_end first.  Return NULL on failure */
+mem_image_t save_mem_image(mem_t m, word_t code_end);
+
+/* Create a copy-on-write memory from an image.  Return NULL on failure */
+mem_t map_mem_image(mem_image_t img);
+void free_mem_image(mem_image_t img);
+
+/*
+  State hashing.  A state hashes to the sum of hash_word(key, value)
+  over its registers, condition codes, PC and memory words, so that a
+  write changes the hash by the difference of two hash_word values and
+  equal states can be told apart from different ones in constant time.
+  Zero values add nothing, so unwritten memory costs nothing.
+*/
+#define HASH_REG_KEY(id) (-1 - (word_t) (id))
+#define HASH_PC_KEY (-1 - (word_t) REG_NONE)
+#define HASH_CC_KEY (-2 - (word_t) REG_NONE)
+
+static inline uword_t hash_word(word_t key, word_t val)
+{
+    uword_t x = ((uword_t) key * 0x9e3779b97f4a7c15ULL) ^ (uword_t) val;
+    if (!val)
+	return 0;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/*
+  Compute the hash of m and keep it up to date from now on.  Takes time
+  proportional to the memory written so far.  set_byte_val and
+  set_word_val then update it in constant time, and loading, mapping,
+  clearing and restoring a snapshot of m recompute it.  Code that stores
+  into the contents directly must not run while m->hashing is set.
+*/
+void start_mem_hash(mem_t m);
+
 /********** Implementation of Register File *************/
 
-mem_t init_reg();
-void free_reg();
+/* Represent a register file as an array of words, indexed by register
+   ID.  regs[REG_NONE] absorbs writes to REG_NONE and is never read */
+typedef struct {
+  word_t regs[REG_NONE+1];
+  uword_t hash;		/* Sum of hash_word(HASH_REG_KEY(id), regs[id]) */
+} reg_rec, *reg_t;
+
+reg_t init_reg();
+void free_reg(reg_t r);
+
+/* Set all registers to 0 */
+void clear_reg(reg_t r);
 
 /* Make a copy of a register file */
-mem_t copy_reg(mem_t oldr);
+reg_t copy_reg(reg_t oldr);
 /* Print the differences between two register files */
-bool_t diff_reg(mem_t oldr, mem_t newr, FILE *outfile);
+bool_t diff_reg(reg_t oldr, reg_t newr, FILE *outfile);
 
 
-word_t get_reg_val(mem_t r, reg_id_t id);
-void set_reg_val(mem_t r, reg_id_t id, word_t val);
-void dump_reg(FILE *outfile, mem_t r);
+word_t get_reg_val(reg_t r, reg_id_t id);
+void set_reg_val(reg_t r, reg_id_t id, word_t val);
+/* Recompute r->hash after its registers were written directly */
+void rehash_reg(reg_t r);
+void dump_reg(FILE *outfile, reg_t r);
 int reg_valid(reg_id_t id);
 
 
@@ -187,6 +491,29 @@ typedef unsigned char cc_t;
 /* Compute condition code.  */
 cc_t compute_cc(alu_t op, word_t arg1, word_t arg2);
 
+/* Condition code, evaluated only when it is read.  While op is CC_KNOWN
+   the code is held in cc.  Otherwise it is the one set by ALU operation
+   op on arguments argA and argB, which gave val */
+typedef struct {
+  int op;
+  cc_t cc;
+  word_t argA;
+  word_t argB;
+  word_t val;
+} lazy_cc_t;
+
+#define CC_KNOWN (-1)
+
+/* Record an ALU operation as the source of the condition code */
+#define DEFER_CC(l, o, a, b, v) \
+    ((l).op = (o), (l).argA = (a), (l).argB = (b), (l).val = (v))
+
+/* Set condition code directly */
+#define SET_CC(l, c) ((l).op = CC_KNOWN, (l).cc = (c))
+
+/* Get condition code, computing it if necessary */
+cc_t get_cc(lazy_cc_t *l);
+
 /* Generated printed form of condition code */
 char *cc_name(cc_t c);
 
@@ -202,9 +529,12 @@ char *stat_name(stat_t e);
 
 typedef struct {
   word_t pc;
-  mem_t r;
+  reg_t r;
   mem_t m;
-  cc_t cc;
+  lazy_cc_t cc;
+  struct state_snap_rec *snaps;	/* Named snapshots */
+  struct undo_log_rec *undo;	/* Log of recent steps, or NULL */
+  struct trace_writer_rec *trace;	/* Trace of every step, or NULL */
 } state_rec, *state_ptr;
 
 state_ptr new_state(int memlen);
@@ -213,12 +543,280 @@ void free_state(state_ptr s);
 state_ptr copy_state(state_ptr s);
 bool_t diff_state(state_ptr olds, state_ptr news, FILE *outfile);
 
+/* Hash of the PC, registers, condition codes and memory of s.  The
+   first call starts hashing memory, and later ones take constant time */
+uword_t state_hash(state_ptr s);
+
+/* Named snapshot of an ISA state.  The memory is a copy-on-write
+   snapshot, so taking one costs no more than copying the registers */
+typedef struct state_snap_rec {
+  char *name;
+  struct state_snap_rec *next;
+  word_t pc;
+  reg_rec r;
+  lazy_cc_t cc;
+  mem_snap_t m;
+} state_snap_rec, *state_snap_t;
+
+/* Take a snapshot of s, replacing any earlier one with the same name */
+state_snap_t snapshot_state(state_ptr s, char *name);
+/* Return snapshot of s with given name, or NULL if there is none */
+state_snap_t find_snapshot(state_ptr s, char *name);
+/* Return s to snapshot snap, which is kept */
+void restore_state(state_ptr s, state_snap_t snap);
+void free_snapshot(state_ptr s, state_snap_t snap);
+/* Print the differences between snapshot snap and s now, in the same
+   form as diff_state */
+bool_t diff_snapshot(state_snap_t snap, state_ptr s, FILE *outfile);
+
 /* Determine if condition satisified */
 bool_t cond_holds(cc_t cc, cond_t bcond);
 
+/* Fetch and decode instruction at pc, using the memory's decode cache.
+   Return NULL if pc is outside the flat contents, which are the only
+   addresses whose instructions are cached */
+dinstr_ptr decode_instr(mem_t m, word_t pc);
+
+/* Length of the instruction whose first byte is instr.  1 if the icode
+   is invalid */
+int instr_length(byte_t instr);
+
 /* Execute single instruction.  Return status. */
 stat_t step_state(state_ptr s, FILE *error_file);
 
+/* Errors reported by step_state and run_state */
+typedef enum {
+  ERR_NONE,		/* No message */
+  ERR_FETCH,		/* Invalid instruction address */
+  ERR_FETCH_IMM,	/* Same, for the constant of irmovq or iaddq */
+  ERR_FETCH_DISP,	/* Same, for the displacement of mrmovq */
+  ERR_REG,		/* Invalid register ID */
+  ERR_DATA,		/* Invalid data address */
+  ERR_STACK,		/* Invalid stack address */
+  ERR_INSTR		/* Invalid instruction */
+} err_t;
+
+typedef struct {
+  err_t kind;
+  word_t val;		/* Offending address, register ID or byte */
+} run_error_t;
+
+#define ERR_MSG_LEN 80
+
+/* Format message for error e at pc into buf, which has room for
+   ERR_MSG_LEN characters.  Empty for ERR_NONE */
+void format_error(char *buf, word_t pc, run_error_t *e);
+
+/* Outcome of run_state */
+typedef struct {
+  word_t steps;		/* Instructions executed */
+  stat_t status;	/* Status of the last one */
+  word_t pc;		/* PC at the end, which is the faulting PC on error */
+  char msg[ERR_MSG_LEN];  /* Error message, or empty string */
+} run_result;
+
+/*
+  Execute instructions until a non-AOK status occurs or max_steps
+  instructions have executed.  Behaves like repeated calls to
+  step_state, but the error message, if any, is only formatted at the
+  end and left in res->msg rather than printed.
+
+  Return number of instructions executed.
+*/
+word_t run_state(state_ptr s, word_t max_steps, run_result *res);
+
+/* **************** Undo log *********/
+
+/* What one instruction overwrote.  An instruction writes at most two
+   registers and one memory word */
+typedef struct {
+  word_t pc;
+  lazy_cc_t cc;
+  word_t regval[2];	/* Old register values */
+  byte_t reg[2];	/* Registers written, in order, or REG_NONE */
+  bool_t wrote;		/* Whether the word at addr was written */
+  word_t addr;
+  word_t word;		/* Its old value */
+} undo_rec;
+
+/* Ring buffer of the last size steps.  Logging a step never allocates */
+typedef struct undo_log_rec {
+  undo_rec *recs;
+  word_t size;
+  word_t next;		/* Where the next step goes */
+  word_t count;		/* Steps that can be undone */
+} undo_log_rec, *undo_log_t;
+
+/*
+  Keep a log of the last size steps of s, so that they can be undone.
+  While it is on, step_state and run_state log every step, and run_state
+  does not fast_forward.
+*/
+void start_undo(state_ptr s, word_t size);
+void stop_undo(state_ptr s);
+
+/* Undo the last n steps of s, or as many as are logged.  Return number
+   undone */
+word_t undo_steps(state_ptr s, word_t n);
+
+/*
+  Undo steps of s back through the last one that wrote any of the 8 bytes
+  at addr, leaving s->pc at that instruction.  Return number undone, and
+  set *found to whether such a step was logged.  If not, every logged
+  step is undone.
+*/
+word_t undo_to_write(state_ptr s, word_t addr, bool_t *found);
+
+/* **************** Execution trace *********/
+
+/* One executed instruction, as recorded in a trace */
+typedef struct {
+  word_t pc;
+  byte_t instr;		/* Its first byte */
+  byte_t status;	/* Status it left, as a stat_t */
+  byte_t reg[2];	/* Registers written, in order, or REG_NONE */
+  word_t regval[2];	/* Their new values */
+  bool_t wrote;		/* Whether the word at addr was written */
+  word_t addr;
+  word_t word;		/* Its new value */
+} trace_rec;
+
+/*
+  A trace file starts with a header giving the register values before
+  the first step.  Each record then holds a tag byte, the PC unless it
+  follows on from the previous instruction, the instruction byte, the
+  status unless it is AOK, and the writes.  Addresses and register values
+  are varints of the difference from the last address or the register's
+  last value, so most records take 3 to 6 bytes.
+*/
+#define TRACE_MAGIC "\177YTR"
+#define TRACE_VERSION 1
+
+#define TRACE_REGS 0x3		/* Tag: number of registers written */
+#define TRACE_MEM 0x4		/* Tag: memory word written */
+#define TRACE_STAT 0x8		/* Tag: status is not AOK */
+#define TRACE_JUMP 0x10		/* Tag: PC does not follow on */
+
+/* Records are encoded into batches, which a writer thread takes off a
+   ring and writes out */
+#define TRACE_BATCH (64 * 1024)
+#define TRACE_RING 16
+/* Longest encoding of a record */
+#define TRACE_MAX_REC 64
+
+typedef struct {
+  size_t len;
+  byte_t data[TRACE_BATCH];
+} trace_batch_rec;
+
+/* The simulator fills ring[head % TRACE_RING] while the writer thread
+   writes out batches tail to head-1.  Only the simulator stores head and
+   only the writer stores tail, so the ring needs no lock */
+typedef struct trace_writer_rec {
+  FILE *out;
+  trace_batch_rec *ring;
+  uword_t head;
+  uword_t tail;
+  int done;		/* Set once the last batch is handed over */
+  void *thread;		/* The writer thread */
+  word_t pc;		/* Where the next instruction falls through to */
+  word_t addr;		/* Last address written */
+  word_t regs[REG_NONE];	/* Last value of each register */
+  word_t steps;		/* Records so far */
+  word_t bytes;		/* Bytes so far, including the header */
+} trace_writer_rec, *trace_t;
+
+/* Write the header of a trace to out, giving registers r, and start its
+   writer thread.  Return NULL if the thread cannot be started */
+trace_t open_trace(FILE *out, reg_t r);
+/* Add a record to trace t */
+void trace_step(trace_t t, trace_rec *rec);
+/* Write out the rest of trace t and free it.  out is flushed but not
+   closed */
+void close_trace(trace_t t);
+
+/*
+  Trace every step of s to out until stop_trace.  step_state and
+  run_state then take the slow path that the undo log does.  Return
+  FALSE if the trace cannot be started.
+*/
+bool_t start_trace(state_ptr s, FILE *out);
+void stop_trace(state_ptr s);
+
+typedef struct trace_reader_rec *trace_reader_t;
+
+/* Read the header of the trace in in.  If r is nonnull, set it to the
+   registers at the start.  Return NULL if in is not a trace */
+trace_reader_t open_trace_reader(FILE *in, reg_t r);
+/* Read the next record of t into rec.  Return 1 if there was one, 0 at
+   the end of the trace, and -1 if it is truncated or corrupt */
+int read_trace(trace_reader_t t, trace_rec *rec);
+void close_trace_reader(trace_reader_t t);
+
+/* Print rec on one line, without the newline */
+void print_step(FILE *out, trace_rec *rec);
+
+/* Execute single instruction of s and describe it in rec, as a trace
+   would.  Return status.  Not added to the undo log or trace of s */
+stat_t record_step(state_ptr s, trace_rec *rec);
+
+/* Whether a and b describe the same step.  Only the last write to each
+   register counts */
+bool_t same_step(trace_rec *a, trace_rec *b);
+
+/*
+  Lockstep check: the ISA model runs s for up to max_steps steps on a
+  second thread, queuing a record of each step, while a pipeline
+  simulator compares its own instructions as they retire.
+*/
+typedef struct check_rec *check_t;
+
+/* Start running s on a new thread, which owns s until stop_check.
+   Return NULL if the thread cannot be started */
+check_t start_check(state_ptr s, word_t max_steps);
+/* Take the model's next step into *expect and compare it with rec.
+   If the model has stopped, expect->status is STAT_BUB */
+bool_t check_step(check_t c, trace_rec *rec, trace_rec *expect);
+/* Stop the model, which is left after its last queued step */
+void stop_check(check_t c);
+
+/*
+  The jump at jpc has just been taken back to s->pc.  If the code from
+  s->pc to jpc is a loop whose iterations only add loop-invariant values
+  to registers, skip as many whole iterations as can be computed exactly
+  and fit within max_steps steps.
+
+  Return number of instructions skipped.
+*/
+word_t fast_forward(state_ptr s, word_t jpc, word_t max_steps);
+
+/*
+  Run with the direct-threaded interpreter until a non-AOK status occurs
+  or max_steps instructions have executed.  Behaves exactly like
+  repeated calls to step_state.
+
+  Return number of instructions executed.
+  if statusp nonnull, then will be set to status of final instruction
+*/
+word_t run_threaded(state_ptr s, word_t max_steps, stat_t *statusp,
+		    FILE *error_file);
+
+/* Number of states run_lanes executes together */
+#define LANES 4
+
+/*
+  Run states s[0] .. s[n-1], n <= LANES, in lockstep.  Register files
+  are held as vectors with one lane per state, and states at the same PC
+  execute each instruction together.  res[i] and s[i] end up as
+  run_state(s[i], max_steps, &res[i]) would leave them.
+*/
+void run_lanes(state_ptr *s, int n, word_t max_steps, run_result *res);
+
+/* Same as run_threaded, but translating basic blocks to host code.
+   Falls back on run_threaded where translation is not supported */
+word_t run_jit(state_ptr s, word_t max_steps, stat_t *statusp,
+	       FILE *error_file);
+
 /************************ Interface Functions *************/
 
 #ifdef HAS_GUI
@@ -2,14 +2,30 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <string.h>
+#include <sched.h>
 #include "isa.h"
 
 
+/* Page holding pos, which lies beyond the flat contents, through the
+   one-entry TLB */
+static inline byte_t *page_of(mem_t m, word_t pos, bool_t alloc)
+{
+    if ((pos >> MEM_PAGE_SHIFT) == m->tlb_tag)
+	return m->tlb_page;
+    return find_page(m, pos, alloc);
+}
+
 bool_t get_byte_val(mem_t m, word_t pos, byte_t *dest)
 {
-    if (pos < 0 || pos >= m->len)
+    byte_t *page;
+    if (pos >= 0 && pos < m->len) {
+	*dest = m->contents[pos];
+	return TRUE;
+    }
+    if (pos < 0 || pos >= m->size)
 	return FALSE;
-    *dest = m->contents[pos];
+    page = page_of(m, pos, FALSE);
+    *dest = page ? page[pos & (MEM_PAGE_SIZE-1)] : 0;
     return TRUE;
 }
 
@@ -17,37 +33,167 @@ bool_t get_word_val(mem_t m, word_t pos, word_t *dest)
 {
     int i;
     word_t val;
-    if (pos < 0 || pos + 8 > m->len)
+    byte_t *bytes;
+    if (pos >= 0 && pos <= m->len - 8)
+	bytes = m->contents + pos;
+    else if (pos < 0 || pos > m->size - 8)
 	return FALSE;
+    else if (pos >= m->len &&
+	     (pos & (MEM_PAGE_SIZE-1)) <= MEM_PAGE_SIZE - 8) {
+	bytes = page_of(m, pos, FALSE);
+	if (!bytes) {
+	    *dest = 0;
+	    return TRUE;
+	}
+	bytes += pos & (MEM_PAGE_SIZE-1);
+    } else {
+	/* Word spans two pages, or the flat contents and a page */
+	byte_t b;
+	val = 0;
+	for (i = 0; i < 8; i++) {
+	    get_byte_val(m, pos+i, &b);
+	    val = val | ((word_t) b << (8*i));
+	}
+	*dest = val;
+	return TRUE;
+    }
     val = 0;
     for (i = 0; i < 8; i++) {
-	word_t b =  m->contents[pos+i] & 0xFF;
+	word_t b =  bytes[i] & 0xFF;
 	val = val | (b <<(8*i));
     }
     *dest = val;
     return TRUE;
 }
 
-bool_t set_byte_val(mem_t m, word_t pos, byte_t val)
+/* Store val to port pos of m */
+static bool_t put_port(mem_t m, word_t pos, word_t val)
 {
-    if (pos < 0 || pos >= m->len)
+    out_port_t p = m->port;
+    int i;
+    /* Leave room for a word in decimal and a newline */
+    if (p->len + 24 > OUT_BUF_SIZE)
+	flush_port(m);
+    switch (pos) {
+    case IO_PUT_BYTE:
+	p->buf[p->len++] = (char) val;
+	break;
+    case IO_PUT_WORD:
+	for (i = 0; i < 8; i++) {
+	    p->buf[p->len++] = (char) val;
+	    val >>= 8;
+	}
+	break;
+    default:
+	p->len += sprintf(p->buf + p->len, "%lld\n", val);
+	break;
+    }
+    return TRUE;
+}
+
+/* set_byte_val, leaving the hash alone */
+static bool_t write_byte(mem_t m, word_t pos, byte_t val)
+{
+    byte_t *page;
+    if (pos >= 0 && pos < m->len) {
+	if (!PAGE_READY(m, pos) && !prepare_write(m, pos))
+	    return FALSE;
+	m->contents[pos] = val;
+	if (m->icache)
+	    invalidate_icache(m, pos, 1);
+	return TRUE;
+    }
+    if (pos < 0 || pos >= m->size)
+	return IS_PORT(m, pos) && put_port(m, pos, val);
+    page = page_of(m, pos, TRUE);
+    if (*PAGE_GEN(page) != m->gen && !prepare_write(m, pos))
 	return FALSE;
-    m->contents[pos] = val;
+    page[pos & (MEM_PAGE_SIZE-1)] = val;
+    /* A decoded instruction at the end of contents may extend here */
+    if (m->icache && pos - (MAX_INSTR_LEN-1) < m->len)
+	invalidate_icache(m, pos, 1);
     return TRUE;
 }
 
-bool_t set_word_val(mem_t m, word_t pos, word_t val)
+/* set_word_val, leaving the hash alone */
+static bool_t write_word(mem_t m, word_t pos, word_t val)
 {
     int i;
-    if (pos < 0 || pos + 8 > m->len)
-	return FALSE;
-    for (i = 0; i < 8; i++) {
-	m->contents[pos+i] = (byte_t) val & 0xFF;
-	val >>= 8;
+    byte_t *bytes;
+    if (pos >= 0 && pos <= m->len - 8) {
+	if ((!PAGE_READY(m, pos) && !prepare_write(m, pos)) ||
+	    (!PAGE_READY(m, pos + 7) && !prepare_write(m, pos + 7)))
+	    return FALSE;
+	bytes = m->contents + pos;
+	for (i = 0; i < 8; i++) {
+	    bytes[i] = (byte_t) val & 0xFF;
+	    val >>= 8;
+	}
+	if (m->icache)
+	    invalidate_icache(m, pos, 8);
+	return TRUE;
+    }
+    if (pos < 0 || pos > m->size - 8)
+	return IS_PORT(m, pos) && put_port(m, pos, val);
+    if (pos >= m->len && (pos & (MEM_PAGE_SIZE-1)) <= MEM_PAGE_SIZE - 8) {
+	bytes = page_of(m, pos, TRUE);
+	if (*PAGE_GEN(bytes) != m->gen && !prepare_write(m, pos))
+	    return FALSE;
+	bytes += pos & (MEM_PAGE_SIZE-1);
+	for (i = 0; i < 8; i++) {
+	    bytes[i] = (byte_t) val & 0xFF;
+	    val >>= 8;
+	}
+	if (m->icache && pos - (MAX_INSTR_LEN-1) < m->len)
+	    invalidate_icache(m, pos, 8);
+    } else {
+	/* Word spans two pages, or the flat contents and a page */
+	if (mem_read_only(m, pos, 8))
+	    return FALSE;
+	for (i = 0; i < 8; i++) {
+	    write_byte(m, pos+i, (byte_t) val & 0xFF);
+	    val >>= 8;
+	}
     }
     return TRUE;
 }
 
+/* Take the aligned words holding the len bytes at pos out of the hash
+   of m, or put them back in if add is set */
+static void hash_span(mem_t m, word_t pos, int len, bool_t add)
+{
+    word_t a;
+    word_t w;
+    for (a = pos & ~7; a < pos + len; a += 8)
+	if (get_word_val(m, a, &w)) {
+	    if (add)
+		m->hash += hash_word(a, w);
+	    else
+		m->hash -= hash_word(a, w);
+	}
+}
+
+bool_t set_byte_val(mem_t m, word_t pos, byte_t val)
+{
+    bool_t ok;
+    if (!m->hashing)
+	return write_byte(m, pos, val);
+    hash_span(m, pos, 1, FALSE);
+    ok = write_byte(m, pos, val);
+    hash_span(m, pos, 1, TRUE);
+    return ok;
+}
+
+bool_t set_word_val(mem_t m, word_t pos, word_t val)
+{
+    bool_t ok;
+    if (!m->hashing)
+	return write_word(m, pos, val);
+    hash_span(m, pos, 8, FALSE);
+    ok = write_word(m, pos, val);
+    hash_span(m, pos, 8, TRUE);
+    return ok;
+}
 
 word_t compute_alu(alu_t op, word_t argA, word_t argB)
 {
@@ -82,9 +228,9 @@ word_t compute_alu(alu_t op, word_t argA, word_t argB)
     return val;
 }
 
-cc_t compute_cc(alu_t op, word_t argA, word_t argB)
+/* Condition code set by ALU operation op on argA and argB giving val */
+static cc_t alu_cc(alu_t op, word_t argA, word_t argB, word_t val)
 {
-    word_t val = compute_alu(op, argA, argB);
     bool_t zero = (val == 0);
     bool_t sign = ((word_t)val < 0);
     bool_t ovf;
@@ -117,6 +263,20 @@ cc_t compute_cc(alu_t op, word_t argA, word_t argB)
     
 }
 
+cc_t compute_cc(alu_t op, word_t argA, word_t argB)
+{
+    return alu_cc(op, argA, argB, compute_alu(op, argA, argB));
+}
+
+cc_t get_cc(lazy_cc_t *l)
+{
+    if (l->op != CC_KNOWN) {
+	l->cc = alu_cc(l->op, l->argA, l->argB, l->val);
+	l->op = CC_KNOWN;
+    }
+    return l->cc;
+}
+
 
 /* Branch logic */
 bool_t cond_holds(cc_t cc, cond_t bcond) {
@@ -155,34 +315,30 @@ bool_t cond_holds(cc_t cc, cond_t bcond) {
 }
 
 
-/* Execute single instruction.  Return status. */
-stat_t step_state(state_ptr s, FILE *error_file)
+/* Fetch and decode the instruction at pc into d */
+static void decode_at(mem_t m, word_t pc, dinstr_ptr d)
 {
-    word_t argA, argB;
     byte_t byte0 = 0;
     byte_t byte1 = 0;
     itype_t hi0;
-    alu_t  lo0;
-    reg_id_t hi1 = REG_NONE;
-    reg_id_t lo1 = REG_NONE;
-    bool_t ok1 = TRUE;
-    word_t cval = 0;
-    word_t okc = TRUE;
-    word_t val, dval;
     bool_t need_regids;
     bool_t need_imm;
-    word_t ftpc = s->pc;  /* Fall-through PC */
+    word_t ftpc = pc;  /* Fall-through PC */
 
-    if (!get_byte_val(s->m, ftpc, &byte0)) {
-	if (error_file)
-	    fprintf(error_file,
-		    "PC = 0x%llx, Invalid instruction address\n", s->pc);
-	return STAT_ADR;
-    }
+    get_byte_val(m, ftpc, &byte0);
     ftpc++;
 
     hi0 = HI4(byte0);
-    lo0 = LO4(byte0);
+    d->byte0 = byte0;
+    d->icode = hi0;
+    d->ifun = LO4(byte0);
+    d->ra = REG_NONE;
+    d->rb = REG_NONE;
+    d->ok1 = TRUE;
+    d->okc = TRUE;
+    d->noloop = FALSE;
+    d->valc = 0;
+    d->handler = NULL;
 
     need_regids =
 	(hi0 == I_RRMOVQ || hi0 == I_ALU || hi0 == I_PUSHQ ||
@@ -190,10 +346,10 @@ stat_t step_state(state_ptr s, FILE *error_file)
 	 hi0 == I_MRMOVQ || hi0 == I_IADDQ);
 
     if (need_regids) {
-	ok1 = get_byte_val(s->m, ftpc, &byte1);
+	d->ok1 = get_byte_val(m, ftpc, &byte1);
 	ftpc++;
-	hi1 = HI4(byte1);
-	lo1 = LO4(byte1);
+	d->ra = HI4(byte1);
+	d->rb = LO4(byte1);
     }
 
     need_imm =
@@ -201,10 +357,131 @@ stat_t step_state(state_ptr s, FILE *error_file)
 	 hi0 == I_JMP || hi0 == I_CALL || hi0 == I_IADDQ);
 
     if (need_imm) {
-	okc = get_word_val(s->m, ftpc, &cval);
+	d->okc = get_word_val(m, ftpc, &d->valc);
 	ftpc += 8;
     }
 
+    d->len = ftpc - pc;
+    d->valp = ftpc;
+    d->valid = TRUE;
+}
+
+/*
+ * Fetch and decode the instruction at pc.  The result is kept in the
+ * memory's decode cache until a write overlaps it.
+ * Return NULL if pc is outside the flat contents of memory.
+ */
+dinstr_ptr decode_instr(mem_t m, word_t pc)
+{
+    dinstr_ptr d = icache_entry(m, pc);
+
+    if (!d)
+	return NULL;
+    if (!d->valid)
+	decode_at(m, pc, d);
+    return d;
+}
+
+/* Record error err, with value v, and return status st */
+#define FAIL(err, v, st)					\
+    do {							\
+	errp->kind = (err);					\
+	errp->val = (v);					\
+	return (st);						\
+    } while (0)
+
+/* Inline paths for words wholly within the contents.  Everything else,
+   and every store while memory is hashed, goes to the checked
+   functions */
+static inline bool_t load_word(mem_t m, word_t pos, word_t *dest)
+{
+    if (pos >= 0 && pos <= m->len - 8) {
+	byte_t *bytes = m->contents + pos;
+	word_t val = 0;
+	int i;
+	for (i = 0; i < 8; i++)
+	    val |= (word_t) bytes[i] << (8*i);
+	*dest = val;
+	return TRUE;
+    }
+    return get_word_val(m, pos, dest);
+}
+
+static inline bool_t store_word(mem_t m, word_t pos, word_t val)
+{
+    if (pos >= 0 && pos <= m->len - 8 && PAGE_READY(m, pos) &&
+	PAGE_READY(m, pos + 7) && !m->hashing) {
+	byte_t *bytes = m->contents + pos;
+	int i;
+	for (i = 0; i < 8; i++) {
+	    bytes[i] = (byte_t) val;
+	    val >>= 8;
+	}
+	if (m->icache)
+	    invalidate_icache(m, pos, 8);
+	return TRUE;
+    }
+    return set_word_val(m, pos, val);
+}
+
+/* Log in u, if nonnull, the old value of register id */
+#define SAVE_REG(id)						\
+    do {							\
+	if (u) {						\
+	    int i_ = u->reg[0] != REG_NONE;			\
+	    u->reg[i_] = (id);					\
+	    u->regval[i_] = get_reg_val(s->r, (id));		\
+	}							\
+    } while (0)
+
+/* Log in u, if nonnull, the old value of the word at pos */
+#define SAVE_WORD(pos)						\
+    do {							\
+	if (u) {						\
+	    u->addr = (pos);					\
+	    u->wrote = get_word_val(s->m, u->addr, &u->word);	\
+	}							\
+    } while (0)
+
+/*
+ * Execute single instruction.  Return status.  When the status is ADR
+ * or INS, *errp describes the error for format_error.  If u is nonnull,
+ * record there what the instruction overwrites.
+ */
+static inline stat_t exec_state(state_ptr s, run_error_t *errp, undo_rec *u)
+{
+    word_t argA, argB;
+    byte_t byte0;
+    itype_t hi0;
+    alu_t  lo0;
+    reg_id_t hi1;
+    reg_id_t lo1;
+    bool_t ok1;
+    word_t cval;
+    word_t okc;
+    word_t val, dval;
+    word_t ftpc;  /* Fall-through PC */
+    dinstr_rec dtmp;
+    dinstr_ptr d = decode_instr(s->m, s->pc);
+
+    if (!d) {
+	/* Instructions beyond the flat contents are not cached */
+	if (s->pc < 0 || s->pc >= s->m->size)
+	    FAIL(ERR_FETCH, 0, STAT_ADR);
+	d = &dtmp;
+	decode_at(s->m, s->pc, d);
+    }
+
+    byte0 = d->byte0;
+    hi0 = d->icode;
+    lo0 = d->ifun;
+    hi1 = d->ra;
+    lo1 = d->rb;
+    ok1 = d->ok1;
+    cval = d->valc;
+    okc = d->okc;
+    ftpc = d->valp;
+
     switch (hi0) {
     case I_NOP:
 	s->pc = ftpc;
@@ -213,263 +490,703 @@ stat_t step_state(state_ptr s, FILE *error_file)
 	return STAT_HLT;
 	break;
     case I_RRMOVQ:  /* Both unconditional and conditional moves */
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, hi1);
-	    return STAT_INS;
-	}
-	if (!reg_valid(lo1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, lo1);
-	    return STAT_INS;
-	}
+	if (!ok1) 
+	    FAIL(ERR_FETCH, 0, STAT_ADR);
+	if (!reg_valid(hi1)) 
+	    FAIL(ERR_REG, hi1, STAT_INS);
+	if (!reg_valid(lo1)) 
+	    FAIL(ERR_REG, lo1, STAT_INS);
 	val = get_reg_val(s->r, hi1);
-	if (cond_holds(s->cc, lo0))
-	  set_reg_val(s->r, lo1, val);
+	if (cond_holds(get_cc(&s->cc), lo0)) {
+	    SAVE_REG(lo1);
+	    set_reg_val(s->r, lo1, val);
+	}
 	s->pc = ftpc;
 	break;
     case I_IRMOVQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address",
-			s->pc);
-	    return STAT_INS;
-	}
-	if (!reg_valid(lo1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, lo1);
-	    return STAT_INS;
-	}
+	if (!ok1) 
+	    FAIL(ERR_FETCH, 0, STAT_ADR);
+	if (!okc) 
+	    FAIL(ERR_FETCH_IMM, 0, STAT_INS);
+	if (!reg_valid(lo1)) 
+	    FAIL(ERR_REG, lo1, STAT_INS);
+	SAVE_REG(lo1);
 	set_reg_val(s->r, lo1, cval);
 	s->pc = ftpc;
 	break;
     case I_RMMOVQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_INS;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, hi1);
-	    return STAT_INS;
-	}
+	if (!ok1) 
+	    FAIL(ERR_FETCH, 0, STAT_ADR);
+	if (!okc) 
+	    FAIL(ERR_FETCH, 0, STAT_INS);
+	if (!reg_valid(hi1)) 
+	    FAIL(ERR_REG, hi1, STAT_INS);
 	if (reg_valid(lo1)) 
 	    cval += get_reg_val(s->r, lo1);
 	val = get_reg_val(s->r, hi1);
-	if (!set_word_val(s->m, cval, val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid data address 0x%llx\n",
-			s->pc, cval);
-	    return STAT_ADR;
-	}
+	SAVE_WORD(cval);
+	if (!store_word(s->m, cval, val)) 
+	    FAIL(ERR_DATA, cval, STAT_ADR);
 	s->pc = ftpc;
 	break;
     case I_MRMOVQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction addres\n", s->pc);
-	    return STAT_INS;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, hi1);
-	    return STAT_INS;
-	}
+	if (!ok1) 
+	    FAIL(ERR_FETCH, 0, STAT_ADR);
+	if (!okc) 
+	    FAIL(ERR_FETCH_DISP, 0, STAT_INS);
+	if (!reg_valid(hi1)) 
+	    FAIL(ERR_REG, hi1, STAT_INS);
 	if (reg_valid(lo1)) 
 	    cval += get_reg_val(s->r, lo1);
-	if (!get_word_val(s->m, cval, &val))
-	    return STAT_ADR;
+	if (!load_word(s->m, cval, &val))
+	    FAIL(ERR_NONE, 0, STAT_ADR);
+	SAVE_REG(hi1);
 	set_reg_val(s->r, hi1, val);
 	s->pc = ftpc;
 	break;
     case I_ALU:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
+	if (!ok1) 
+	    FAIL(ERR_FETCH, 0, STAT_ADR);
 	argA = get_reg_val(s->r, hi1);
 	argB = get_reg_val(s->r, lo1);
 	val = compute_alu(lo0, argA, argB);
+	SAVE_REG(lo1);
 	set_reg_val(s->r, lo1, val);
-	s->cc = compute_cc(lo0, argA, argB);
+	DEFER_CC(s->cc, lo0, argA, argB, val);
 	s->pc = ftpc;
 	break;
     case I_JMP:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (cond_holds(s->cc, lo0))
+	if (!ok1) 
+	    FAIL(ERR_FETCH, 0, STAT_ADR);
+	if (!okc) 
+	    FAIL(ERR_FETCH, 0, STAT_ADR);
+	if (cond_holds(get_cc(&s->cc), lo0))
 	    s->pc = cval;
 	else
 	    s->pc = ftpc;
 	break;
     case I_CALL:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
+	if (!ok1) 
+	    FAIL(ERR_FETCH, 0, STAT_ADR);
+	if (!okc) 
+	    FAIL(ERR_FETCH, 0, STAT_ADR);
 	val = get_reg_val(s->r, REG_RSP) - 8;
+	SAVE_REG(REG_RSP);
 	set_reg_val(s->r, REG_RSP, val);
-	if (!set_word_val(s->m, val, ftpc)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n", s->pc, val);
-	    return STAT_ADR;
-	}
+	SAVE_WORD(val);
+	if (!store_word(s->m, val, ftpc)) 
+	    FAIL(ERR_STACK, val, STAT_ADR);
 	s->pc = cval;
 	break;
     case I_RET:
 	/* Return Instruction.  Pop address from stack */
 	dval = get_reg_val(s->r, REG_RSP);
-	if (!get_word_val(s->m, dval, &val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n",
-			s->pc, dval);
-	    return STAT_ADR;
-	}
+	if (!load_word(s->m, dval, &val)) 
+	    FAIL(ERR_STACK, dval, STAT_ADR);
+	SAVE_REG(REG_RSP);
 	set_reg_val(s->r, REG_RSP, dval + 8);
 	s->pc = val;
 	break;
     case I_PUSHQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n", s->pc, hi1);
-	    return STAT_INS;
-	}
+	if (!ok1) 
+	    FAIL(ERR_FETCH, 0, STAT_ADR);
+	if (!reg_valid(hi1)) 
+	    FAIL(ERR_REG, hi1, STAT_INS);
 	val = get_reg_val(s->r, hi1);
 	dval = get_reg_val(s->r, REG_RSP) - 8;
+	SAVE_REG(REG_RSP);
 	set_reg_val(s->r, REG_RSP, dval);
-	if  (!set_word_val(s->m, dval, val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n", s->pc, dval);
-	    return STAT_ADR;
-	}
+	SAVE_WORD(dval);
+	if  (!store_word(s->m, dval, val)) 
+	    FAIL(ERR_STACK, dval, STAT_ADR);
 	s->pc = ftpc;
 	break;
     case I_POPQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n", s->pc, hi1);
-	    return STAT_INS;
-	}
+	if (!ok1) 
+	    FAIL(ERR_FETCH, 0, STAT_ADR);
+	if (!reg_valid(hi1)) 
+	    FAIL(ERR_REG, hi1, STAT_INS);
 	dval = get_reg_val(s->r, REG_RSP);
+	SAVE_REG(REG_RSP);
 	set_reg_val(s->r, REG_RSP, dval+8);
-	if (!get_word_val(s->m, dval, &val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n",
-			s->pc, dval);
-	    return STAT_ADR;
-	}
+	if (!load_word(s->m, dval, &val)) 
+	    FAIL(ERR_STACK, dval, STAT_ADR);
+	SAVE_REG(hi1);
 	set_reg_val(s->r, hi1, val);
 	s->pc = ftpc;
 	break;
     case I_IADDQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address",
-			s->pc);
-	    return STAT_INS;
-	}
-	if (!reg_valid(lo1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, lo1);
-	    return STAT_INS;
-	}
+	if (!ok1) 
+	    FAIL(ERR_FETCH, 0, STAT_ADR);
+	if (!okc) 
+	    FAIL(ERR_FETCH_IMM, 0, STAT_INS);
+	if (!reg_valid(lo1)) 
+	    FAIL(ERR_REG, lo1, STAT_INS);
 	argB = get_reg_val(s->r, lo1);
 	val = argB + cval;
+	SAVE_REG(lo1);
 	set_reg_val(s->r, lo1, val);
-	s->cc = compute_cc(A_ADD, cval, argB);
+	DEFER_CC(s->cc, A_ADD, cval, argB, val);
 	s->pc = ftpc;
 	break;
     default:
-	if (error_file)
-	    fprintf(error_file,
-		    "PC = 0x%llx, Invalid instruction %.2x\n", s->pc, byte0);
-	return STAT_INS;
+	FAIL(ERR_INSTR, byte0, STAT_INS);
     }
     return STAT_AOK;
 }
+#undef FAIL
+#undef SAVE_REG
+#undef SAVE_WORD
+
+void format_error(char *buf, word_t pc, run_error_t *e)
+{
+    switch (e->kind) {
+    case ERR_NONE:
+	buf[0] = '\0';
+	break;
+    case ERR_FETCH:
+	sprintf(buf, "PC = 0x%llx, Invalid instruction address\n", pc);
+	break;
+    case ERR_FETCH_IMM:
+	sprintf(buf, "PC = 0x%llx, Invalid instruction address", pc);
+	break;
+    case ERR_FETCH_DISP:
+	sprintf(buf, "PC = 0x%llx, Invalid instruction addres\n", pc);
+	break;
+    case ERR_REG:
+	sprintf(buf, "PC = 0x%llx, Invalid register ID 0x%.1x\n",
+		pc, (int) e->val);
+	break;
+    case ERR_DATA:
+	sprintf(buf, "PC = 0x%llx, Invalid data address 0x%llx\n",
+		pc, e->val);
+	break;
+    case ERR_STACK:
+	sprintf(buf, "PC = 0x%llx, Invalid stack address 0x%llx\n",
+		pc, e->val);
+	break;
+    case ERR_INSTR:
+	sprintf(buf, "PC = 0x%llx, Invalid instruction %.2x\n",
+		pc, (int) e->val);
+	break;
+    }
+}
+
+int instr_length(byte_t instr)
+{
+    switch (HI4(instr)) {
+    case I_RRMOVQ: case I_ALU: case I_PUSHQ: case I_POPQ:
+	return 2;
+    case I_JMP: case I_CALL:
+	return 9;
+    case I_IRMOVQ: case I_RMMOVQ: case I_MRMOVQ: case I_IADDQ:
+	return 10;
+    default:
+	return 1;
+    }
+}
+
+/* Start the record in u of the step s is about to take */
+static inline void begin_step(undo_rec *u, state_ptr s)
+{
+    u->pc = s->pc;
+    u->cc = s->cc;
+    u->reg[0] = u->reg[1] = REG_NONE;
+    u->wrote = FALSE;
+}
+
+/* Start the log entry for the step s is about to take */
+static inline undo_rec *log_step(undo_log_t log, state_ptr s)
+{
+    undo_rec *u = &log->recs[log->next];
+    if (++log->next == log->size)
+	log->next = 0;
+    if (log->count < log->size)
+	log->count++;
+    begin_step(u, s);
+    return u;
+}
+
+/* Describe in rec the step recorded in u, whose first byte was instr.
+   The values written are read back from s */
+static void undo_to_trace(state_ptr s, undo_rec *u, byte_t instr,
+			  stat_t status, trace_rec *rec)
+{
+    int i;
+
+    rec->pc = u->pc;
+    rec->instr = instr;
+    rec->status = status;
+    for (i = 0; i < 2; i++) {
+	rec->reg[i] = u->reg[i];
+	if (u->reg[i] != REG_NONE)
+	    rec->regval[i] = get_reg_val(s->r, u->reg[i]);
+    }
+    rec->wrote = u->wrote;
+    rec->addr = u->addr;
+    if (u->wrote)
+	get_word_val(s->m, u->addr, &rec->word);
+}
+
+/* Execute single instruction, adding it to the undo log and trace of s
+   if they are on */
+static inline stat_t logged_step(state_ptr s, run_error_t *errp)
+{
+    undo_rec tmp;
+    undo_rec *u = s->undo ? log_step(s->undo, s) : NULL;
+    byte_t instr = 0;
+    stat_t status;
+    trace_rec rec;
+
+    if (!s->trace)
+	return exec_state(s, errp, u);
+    if (!u) {
+	u = &tmp;
+	begin_step(u, s);
+    }
+    get_byte_val(s->m, s->pc, &instr);
+    status = exec_state(s, errp, u);
+    undo_to_trace(s, u, instr, status, &rec);
+    trace_step(s->trace, &rec);
+    return status;
+}
+
+stat_t record_step(state_ptr s, trace_rec *rec)
+{
+    run_error_t err;
+    undo_rec u;
+    byte_t instr = 0;
+    stat_t status;
+
+    begin_step(&u, s);
+    get_byte_val(s->m, s->pc, &instr);
+    status = exec_state(s, &err, &u);
+    undo_to_trace(s, &u, instr, status, rec);
+    return status;
+}
+
+/* Execute single instruction.  Return status. */
+stat_t step_state(state_ptr s, FILE *error_file)
+{
+    run_error_t err;
+    stat_t status = logged_step(s, &err);
+    if (error_file && (status == STAT_ADR || status == STAT_INS)) {
+	char msg[ERR_MSG_LEN];
+	format_error(msg, s->pc, &err);
+	fputs(msg, error_file);
+    }
+    return status;
+}
+
+word_t run_state(state_ptr s, word_t max_steps, run_result *res)
+{
+    run_error_t err;
+    stat_t status = STAT_AOK;
+    word_t steps = 0;
+
+    if (s->undo || s->trace) {
+	/* Every step must be logged, so no loops are skipped */
+	while (steps < max_steps) {
+	    status = logged_step(s, &err);
+	    steps++;
+	    if (status != STAT_AOK)
+		break;
+	}
+    } else {
+	while (steps < max_steps) {
+	    word_t pc = s->pc;
+	    status = exec_state(s, &err, NULL);
+	    steps++;
+	    if (status != STAT_AOK)
+		break;
+	    if (s->pc <= pc && steps < max_steps)
+		steps += fast_forward(s, pc, max_steps - steps);
+	}
+    }
+
+    res->steps = steps;
+    res->status = status;
+    res->pc = s->pc;
+    if (status == STAT_ADR || status == STAT_INS)
+	format_error(res->msg, s->pc, &err);
+    else
+	res->msg[0] = '\0';
+    return steps;
+}
+
+void start_undo(state_ptr s, word_t size)
+{
+    undo_log_t log = (undo_log_t) malloc(sizeof(undo_log_rec));
+    stop_undo(s);
+    log->recs = (undo_rec *) malloc(size * sizeof(undo_rec));
+    log->size = size;
+    log->next = 0;
+    log->count = 0;
+    s->undo = log;
+}
+
+void stop_undo(state_ptr s)
+{
+    if (!s->undo)
+	return;
+    free((void *) s->undo->recs);
+    free((void *) s->undo);
+    s->undo = NULL;
+}
+
+/* Zigzag form of v, so that small negative values stay small */
+#define ZIGZAG(v) (((uword_t) (v) << 1) ^ (uword_t) ((word_t) (v) >> 63))
+
+/* Store v at p in 7-bit groups, low first.  Return end of encoding */
+static inline byte_t *put_varint(byte_t *p, uword_t v)
+{
+    while (v >= 0x80) {
+	*p++ = (byte_t) v | 0x80;
+	v >>= 7;
+    }
+    *p++ = (byte_t) v;
+    return p;
+}
+
+/* Hand the batch being filled to the writer thread and start the next */
+static void next_batch(trace_t t)
+{
+    __atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+    /* Wait until the writer has finished with the batch to be filled */
+    while (t->head - __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE) == TRACE_RING)
+	sched_yield();
+    t->ring[t->head % TRACE_RING].len = 0;
+}
+
+void trace_step(trace_t t, trace_rec *rec)
+{
+    trace_batch_rec *b = &t->ring[t->head % TRACE_RING];
+    byte_t *start = b->data + b->len;
+    byte_t *p = start + 1;
+    byte_t tag = 0;
+    int i;
+
+    if (rec->pc != t->pc) {
+	tag |= TRACE_JUMP;
+	p = put_varint(p, ZIGZAG(rec->pc - t->pc));
+    }
+    *p++ = rec->instr;
+    t->pc = rec->pc + instr_length(rec->instr);
+    if (rec->status != STAT_AOK) {
+	tag |= TRACE_STAT;
+	*p++ = rec->status;
+    }
+    if (rec->reg[0] != REG_NONE) {
+	*p++ = HPACK(rec->reg[0], rec->reg[1]);
+	for (i = 0; i < 2 && rec->reg[i] != REG_NONE; i++) {
+	    word_t *last = &t->regs[rec->reg[i]];
+	    p = put_varint(p, ZIGZAG(rec->regval[i] - *last));
+	    *last = rec->regval[i];
+	    tag++;
+	}
+    }
+    if (rec->wrote) {
+	tag |= TRACE_MEM;
+	p = put_varint(p, ZIGZAG(rec->addr - t->addr));
+	p = put_varint(p, ZIGZAG(rec->word));
+	t->addr = rec->addr;
+    }
+    *start = tag;
+    b->len = p - b->data;
+    t->bytes += p - start;
+    t->steps++;
+    if (b->len > TRACE_BATCH - TRACE_MAX_REC)
+	next_batch(t);
+}
+
+/* Take the newest entry off the log and undo its step */
+static undo_rec *undo_step(state_ptr s)
+{
+    undo_log_t log = s->undo;
+    undo_rec *u;
+    log->next = (log->next ? log->next : log->size) - 1;
+    log->count--;
+    u = &log->recs[log->next];
+    if (u->wrote)
+	set_word_val(s->m, u->addr, u->word);
+    /* Second write first, in case both were to the same register */
+    if (u->reg[1] != REG_NONE)
+	set_reg_val(s->r, u->reg[1], u->regval[1]);
+    if (u->reg[0] != REG_NONE)
+	set_reg_val(s->r, u->reg[0], u->regval[0]);
+    s->cc = u->cc;
+    s->pc = u->pc;
+    return u;
+}
+
+word_t undo_steps(state_ptr s, word_t n)
+{
+    word_t done = 0;
+    if (!s->undo)
+	return 0;
+    while (done < n && s->undo->count > 0) {
+	undo_step(s);
+	done++;
+    }
+    return done;
+}
+
+word_t undo_to_write(state_ptr s, word_t addr, bool_t *found)
+{
+    word_t done = 0;
+    *found = FALSE;
+    if (!s->undo)
+	return 0;
+    while (s->undo->count > 0) {
+	undo_rec *u = undo_step(s);
+	done++;
+	if (u->wrote && u->addr < addr + 8 && addr < u->addr + 8) {
+	    *found = TRUE;
+	    break;
+	}
+    }
+    return done;
+}
+
+/* Longest loop body considered by fast_forward, in instructions */
+#define FF_MAX_BODY 16
+
+#define WORD_MAX ((word_t) (~(uword_t) 0 >> 1))
+#define WORD_MIN (-WORD_MAX - 1)
+
+/*
+ * Number of leading values of x, x+d, x+2d, ... that are within the
+ * range of word_t, at most limit
+ */
+static word_t span(word_t x, word_t d, word_t limit)
+{
+    uword_t room, step;
+    if (d == 0)
+	return limit;
+    if (d > 0) {
+	room = (uword_t) WORD_MAX - (uword_t) x;
+	step = (uword_t) d;
+    } else {
+	room = (uword_t) x - (uword_t) WORD_MIN;
+	step = (uword_t) 0 - (uword_t) d;
+    }
+    if (room / step >= (uword_t) limit)
+	return limit;
+    return room / step + 1;
+}
+
+/*
+ * Number of leading values of v, v+d, v+2d, ... for which condition c
+ * holds, at most limit.  The values are assumed not to wrap around,
+ * so the condition codes are zero, sign and no overflow
+ */
+static word_t cond_count(cond_t c, word_t v, word_t d, word_t limit)
+{
+    uword_t n, step, cnt;
+    bool_t holds = cond_holds(PACK_CC(v == 0, v < 0, 0), c);
+
+    if (!holds)
+	return 0;
+    if (d == 0 || c == C_YES)
+	return limit;
+    step = d > 0 ? (uword_t) d : (uword_t) 0 - (uword_t) d;
+    switch (c) {
+    case C_E:
+	/* Only v itself is zero */
+	return 1;
+    case C_NE:
+	/* Holds until the values reach zero, if they ever do */
+	if ((v < 0) != (d > 0) || v == 0)
+	    return limit;
+	n = v < 0 ? (uword_t) 0 - (uword_t) v : (uword_t) v;
+	if (n % step != 0)
+	    return limit;
+	cnt = n / step;
+	break;
+    case C_G:
+    case C_GE:
+	/* v >= 0 here.  Holds while the values stay positive (or zero) */
+	if (d > 0)
+	    return limit;
+	cnt = c == C_G ? ((uword_t) v - 1) / step + 1 : (uword_t) v / step + 1;
+	break;
+    case C_L:
+    case C_LE:
+	/* v <= 0 here.  Holds while the values stay negative (or zero) */
+	if (d < 0)
+	    return limit;
+	n = (uword_t) 0 - (uword_t) v;
+	cnt = c == C_L ? (n - 1) / step + 1 : n / step + 1;
+	break;
+    default:
+	return 0;
+    }
+    return cnt < (uword_t) limit ? (word_t) cnt : limit;
+}
+
+/* Value of a register at some point of a loop iteration: either
+   its value at the start of the iteration plus c, or c */
+typedef struct {
+    bool_t old;
+    word_t c;
+} ff_val;
+
+word_t fast_forward(state_ptr s, word_t jpc, word_t max_steps)
+{
+    dinstr_ptr j = decode_instr(s->m, jpc);
+    dinstr_ptr body[FF_MAX_BODY];
+    ff_val sym[REG_NONE];
+    /* Register operands read in the body, and their values */
+    reg_id_t use_reg[FF_MAX_BODY];
+    ff_val use_val[FF_MAX_BODY];
+    int nuse = 0;
+    /* Last instruction setting the condition codes, and its operands */
+    dinstr_ptr flag = NULL;
+    ff_val flag_pre = { FALSE, 0 };
+    word_t flag_arg = 0;
+    word_t src;
+    word_t delta[REG_NONE];
+    word_t len, limit, k, i;
+    word_t pc = s->pc;
+    int n = 0;
+    reg_id_t id;
+
+    if (!j || j->noloop || j->icode != I_JMP || j->valc != s->pc)
+	return 0;
+
+    /* Collect the straight-line body from the loop head to the jump */
+    while (pc != jpc) {
+	dinstr_ptr d = decode_instr(s->m, pc);
+	if (!d || n == FF_MAX_BODY - 1 || pc > jpc)
+	    goto noloop;
+	body[n++] = d;
+	pc = d->valp;
+    }
+    len = n + 1;
+
+    for (id = REG_RAX; id < REG_NONE; id++) {
+	sym[id].old = TRUE;
+	sym[id].c = 0;
+    }
+
+    /* Track register values through one iteration */
+    for (i = 0; i < n; i++) {
+	dinstr_ptr d = body[i];
+	if (!d->ok1 || !d->okc)
+	    goto noloop;
+	switch (d->icode) {
+	case I_NOP:
+	    break;
+	case I_IRMOVQ:
+	    if (!reg_valid(d->rb))
+		goto noloop;
+	    sym[d->rb].old = FALSE;
+	    sym[d->rb].c = d->valc;
+	    break;
+	case I_IADDQ:
+	    if (!reg_valid(d->rb))
+		goto noloop;
+	    flag = d;
+	    flag_pre = sym[d->rb];
+	    flag_arg = d->valc;
+	    sym[d->rb].c = (uword_t) sym[d->rb].c + (uword_t) d->valc;
+	    break;
+	case I_RRMOVQ:
+	case I_ALU:
+	    if (!reg_valid(d->ra) || !reg_valid(d->rb))
+		goto noloop;
+	    if (d->icode == I_ALU && d->ifun == A_AND && d->ra == d->rb) {
+		/* Test of a register */
+		flag = d;
+		flag_pre = sym[d->rb];
+		break;
+	    }
+	    if (d->icode == I_RRMOVQ ? d->ifun != C_YES :
+		(d->ifun != A_ADD && d->ifun != A_SUB) || d->ra == d->rb)
+		goto noloop;
+	    use_reg[nuse] = d->ra;
+	    use_val[nuse] = sym[d->ra];
+	    /* Read the source before writing rb, which may be the same */
+	    src = (uword_t) (sym[d->ra].old ? get_reg_val(s->r, d->ra) : 0)
+		+ (uword_t) sym[d->ra].c;
+	    nuse++;
+	    if (d->icode == I_RRMOVQ) {
+		sym[d->rb].old = FALSE;
+		sym[d->rb].c = src;
+	    } else {
+		flag = d;
+		flag_pre = sym[d->rb];
+		flag_arg = src;
+		if (d->ifun == A_ADD)
+		    sym[d->rb].c = (uword_t) sym[d->rb].c + (uword_t) flag_arg;
+		else
+		    sym[d->rb].c = (uword_t) sym[d->rb].c - (uword_t) flag_arg;
+	    }
+	    break;
+	default:
+	    goto noloop;
+	}
+    }
+
+    /* Each iteration must add a fixed amount to each register.  A
+       register set to a constant qualifies if it already holds it */
+    for (id = REG_RAX; id < REG_NONE; id++) {
+	if (sym[id].old)
+	    delta[id] = sym[id].c;
+	else if (sym[id].c == get_reg_val(s->r, id))
+	    delta[id] = 0;
+	else
+	    return 0;
+    }
+    /* ... and operands must not change from one iteration to the next */
+    for (i = 0; i < nuse; i++)
+	if (use_val[i].old && delta[use_reg[i]] != 0)
+	    goto noloop;
+
+    limit = max_steps / len;
+    if (!flag) {
+	/* Condition codes are left alone */
+	k = cond_holds(get_cc(&s->cc), j->ifun) ? limit : 0;
+    } else {
+	/* The flag-setting instruction sees pre, pre+dp, pre+2dp, ...
+	   and produces v, v+dp, v+2dp, ... */
+	word_t pre = (uword_t) (flag_pre.old ? get_reg_val(s->r, flag->rb) : 0)
+	    + (uword_t) flag_pre.c;
+	word_t dp = flag_pre.old ? delta[flag->rb] : 0;
+	word_t v = pre;
+	if (flag->icode == I_IADDQ || flag->ifun == A_ADD) {
+	    v = (uword_t) pre + (uword_t) flag_arg;
+	    if (GET_OF(compute_cc(A_ADD, flag_arg, pre)))
+		return 0;
+	} else if (flag->ifun == A_SUB) {
+	    v = (uword_t) pre - (uword_t) flag_arg;
+	    if (GET_OF(compute_cc(A_SUB, flag_arg, pre)))
+		return 0;
+	}
+	k = cond_count(j->ifun, v, dp, limit);
+	k = span(pre, dp, k);
+	k = span(v, dp, k);
+	if (k > 0) {
+	    /* Condition codes of the last skipped iteration */
+	    pre += (k - 1) * dp;
+	    if (flag->icode == I_IADDQ || flag->ifun == A_ADD)
+		DEFER_CC(s->cc, A_ADD, flag_arg, pre, pre + flag_arg);
+	    else if (flag->ifun == A_SUB)
+		DEFER_CC(s->cc, A_SUB, flag_arg, pre, pre - flag_arg);
+	    else
+		DEFER_CC(s->cc, A_AND, pre, pre, pre);
+	}
+    }
+    if (k == 0)
+	return 0;
+
+    for (id = REG_RAX; id < REG_NONE; id++)
+	if (delta[id] != 0)
+	    set_reg_val(s->r, id, (word_t) ((uword_t) get_reg_val(s->r, id) +
+					    (uword_t) k * (uword_t) delta[id]));
+    return k * len;
+
+ noloop:
+    j->noloop = TRUE;
+    return 0;
+}
@@ -0,0 +1,828 @@
+/*
+ * Dynamic binary translator for the Y86-64 ISA (x86-64 hosts only).
+ *
+ * Basic blocks are translated on first execution into host code in an
+ * executable buffer.  Y86-64 registers %rax through %r10 are pinned to
+ * host registers for as long as translated code runs; %r11 through %r14
+ * live in the translator's context record.  Condition codes stay in the
+ * host flags within a block, so a jXX or cmovXX right after an ALU
+ * operation tests them directly.  They are packed into the Y86-64 CC only
+ * when the block exits or the flags are about to be clobbered.
+ *
+ * Control leaves translated code, and returns here, whenever something
+ * needs the reference interpreter: an instruction that is not
+ * translated (halt, mulq, divq, invalid encodings), a memory access out
+ * of bounds, a store to a page that is not ready to write (the first
+ * one since a snapshot, say), a store that overlaps decoded code, or
+ * too few steps left in the budget for the next block.  step_state then
+ * executes the instruction, so statuses, error messages and step counts
+ * are the same as for the interpreter.  A store over decoded code
+ * discards only the translations whose instructions it overlaps.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include "isa.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+/* Size of the executable code buffer */
+#define JIT_CODE_SIZE (4<<20)
+
+/* Flush translations when less than this much buffer is left */
+#define JIT_CODE_SLACK (8<<10)
+
+/* Maximum number of instructions in a translated block */
+#define JIT_MAX_BLOCK 32
+
+/* Reasons for leaving translated code */
+typedef enum { EXIT_LOOKUP, EXIT_STEP, EXIT_BUDGET, EXIT_SMC } exit_t;
+
+/* State shared between translated code and run_jit.  The fields before
+   regs must stay within reach of 8-bit displacements */
+typedef struct {
+    word_t pc;           /* PC on exit */
+    word_t budget;       /* Steps that may still be executed */
+    word_t addr;         /* Address of store that hit decoded code */
+    byte_t *membase;     /* Memory contents */
+    byte_t *blocks;      /* Memory's icache_blocks */
+    word_t *page_gen;    /* Memory's page generations */
+    word_t gen;          /* and current generation */
+    void **table;        /* Translated code for each PC */
+    int reason;          /* exit_t */
+    cc_t cc;
+    word_t regs[16];     /* Y86-64 registers */
+} jit_ctx;
+
+/* Host registers */
+enum { H_RAX, H_RCX, H_RDX, H_RBX, H_RSP, H_RBP, H_RSI, H_RDI,
+       H_R8, H_R9, H_R10, H_R11, H_R12, H_R13, H_R14, H_R15 };
+
+/*
+ * Host register pinned to each Y86-64 register, or -1 if it lives in
+ * jit_ctx.  %rax and %rdx are scratch, %rbp points to the jit_ctx and
+ * %r15 to the memory contents.
+ */
+static const int host_reg[16] = {
+    H_RBX, H_RCX, H_RSI, H_RDI, H_R8, H_R9, H_R10, H_R11,
+    H_R12, H_R13, H_R14, -1, -1, -1, -1, -1
+};
+
+/* Host condition (low nibble of jcc/cmovcc opcodes) for each cond_t */
+static const int host_cond[7] = { -1, 0xE, 0xC, 0x4, 0x5, 0xD, 0xF };
+
+#define CTX_OFF(field) ((int) offsetof(jit_ctx, field))
+#define REG_OFF(id) (CTX_OFF(regs) + 8 * (id))
+
+/* Pending forward jump to an out-of-line exit path */
+typedef enum { STUB_STEP, STUB_SMC, STUB_BUDGET, STUB_GOTO } stub_t;
+
+typedef struct {
+    stub_t kind;
+    byte_t *patch;      /* rel32 field to point at the stub */
+    word_t pc;
+    int unexec;         /* Block instructions not executed */
+} stub_rec;
+
+typedef struct {
+    mem_t m;
+    byte_t *code;       /* Executable buffer */
+    byte_t *p;          /* Next free byte */
+    byte_t *start;      /* First byte after the fixed routines */
+    byte_t *epilogue;   /* Return to run_jit, eax = reason, rdx = pc */
+    byte_t *miss;       /* Exit for PC without translation, rdx = pc */
+    void (*enter)(jit_ctx *ctx, void *target);
+    void **table;
+    word_t *ends;       /* End of the code translated at each PC */
+    byte_t *xmap;       /* Blocks of memory holding translated code */
+    stub_rec stubs[6*JIT_MAX_BLOCK];
+    int nstubs;
+    bool_t cc_live;     /* Host flags hold the Y86-64 CC, not yet saved */
+} jit_rec, *jit_ptr;
+
+/***************** Instruction encoding ****************/
+
+static void emit_byte(jit_ptr j, int b)
+{
+    *j->p++ = (byte_t) b;
+}
+
+static void emit_word32(jit_ptr j, int v)
+{
+    memcpy(j->p, &v, 4);
+    j->p += 4;
+}
+
+static void emit_word64(jit_ptr j, word_t v)
+{
+    memcpy(j->p, &v, 8);
+    j->p += 8;
+}
+
+/* Opcodes above 0xFF are two-byte opcodes */
+static void emit_op(jit_ptr j, int op)
+{
+    if (op > 0xFF)
+	emit_byte(j, op >> 8);
+    emit_byte(j, op & 0xFF);
+}
+
+/* REX.W prefix, extending ModRM.reg, SIB.index and base */
+static void emit_rex(jit_ptr j, int reg, int index, int base)
+{
+    emit_byte(j, 0x48 | ((reg & 8) >> 1) | ((index & 8) >> 2) |
+	      ((base & 8) >> 3));
+}
+
+/* op reg, rm with both operands in registers */
+static void emit_rr(jit_ptr j, int op, int reg, int rm)
+{
+    emit_rex(j, reg, 0, rm);
+    emit_op(j, op);
+    emit_byte(j, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* op reg, [base + disp] */
+static void emit_rm(jit_ptr j, int op, int reg, int base, int disp)
+{
+    int mod = (disp == 0 && (base & 7) != H_RBP) ? 0 :
+	(disp >= -128 && disp < 128) ? 1 : 2;
+    emit_rex(j, reg, 0, base);
+    emit_op(j, op);
+    emit_byte(j, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == H_RSP)
+	emit_byte(j, 0x24);
+    if (mod == 1)
+	emit_byte(j, disp);
+    else if (mod == 2)
+	emit_word32(j, disp);
+}
+
+/* op reg, [r15 + rdx]: access to simulated memory */
+static void emit_rmem(jit_ptr j, int op, int reg)
+{
+    emit_rex(j, reg, H_RDX, H_R15);
+    emit_op(j, op);
+    emit_byte(j, ((reg & 7) << 3) | 4);
+    emit_byte(j, (H_RDX << 3) | (H_R15 & 7));
+}
+
+static bool_t fits_int32(word_t v)
+{
+    return v >= -0x80000000LL && v <= 0x7FFFFFFFLL;
+}
+
+/* mov reg, val */
+static void emit_mov_imm(jit_ptr j, int reg, word_t val)
+{
+    if (val >= 0 && val <= 0xFFFFFFFFLL) {
+	if (reg & 8)
+	    emit_byte(j, 0x41);
+	emit_byte(j, 0xB8 + (reg & 7));
+	emit_word32(j, (int) val);
+    } else if (fits_int32(val)) {
+	emit_rr(j, 0xC7, 0, reg);
+	emit_word32(j, (int) val);
+    } else {
+	emit_rex(j, 0, 0, reg);
+	emit_byte(j, 0xB8 + (reg & 7));
+	emit_word64(j, val);
+    }
+}
+
+/* Jump (cc < 0) or conditional jump to target */
+static void emit_jump(jit_ptr j, int cc, byte_t *target)
+{
+    if (cc < 0)
+	emit_byte(j, 0xE9);
+    else
+	emit_op(j, 0x0F80 | cc);
+    emit_word32(j, (int) (target - (j->p + 4)));
+}
+
+/* Jump (cc < 0) or conditional jump to a stub emitted after the block */
+static void emit_stub_jump(jit_ptr j, int cc, stub_t kind, word_t pc,
+			   int unexec)
+{
+    stub_rec *st = &j->stubs[j->nstubs++];
+    if (cc < 0)
+	emit_byte(j, 0xE9);
+    else
+	emit_op(j, 0x0F80 | cc);
+    st->kind = kind;
+    st->patch = j->p;
+    st->pc = pc;
+    st->unexec = unexec;
+    emit_word32(j, 0);
+}
+
+/************ Translation of Y86-64 operations ************/
+
+/* Host register holding Y86-64 register id, loading it into scratch if
+   the register lives in the context */
+static int use_reg(jit_ptr j, int id, int scratch)
+{
+    if (host_reg[id] >= 0)
+	return host_reg[id];
+    emit_rm(j, 0x8B, scratch, H_RBP, REG_OFF(id));
+    return scratch;
+}
+
+/* Store value computed in host register hreg into Y86-64 register id */
+static void def_reg(jit_ptr j, int id, int hreg)
+{
+    if (host_reg[id] < 0)
+	emit_rm(j, 0x89, hreg, H_RBP, REG_OFF(id));
+    else if (host_reg[id] != hreg)
+	emit_rr(j, 0x89, hreg, host_reg[id]);
+}
+
+/* Pack live host flags into the context's CC.  Leaves the flags intact */
+static void save_cc(jit_ptr j)
+{
+    static const byte_t pack[] = {
+	0x0F, 0x94, 0xC0,	/* setz al */
+	0x0F, 0x98, 0xC2,	/* sets dl */
+	0x8D, 0x04, 0x42,	/* lea eax, [rdx+rax*2] */
+	0x0F, 0x90, 0xC2,	/* seto dl */
+	0x8D, 0x04, 0x42	/* lea eax, [rdx+rax*2] */
+    };
+    if (!j->cc_live)
+	return;
+    memcpy(j->p, pack, sizeof(pack));
+    j->p += sizeof(pack);
+    /* mov [rbp+cc], al */
+    emit_byte(j, 0x88);
+    emit_byte(j, 0x45);
+    emit_byte(j, CTX_OFF(cc));
+    j->cc_live = FALSE;
+}
+
+/*
+ * Make a host condition reflect Y86-64 condition bcond, returning the
+ * host condition code to test.  Uses the host flags directly when they
+ * still hold the CC, otherwise looks up the stored CC in a truth table.
+ * Clobbers rax and rdx in the second case.
+ */
+static int emit_cond(jit_ptr j, cond_t bcond)
+{
+    int mask = 0;
+    int c;
+    if (j->cc_live)
+	return host_cond[bcond];
+    for (c = 0; c < 8; c++)
+	if (cond_holds(c, bcond))
+	    mask |= 1 << c;
+    /* movzx eax, byte [rbp+cc] */
+    emit_byte(j, 0x0F);
+    emit_byte(j, 0xB6);
+    emit_byte(j, 0x45);
+    emit_byte(j, CTX_OFF(cc));
+    /* mov edx, mask; bt edx, eax */
+    emit_mov_imm(j, H_RDX, mask);
+    emit_byte(j, 0x0F);
+    emit_byte(j, 0xA3);
+    emit_byte(j, 0xC2);
+    return 0x2;		/* Carry set */
+}
+
+/* Continue at a known PC */
+static void emit_goto(jit_ptr j, word_t pc)
+{
+    save_cc(j);
+    emit_mov_imm(j, H_RDX, pc);
+    if (pc < 0 || pc >= j->m->len) {
+	emit_jump(j, -1, j->miss);
+	return;
+    }
+    /* mov rax, [rbp+table]; jmp [rax + pc*8] */
+    emit_rm(j, 0x8B, H_RAX, H_RBP, CTX_OFF(table));
+    emit_rm(j, 0xFF, 4, H_RAX, (int) pc * 8);
+}
+
+/* Continue at the PC held in rdx.  The CC must already be saved */
+static void emit_goto_rdx(jit_ptr j)
+{
+    /* cmp rdx, len; jae miss */
+    emit_rr(j, 0x81, 7, H_RDX);
+    emit_word32(j, j->m->len);
+    emit_jump(j, 0x3, j->miss);
+    /* mov rax, [rbp+table]; jmp [rax + rdx*8] */
+    emit_rm(j, 0x8B, H_RAX, H_RBP, CTX_OFF(table));
+    emit_byte(j, 0xFF);
+    emit_byte(j, 0x24);
+    emit_byte(j, 0xD0);
+}
+
+/* Set rdx to the effective address valc + rb */
+static void emit_addr(jit_ptr j, dinstr_ptr d)
+{
+    if (d->rb == REG_NONE) {
+	emit_mov_imm(j, H_RDX, d->valc);
+	return;
+    }
+    if (fits_int32(d->valc)) {
+	int base = host_reg[d->rb];
+	if (base < 0) {
+	    emit_rm(j, 0x8B, H_RDX, H_RBP, REG_OFF(d->rb));
+	    base = H_RDX;
+	}
+	/* lea rdx, [base + valc] */
+	emit_rm(j, 0x8D, H_RDX, base, (int) d->valc);
+    } else {
+	emit_mov_imm(j, H_RDX, d->valc);
+	emit_rr(j, 0x01, use_reg(j, d->rb, H_RAX), H_RDX);
+    }
+}
+
+/* Leave for the interpreter at instruction i of n unless rdx is a valid
+   address for an 8-byte access.  The CC must already be saved */
+static void emit_check_addr(jit_ptr j, word_t pc, int i, int n)
+{
+    /* cmp rdx, len-8; ja step */
+    emit_rr(j, 0x81, 7, H_RDX);
+    emit_word32(j, j->m->len - 8);
+    emit_stub_jump(j, 0x7, STUB_STEP, pc, n - i);
+}
+
+/* Leave for the interpreter at instruction i of n unless the pages of
+   an 8-byte store at rdx are ready to write (see PAGE_READY) */
+static void emit_check_ready(jit_ptr j, word_t pc, int i, int n)
+{
+    int k;
+    for (k = 0; k < 8; k += 7) {
+	/* lea rax, [rdx+k]; shr rax, SHIFT; shl rax, 3 */
+	emit_rm(j, 0x8D, H_RAX, H_RDX, k);
+	emit_rr(j, 0xC1, 5, H_RAX);
+	emit_byte(j, MEM_PAGE_SHIFT);
+	emit_rr(j, 0xC1, 4, H_RAX);
+	emit_byte(j, 3);
+	/* add rax, [rbp+page_gen]; mov rax, [rax]; cmp rax, [rbp+gen] */
+	emit_rm(j, 0x03, H_RAX, H_RBP, CTX_OFF(page_gen));
+	emit_rm(j, 0x8B, H_RAX, H_RAX, 0);
+	emit_rm(j, 0x3B, H_RAX, H_RBP, CTX_OFF(gen));
+	emit_stub_jump(j, 0x5, STUB_STEP, pc, n - i);
+    }
+}
+
+/* After a store of 8 bytes at rdx by instruction i of n, leave if the
+   store may have overwritten decoded code */
+static void emit_check_smc(jit_ptr j, word_t npc, int i, int n)
+{
+    int k;
+    for (k = 0; k < 8; k += 7) {
+	/* lea rax, [rdx+k]; shr rax, SHIFT; add rax, [rbp+blocks] */
+	emit_rm(j, 0x8D, H_RAX, H_RDX, k);
+	emit_rr(j, 0xC1, 5, H_RAX);
+	emit_byte(j, ICACHE_BLOCK_SHIFT);
+	emit_rm(j, 0x03, H_RAX, H_RBP, CTX_OFF(blocks));
+	/* cmp byte [rax], 0; jne smc */
+	emit_byte(j, 0x80);
+	emit_byte(j, 0x38);
+	emit_byte(j, 0x00);
+	emit_stub_jump(j, 0x5, STUB_SMC, npc, n - i - 1);
+    }
+}
+
+/* Can translated code execute this instruction? */
+static bool_t translatable(dinstr_ptr d)
+{
+    switch (d->icode) {
+    case I_NOP:
+	return TRUE;
+    case I_RRMOVQ:
+	return d->ok1 && d->ifun <= C_G &&
+	    reg_valid(d->ra) && reg_valid(d->rb);
+    case I_IRMOVQ:
+    case I_IADDQ:
+	return d->ok1 && d->okc && reg_valid(d->rb);
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+	return d->ok1 && d->okc && reg_valid(d->ra);
+    case I_ALU:
+	/* mulq and divq are left to compute_alu and compute_cc */
+	return d->ok1 && d->ifun <= A_XOR &&
+	    reg_valid(d->ra) && reg_valid(d->rb);
+    case I_JMP:
+	return d->ok1 && d->okc && d->ifun <= C_G;
+    case I_CALL:
+	return d->okc;
+    case I_RET:
+	return TRUE;
+    case I_PUSHQ:
+    case I_POPQ:
+	return d->ok1 && reg_valid(d->ra);
+    default:
+	return FALSE;
+    }
+}
+
+/* Emit instruction i of an n-instruction block */
+static void emit_instr(jit_ptr j, dinstr_ptr d, word_t pc, int i, int n)
+{
+    static const int alu_ops[4] = { 0x01, 0x29, 0x21, 0x31 };
+    int a, b, cc;
+
+    /* Memory accesses need rax, rdx and the flags */
+    if (d->icode == I_RMMOVQ || d->icode == I_MRMOVQ ||
+	d->icode == I_CALL || d->icode == I_RET ||
+	d->icode == I_PUSHQ || d->icode == I_POPQ)
+	save_cc(j);
+
+    switch (d->icode) {
+    case I_NOP:
+	break;
+    case I_RRMOVQ:
+	if (d->ifun == C_YES) {
+	    a = use_reg(j, d->ra, H_RAX);
+	    def_reg(j, d->rb, a);
+	    break;
+	}
+	cc = emit_cond(j, d->ifun);
+	b = use_reg(j, d->rb, H_RDX);
+	if (host_reg[d->ra] >= 0)
+	    emit_rr(j, 0x0F40 | cc, b, host_reg[d->ra]);
+	else
+	    emit_rm(j, 0x0F40 | cc, b, H_RBP, REG_OFF(d->ra));
+	def_reg(j, d->rb, b);
+	break;
+    case I_IRMOVQ:
+	if (host_reg[d->rb] >= 0)
+	    emit_mov_imm(j, host_reg[d->rb], d->valc);
+	else {
+	    emit_mov_imm(j, H_RAX, d->valc);
+	    def_reg(j, d->rb, H_RAX);
+	}
+	break;
+    case I_RMMOVQ:
+	emit_addr(j, d);
+	emit_check_addr(j, pc, i, n);
+	emit_check_ready(j, pc, i, n);
+	emit_rmem(j, 0x89, use_reg(j, d->ra, H_RAX));
+	emit_check_smc(j, d->valp, i, n);
+	break;
+    case I_MRMOVQ:
+	emit_addr(j, d);
+	emit_check_addr(j, pc, i, n);
+	a = host_reg[d->ra] >= 0 ? host_reg[d->ra] : H_RAX;
+	emit_rmem(j, 0x8B, a);
+	def_reg(j, d->ra, a);
+	break;
+    case I_ALU:
+	if (host_reg[d->rb] >= 0) {
+	    if (host_reg[d->ra] >= 0)
+		emit_rr(j, alu_ops[d->ifun], host_reg[d->ra], host_reg[d->rb]);
+	    else	/* op rb, [rbp+ra] */
+		emit_rm(j, alu_ops[d->ifun] + 2, host_reg[d->rb],
+			H_RBP, REG_OFF(d->ra));
+	} else {	/* op [rbp+rb], ra */
+	    a = use_reg(j, d->ra, H_RAX);
+	    emit_rm(j, alu_ops[d->ifun], a, H_RBP, REG_OFF(d->rb));
+	}
+	j->cc_live = TRUE;
+	break;
+    case I_IADDQ:
+	b = use_reg(j, d->rb, H_RDX);
+	if (fits_int32(d->valc)) {
+	    emit_rr(j, 0x81, 0, b);
+	    emit_word32(j, (int) d->valc);
+	} else {
+	    emit_mov_imm(j, H_RAX, d->valc);
+	    emit_rr(j, 0x01, H_RAX, b);
+	}
+	def_reg(j, d->rb, b);
+	j->cc_live = TRUE;
+	break;
+    case I_JMP:
+	if (d->ifun == C_YES) {
+	    emit_goto(j, d->valc);
+	    break;
+	}
+	cc = emit_cond(j, d->ifun);
+	save_cc(j);
+	emit_stub_jump(j, cc, STUB_GOTO, d->valc, 0);
+	emit_goto(j, d->valp);
+	break;
+    case I_CALL:
+	/* lea rdx, [rsp-8]; check; mov [r15+rdx], valp; rsp = rdx */
+	emit_rm(j, 0x8D, H_RDX, host_reg[REG_RSP], -8);
+	emit_check_addr(j, pc, i, n);
+	emit_check_ready(j, pc, i, n);
+	emit_rmem(j, 0xC7, 0);
+	emit_word32(j, (int) d->valp);
+	def_reg(j, REG_RSP, H_RDX);
+	emit_check_smc(j, d->valc, i, n);
+	emit_goto(j, d->valc);
+	break;
+    case I_RET:
+	emit_rr(j, 0x89, host_reg[REG_RSP], H_RDX);
+	emit_check_addr(j, pc, i, n);
+	/* mov rax, [r15+rdx]; lea rsp, [rdx+8]; mov rdx, rax */
+	emit_rmem(j, 0x8B, H_RAX);
+	emit_rm(j, 0x8D, host_reg[REG_RSP], H_RDX, 8);
+	emit_rr(j, 0x89, H_RAX, H_RDX);
+	emit_goto_rdx(j);
+	break;
+    case I_PUSHQ:
+	emit_rm(j, 0x8D, H_RDX, host_reg[REG_RSP], -8);
+	emit_check_addr(j, pc, i, n);
+	emit_check_ready(j, pc, i, n);
+	emit_rmem(j, 0x89, use_reg(j, d->ra, H_RAX));
+	def_reg(j, REG_RSP, H_RDX);
+	emit_check_smc(j, d->valp, i, n);
+	break;
+    case I_POPQ:
+	emit_rr(j, 0x89, host_reg[REG_RSP], H_RDX);
+	emit_check_addr(j, pc, i, n);
+	emit_rmem(j, 0x8B, H_RAX);
+	emit_rm(j, 0x8D, host_reg[REG_RSP], H_RDX, 8);
+	def_reg(j, d->ra, H_RAX);
+	break;
+    default:
+	break;
+    }
+}
+
+/* Emit the out-of-line exits requested by the block just translated */
+static void emit_stubs(jit_ptr j)
+{
+    int k;
+    for (k = 0; k < j->nstubs; k++) {
+	stub_rec *st = &j->stubs[k];
+	int rel = (int) (j->p - (st->patch + 4));
+	memcpy(st->patch, &rel, 4);
+	if (st->kind == STUB_GOTO) {
+	    emit_goto(j, st->pc);
+	    continue;
+	}
+	if (st->unexec > 0) {
+	    /* add qword [rbp+budget], unexec */
+	    emit_rm(j, 0x83, 0, H_RBP, CTX_OFF(budget));
+	    emit_byte(j, st->unexec);
+	}
+	if (st->kind == STUB_SMC)
+	    emit_rm(j, 0x89, H_RDX, H_RBP, CTX_OFF(addr));
+	emit_mov_imm(j, H_RDX, st->pc);
+	emit_mov_imm(j, H_RAX, st->kind == STUB_STEP ? EXIT_STEP :
+		     st->kind == STUB_SMC ? EXIT_SMC : EXIT_BUDGET);
+	emit_jump(j, -1, j->epilogue);
+    }
+    j->nstubs = 0;
+}
+
+/* Emit the routines entering and leaving translated code */
+static void emit_fixed(jit_ptr j)
+{
+    static const byte_t push[] = {
+	0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57
+    };
+    static const byte_t pop[] = {
+	0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3
+    };
+    int id;
+
+    j->p = j->code;
+    j->enter = (void (*)(jit_ctx *, void *)) j->p;
+    memcpy(j->p, push, sizeof(push));
+    j->p += sizeof(push);
+    emit_rr(j, 0x89, H_RDI, H_RBP);
+    emit_rr(j, 0x89, H_RSI, H_RAX);
+    emit_rm(j, 0x8B, H_R15, H_RBP, CTX_OFF(membase));
+    for (id = 0; id < REG_NONE; id++)
+	if (host_reg[id] >= 0)
+	    emit_rm(j, 0x8B, host_reg[id], H_RBP, REG_OFF(id));
+    /* jmp rax */
+    emit_byte(j, 0xFF);
+    emit_byte(j, 0xE0);
+
+    j->miss = j->p;
+    emit_mov_imm(j, H_RAX, EXIT_LOOKUP);
+
+    j->epilogue = j->p;
+    emit_rm(j, 0x89, H_RDX, H_RBP, CTX_OFF(pc));
+    /* mov [rbp+reason], eax */
+    emit_byte(j, 0x89);
+    emit_byte(j, 0x45);
+    emit_byte(j, CTX_OFF(reason));
+    for (id = 0; id < REG_NONE; id++)
+	if (host_reg[id] >= 0)
+	    emit_rm(j, 0x89, host_reg[id], H_RBP, REG_OFF(id));
+    memcpy(j->p, pop, sizeof(pop));
+    j->p += sizeof(pop);
+    j->start = j->p;
+}
+
+/* Discard all translations */
+static void flush_jit(jit_ptr j)
+{
+    int pos;
+    for (pos = 0; pos < j->m->len; pos++)
+	j->table[pos] = j->miss;
+    memset(j->xmap, 0, (j->m->len >> ICACHE_BLOCK_SHIFT) + 1);
+    j->p = j->start;
+}
+
+/* Discard the translations of code overlapping the cnt bytes at pos */
+static void invalidate_jit(jit_ptr j, word_t pos, int cnt)
+{
+    /* A block starts at most JIT_MAX_BLOCK instructions before pos */
+    word_t pc = pos - (JIT_MAX_BLOCK * MAX_INSTR_LEN - 1);
+    word_t hi = pos + cnt;
+    if (!j->xmap[pos >> ICACHE_BLOCK_SHIFT] &&
+	!j->xmap[(hi-1) >> ICACHE_BLOCK_SHIFT])
+	return;
+    if (pc < 0)
+	pc = 0;
+    if (hi > j->m->len)
+	hi = j->m->len;
+    for (; pc < hi; pc++)
+	if (j->table[pc] != j->miss && j->ends[pc] > pos)
+	    j->table[pc] = j->miss;
+}
+
+/* Translate the block starting at pc.  Return NULL if its first
+   instruction has to be executed by the interpreter */
+static void *translate(jit_ptr j, word_t pc)
+{
+    dinstr_ptr block[JIT_MAX_BLOCK];
+    dinstr_ptr d;
+    byte_t *code;
+    word_t npc = pc;
+    int n = 0;
+    int i;
+    bool_t ends = FALSE;	/* Last instruction transfers control */
+
+    while (n < JIT_MAX_BLOCK && !ends) {
+	d = decode_instr(j->m, npc);
+	if (!d || !translatable(d))
+	    break;
+	block[n++] = d;
+	ends = d->icode == I_JMP || d->icode == I_CALL || d->icode == I_RET;
+	npc = d->valp;
+    }
+    if (n == 0)
+	return NULL;
+
+    if (j->p + JIT_CODE_SLACK > j->code + JIT_CODE_SIZE)
+	flush_jit(j);
+    code = j->p;
+    j->cc_live = FALSE;
+
+    /* cmp qword [rbp+budget], n; jl budget; sub qword [rbp+budget], n */
+    emit_rm(j, 0x83, 7, H_RBP, CTX_OFF(budget));
+    emit_byte(j, n);
+    emit_stub_jump(j, 0xC, STUB_BUDGET, pc, 0);
+    emit_rm(j, 0x83, 5, H_RBP, CTX_OFF(budget));
+    emit_byte(j, n);
+
+    npc = pc;
+    for (i = 0; i < n; i++) {
+	d = block[i];
+	emit_instr(j, d, npc, i, n);
+	j->xmap[npc >> ICACHE_BLOCK_SHIFT] = 1;
+	j->xmap[(npc + d->len - 1) >> ICACHE_BLOCK_SHIFT] = 1;
+	npc = d->valp;
+    }
+    if (!ends) {
+	/* Fell off the end, or the next instruction is interpreted */
+	d = decode_instr(j->m, npc);
+	save_cc(j);
+	if (d && !translatable(d))
+	    emit_stub_jump(j, -1, STUB_STEP, npc, 0);
+	else
+	    emit_goto(j, npc);
+    }
+    emit_stubs(j);
+    j->table[pc] = code;
+    j->ends[pc] = npc;
+    return code;
+}
+
+/* Execute one instruction with the interpreter.  set_word_val keeps
+   the decoded instructions up to date, but not the translations, so
+   discard those the instruction's store is going to overlap */
+static stat_t jit_step(jit_ptr j, state_ptr s, FILE *error_file)
+{
+    dinstr_ptr d = decode_instr(s->m, s->pc);
+    word_t a = -1;
+    if (d && d->icode == I_RMMOVQ)
+	a = d->valc + (d->rb == REG_NONE ? 0 : get_reg_val(s->r, d->rb));
+    else if (d && (d->icode == I_CALL || d->icode == I_PUSHQ))
+	a = get_reg_val(s->r, REG_RSP) - 8;
+    if (a >= 0 && a <= j->m->len - 8)
+	invalidate_jit(j, a, 8);
+    return step_state(s, error_file);
+}
+
+static jit_ptr new_jit(mem_t m)
+{
+    jit_ptr j = (jit_ptr) calloc(1, sizeof(jit_rec));
+    j->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC,
+		   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (j->code == MAP_FAILED) {
+	free(j);
+	return NULL;
+    }
+    j->m = m;
+    j->table = (void **) malloc(m->len * sizeof(void *));
+    j->ends = (word_t *) malloc(m->len * sizeof(word_t));
+    j->xmap = (byte_t *) calloc((m->len >> ICACHE_BLOCK_SHIFT) + 1, 1);
+    emit_fixed(j);
+    flush_jit(j);
+    return j;
+}
+
+static void free_jit(jit_ptr j)
+{
+    munmap(j->code, JIT_CODE_SIZE);
+    free(j->table);
+    free(j->ends);
+    free(j->xmap);
+    free(j);
+}
+
+word_t run_jit(state_ptr s, word_t max_steps, stat_t *statusp,
+	       FILE *error_file)
+{
+    jit_ptr j;
+    jit_ctx ctx;
+    word_t steps = 0;
+    stat_t status = STAT_AOK;
+    bool_t tail = FALSE;	/* Budget too small for translated blocks */
+    int id;
+
+    /* Translated stores do not update the hash */
+    j = s->m->hashing ? NULL : new_jit(s->m);
+    if (!j)
+	return run_threaded(s, max_steps, statusp, error_file);
+
+    while (steps < max_steps && status == STAT_AOK) {
+	void *code = NULL;
+	if (!tail && s->pc >= 0 && s->pc < s->m->len) {
+	    code = j->table[s->pc];
+	    if (code == j->miss)
+		code = translate(j, s->pc);
+	}
+	if (!code) {
+	    status = jit_step(j, s, error_file);
+	    steps++;
+	    continue;
+	}
+
+	for (id = 0; id < REG_NONE; id++)
+	    ctx.regs[id] = get_reg_val(s->r, id);
+	ctx.cc = get_cc(&s->cc);
+	ctx.budget = max_steps - steps;
+	ctx.membase = s->m->contents;
+	ctx.blocks = s->m->icache_blocks;
+	ctx.page_gen = s->m->page_gen;
+	ctx.gen = s->m->gen;
+	ctx.table = j->table;
+
+	j->enter(&ctx, code);
+
+	for (id = 0; id < REG_NONE; id++)
+	    set_reg_val(s->r, id, ctx.regs[id]);
+	SET_CC(s->cc, ctx.cc);
+	s->pc = ctx.pc;
+	steps = max_steps - ctx.budget;
+
+	switch (ctx.reason) {
+	case EXIT_STEP:
+	    if (steps < max_steps) {
+		status = jit_step(j, s, error_file);
+		steps++;
+	    }
+	    break;
+	case EXIT_BUDGET:
+	    tail = TRUE;
+	    break;
+	case EXIT_SMC:
+	    /* The store bypassed set_word_val */
+	    invalidate_icache(s->m, ctx.addr, 8);
+	    invalidate_jit(j, ctx.addr, 8);
+	    break;
+	default:
+	    break;
+	}
+    }
+
+    free_jit(j);
+    if (statusp)
+	*statusp = status;
+    return steps;
+}
+
+#else /* No translator for this host */
+
+word_t run_jit(state_ptr s, word_t max_steps, stat_t *statusp,
+	       FILE *error_file)
+{
+    return run_threaded(s, max_steps, statusp, error_file);
+}
+
+#endif
@@ -0,0 +1,365 @@
+/*
+ * Lockstep execution of several Y86-64 states.
+ *
+ * The register files, PCs and condition codes of up to LANES states are
+ * held struct-of-arrays style, as vectors with one lane per state.  At
+ * each step the active lanes at the lowest PC form a group; when they
+ * all decode the same instruction there, it is executed for the whole
+ * group at once, with register moves, ALU operations, condition codes
+ * and branch conditions computed as vector operations and the results
+ * merged into the group's lanes under a mask.  Lanes at other PCs wait,
+ * and taking the lowest PC first lets them rejoin after a divergent
+ * branch.  Memory accesses are made lane by lane, since each state has
+ * its own memory.
+ *
+ * Instructions that need more than this -- mulq, divq and anything that
+ * does not decode cleanly -- are executed by run_state, one lane at a
+ * time, so statuses, error messages and condition codes match it
+ * exactly.
+ *
+ * With GCC on x86-64, run_lanes is compiled twice, once for AVX2 and
+ * once for the baseline instruction set, and the version to use is
+ * chosen when the program starts.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "isa.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) && \
+    defined(__linux__)
+#define LANES_TARGETS __attribute__ ((target_clones("avx2", "default")))
+#else
+#define LANES_TARGETS
+#endif
+
+/* One word per lane.  Comparisons give -1 in lanes where they hold */
+typedef word_t vec_t __attribute__ ((vector_size (LANES * sizeof(word_t))));
+typedef uword_t uvec_t __attribute__ ((vector_size (LANES * sizeof(word_t))));
+
+/* Lanes of x where mask is set, and of y elsewhere */
+#define BLEND(mask, x, y) (((mask) & (x)) | (~(mask) & (y)))
+
+typedef struct {
+    vec_t regs[REG_NONE];
+    vec_t pc;
+    vec_t zf, sf, of;	/* Condition code, -1 where a flag is set */
+    /* Lanes whose condition code is still deferred in their state */
+    bool_t pending[LANES];
+    word_t steps[LANES];
+    stat_t status[LANES];
+} lanes_rec, *lanes_ptr;
+
+/* Copy lane i into its state */
+static void store_lane(lanes_ptr l, state_ptr s, int i)
+{
+    reg_id_t id;
+    for (id = REG_RAX; id < REG_NONE; id++)
+	set_reg_val(s->r, id, l->regs[id][i]);
+    s->pc = l->pc[i];
+    if (!l->pending[i])
+	SET_CC(s->cc, PACK_CC(l->zf[i] & 1, l->sf[i] & 1, l->of[i] & 1));
+}
+
+/* Set lane i from its state */
+static void load_lane(lanes_ptr l, state_ptr s, int i)
+{
+    reg_id_t id;
+    for (id = REG_RAX; id < REG_NONE; id++)
+	l->regs[id][i] = s->r->regs[id];
+    l->pc[i] = s->pc;
+    l->pending[i] = (s->cc.op != CC_KNOWN);
+    if (!l->pending[i]) {
+	l->zf[i] = -GET_ZF(s->cc.cc);
+	l->sf[i] = -GET_SF(s->cc.cc);
+	l->of[i] = -GET_OF(s->cc.cc);
+    }
+}
+
+/* Execute one instruction of lane i with run_state */
+static void scalar_step(lanes_ptr l, state_ptr s, int i, run_result *res)
+{
+    store_lane(l, s, i);
+    run_state(s, 1, res);
+    load_lane(l, s, i);
+    l->status[i] = res->status;
+    l->steps[i]++;
+}
+
+/* Can d be executed as a vector operation? */
+static bool_t vector_instr(dinstr_ptr d)
+{
+    if (!d || !d->ok1 || !d->okc)
+	return FALSE;
+    switch (d->icode) {
+    case I_NOP:
+    case I_HALT:
+    case I_RET:
+	return TRUE;
+    case I_RRMOVQ:
+	return d->ifun <= C_G && d->ra < REG_NONE && d->rb < REG_NONE;
+    case I_IRMOVQ:
+    case I_IADDQ:
+	return d->rb < REG_NONE;
+    case I_ALU:
+	return d->ifun <= A_XOR && d->ra < REG_NONE && d->rb < REG_NONE;
+    case I_JMP:
+	return d->ifun <= C_G;
+    case I_CALL:
+	return TRUE;
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+    case I_PUSHQ:
+    case I_POPQ:
+	return d->ra < REG_NONE;
+    default:
+	return FALSE;
+    }
+}
+
+/* Do lanes decode the same instruction? */
+static bool_t same_instr(dinstr_ptr d, dinstr_ptr e)
+{
+    return e && e->byte0 == d->byte0 && e->ra == d->ra && e->rb == d->rb &&
+	e->valc == d->valc && e->len == d->len &&
+	e->ok1 == d->ok1 && e->okc == d->okc;
+}
+
+/* Record error err, with value v, for lane i */
+static void lane_error(lanes_ptr l, int i, run_result *res,
+		       stat_t status, err_t err, word_t v)
+{
+    run_error_t e;
+    e.kind = err;
+    e.val = v;
+    l->status[i] = status;
+    format_error(res->msg, l->pc[i], &e);
+}
+
+/* Memory operations of d for lane i of the group */
+static void lane_memory(lanes_ptr l, state_ptr s, int i, dinstr_ptr d,
+			run_result *res)
+{
+    word_t addr, val;
+    switch (d->icode) {
+    case I_RMMOVQ:
+	addr = d->valc;
+	if (d->rb < REG_NONE)
+	    addr += l->regs[d->rb][i];
+	if (!set_word_val(s->m, addr, l->regs[d->ra][i])) {
+	    lane_error(l, i, res, STAT_ADR, ERR_DATA, addr);
+	    return;
+	}
+	break;
+    case I_MRMOVQ:
+	addr = d->valc;
+	if (d->rb < REG_NONE)
+	    addr += l->regs[d->rb][i];
+	if (!get_word_val(s->m, addr, &val)) {
+	    lane_error(l, i, res, STAT_ADR, ERR_NONE, 0);
+	    return;
+	}
+	l->regs[d->ra][i] = val;
+	break;
+    case I_CALL:
+	addr = l->regs[REG_RSP][i] - 8;
+	l->regs[REG_RSP][i] = addr;
+	if (!set_word_val(s->m, addr, d->valp)) {
+	    lane_error(l, i, res, STAT_ADR, ERR_STACK, addr);
+	    return;
+	}
+	l->pc[i] = d->valc;
+	return;
+    case I_RET:
+	addr = l->regs[REG_RSP][i];
+	if (!get_word_val(s->m, addr, &val)) {
+	    lane_error(l, i, res, STAT_ADR, ERR_STACK, addr);
+	    return;
+	}
+	l->regs[REG_RSP][i] = addr + 8;
+	l->pc[i] = val;
+	return;
+    case I_PUSHQ:
+	val = l->regs[d->ra][i];
+	addr = l->regs[REG_RSP][i] - 8;
+	l->regs[REG_RSP][i] = addr;
+	if (!set_word_val(s->m, addr, val)) {
+	    lane_error(l, i, res, STAT_ADR, ERR_STACK, addr);
+	    return;
+	}
+	break;
+    case I_POPQ:
+	addr = l->regs[REG_RSP][i];
+	l->regs[REG_RSP][i] = addr + 8;
+	if (!get_word_val(s->m, addr, &val)) {
+	    lane_error(l, i, res, STAT_ADR, ERR_STACK, addr);
+	    return;
+	}
+	l->regs[d->ra][i] = val;
+	break;
+    default:
+	break;
+    }
+    l->pc[i] = d->valp;
+}
+
+/* Set *cond to the lanes where condition c holds */
+static inline void cond_lanes(lanes_ptr l, cond_t c, vec_t *cond)
+{
+    switch (c) {
+    case C_LE:
+	*cond = (l->sf ^ l->of) | l->zf;
+	break;
+    case C_L:
+	*cond = l->sf ^ l->of;
+	break;
+    case C_E:
+	*cond = l->zf;
+	break;
+    case C_NE:
+	*cond = ~l->zf;
+	break;
+    case C_GE:
+	*cond = ~(l->sf ^ l->of);
+	break;
+    case C_G:
+	*cond = ~(l->sf ^ l->of) & ~l->zf;
+	break;
+    default:
+	*cond = ~(vec_t) { 0 };
+	break;
+    }
+}
+
+LANES_TARGETS
+void run_lanes(state_ptr *s, int n, word_t max_steps, run_result *res)
+{
+    lanes_rec l;
+    int i;
+
+    memset(&l, 0, sizeof(l));
+    for (i = 0; i < n; i++) {
+	load_lane(&l, s[i], i);
+	l.status[i] = STAT_AOK;
+	res[i].msg[0] = '\0';
+    }
+
+    for (;;) {
+	vec_t m = { 0 };	/* Lanes in the group */
+	vec_t cond, a, b, val;
+	uvec_t ua, ub;
+	dinstr_ptr d = NULL;
+	int lead = -1;
+	word_t pc = 0;
+
+	/* The lowest PC goes first */
+	for (i = 0; i < n; i++)
+	    if (l.status[i] == STAT_AOK && l.steps[i] < max_steps &&
+		(lead < 0 || l.pc[i] < pc)) {
+		lead = i;
+		pc = l.pc[i];
+	    }
+	if (lead < 0)
+	    break;
+
+	d = decode_instr(s[lead]->m, pc);
+	if (!vector_instr(d)) {
+	    scalar_step(&l, s[lead], lead, &res[lead]);
+	    continue;
+	}
+	for (i = lead; i < n; i++)
+	    if (l.status[i] == STAT_AOK && l.steps[i] < max_steps &&
+		l.pc[i] == pc &&
+		(i == lead || same_instr(d, decode_instr(s[i]->m, pc)))) {
+		m[i] = -1;
+		l.steps[i]++;
+	    }
+
+	if ((d->icode == I_JMP || d->icode == I_RRMOVQ) && d->ifun != C_YES) {
+	    /* Conditions read deferred condition codes */
+	    for (i = lead; i < n; i++)
+		if (m[i] && l.pending[i]) {
+		    cc_t cc = get_cc(&s[i]->cc);
+		    l.zf[i] = -GET_ZF(cc);
+		    l.sf[i] = -GET_SF(cc);
+		    l.of[i] = -GET_OF(cc);
+		    l.pending[i] = FALSE;
+		}
+	    cond_lanes(&l, d->ifun, &cond);
+	} else
+	    cond = ~(vec_t) { 0 };
+
+	switch (d->icode) {
+	case I_HALT:
+	    for (i = lead; i < n; i++)
+		if (m[i])
+		    l.status[i] = STAT_HLT;
+	    break;
+	case I_NOP:
+	    l.pc = BLEND(m, d->valp, l.pc);
+	    break;
+	case I_RRMOVQ:
+	    l.regs[d->rb] = BLEND(m & cond, l.regs[d->ra], l.regs[d->rb]);
+	    l.pc = BLEND(m, d->valp, l.pc);
+	    break;
+	case I_IRMOVQ:
+	    l.regs[d->rb] = BLEND(m, d->valc, l.regs[d->rb]);
+	    l.pc = BLEND(m, d->valp, l.pc);
+	    break;
+	case I_ALU:
+	case I_IADDQ:
+	    if (d->icode == I_IADDQ)
+		a = (vec_t) { 0 } + d->valc;
+	    else
+		a = l.regs[d->ra];
+	    b = l.regs[d->rb];
+	    /* Wrap around without signed overflow */
+	    ua = (uvec_t) a;
+	    ub = (uvec_t) b;
+	    switch (d->icode == I_IADDQ ? A_ADD : d->ifun) {
+	    case A_ADD:
+		val = (vec_t) (ua + ub);
+		l.of = BLEND(m, ((a < 0) == (b < 0)) & ((val < 0) != (a < 0)),
+			     l.of);
+		break;
+	    case A_SUB:
+		val = (vec_t) (ub - ua);
+		l.of = BLEND(m, ((a > 0) == (b < 0)) & ((val < 0) != (b < 0)),
+			     l.of);
+		break;
+	    case A_AND:
+		val = a & b;
+		l.of = BLEND(m, 0, l.of);
+		break;
+	    default:
+		val = a ^ b;
+		l.of = BLEND(m, 0, l.of);
+		break;
+	    }
+	    l.zf = BLEND(m, val == 0, l.zf);
+	    l.sf = BLEND(m, val < 0, l.sf);
+	    l.regs[d->rb] = BLEND(m, val, l.regs[d->rb]);
+	    l.pc = BLEND(m, d->valp, l.pc);
+	    for (i = lead; i < n; i++)
+		if (m[i])
+		    l.pending[i] = FALSE;
+	    break;
+	case I_JMP:
+	    l.pc = BLEND(m, BLEND(cond, d->valc, d->valp), l.pc);
+	    break;
+	default:
+	    for (i = lead; i < n; i++)
+		if (m[i])
+		    lane_memory(&l, s[i], i, d, &res[i]);
+	    break;
+	}
+    }
+
+    for (i = 0; i < n; i++) {
+	store_lane(&l, s[i], i);
+	res[i].steps = l.steps[i];
+	res[i].status = l.status[i];
+	res[i].pc = l.pc[i];
+    }
+}
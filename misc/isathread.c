@@ -0,0 +1,439 @@
+/*
+ * Direct-threaded interpreter for the Y86-64 ISA.
+ *
+ * Every entry of the memory's decode cache is given the address of a
+ * handler for its icode:ifun pair, and each handler finishes by jumping
+ * straight to the handler of the next instruction.  The host then sees
+ * one indirect branch per instruction type instead of the single shared
+ * branch of the switch in step_state.
+ *
+ * Common pairs -- subq or andq followed by a conditional jump, and
+ * mrmovq or irmovq followed by addq -- are fused: the first instruction
+ * of the pair gets a handler that also executes the second, saving a
+ * dispatch.  Steps are still counted one per instruction.
+ *
+ * Semantics match step_state exactly.  Instructions that would not
+ * complete with status AOK are handed to step_state, so that partial
+ * state updates and error messages are the same.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "isa.h"
+
+/* Condition codes as computed by compute_cc for A_ADD and A_SUB */
+static inline cc_t add_cc(word_t argA, word_t argB, word_t val)
+{
+    bool_t ovf = ((argA < 0) == (argB < 0)) && ((val < 0) != (argA < 0));
+    return PACK_CC(val == 0, val < 0, ovf);
+}
+
+static inline cc_t sub_cc(word_t argA, word_t argB, word_t val)
+{
+    bool_t ovf = ((argA > 0) == (argB < 0)) && ((val < 0) != (argB < 0));
+    return PACK_CC(val == 0, val < 0, ovf);
+}
+
+/* Value of the base register of a memory operand, which may be REG_NONE.
+   Other register IDs are checked before a handler is assigned */
+#define BASE_VAL(d) ((d)->rb == REG_NONE ? 0 : regs[(d)->rb])
+
+/* Can an 8-byte store at pos be done without preparing its pages?  If
+   not, the instruction is left to step_state */
+#define WORD_OK(m, pos) ((pos) >= 0 && (pos) <= (m)->len - 8 && \
+			 PAGE_READY(m, pos) && PAGE_READY(m, (pos) + 7))
+
+#ifdef __GNUC__
+
+word_t run_threaded(state_ptr s, word_t max_steps, stat_t *statusp,
+		    FILE *error_file)
+{
+    /* Handlers indexed by ifun, one table per icode */
+    static void *const rrmovq_handlers[16] = {
+	&&h_rrmovq, &&h_cmovle, &&h_cmovl, &&h_cmove,
+	&&h_cmovne, &&h_cmovge, &&h_cmovg, &&h_step,
+	&&h_step, &&h_step, &&h_step, &&h_step,
+	&&h_step, &&h_step, &&h_step, &&h_step
+    };
+    static void *const alu_handlers[16] = {
+	&&h_addq, &&h_subq, &&h_andq, &&h_xorq,
+	&&h_mulq, &&h_divq, &&h_step, &&h_step,
+	&&h_step, &&h_step, &&h_step, &&h_step,
+	&&h_step, &&h_step, &&h_step, &&h_step
+    };
+    static void *const jmp_handlers[16] = {
+	&&h_jmp, &&h_jle, &&h_jl, &&h_je,
+	&&h_jne, &&h_jge, &&h_jg, &&h_step,
+	&&h_step, &&h_step, &&h_step, &&h_step,
+	&&h_step, &&h_step, &&h_step, &&h_step
+    };
+    /* Handlers of conditional jumps, indexed by ifun mod 8.  Other
+       entries hold a label that is never a handler */
+    static void *const cjmp_handlers[8] = {
+	&&resolve, &&h_jle, &&h_jl, &&h_je,
+	&&h_jne, &&h_jge, &&h_jg, &&resolve
+    };
+
+    mem_t m = s->m;
+    word_t *regs = s->r->regs;
+    word_t steps = 0;
+    stat_t status = STAT_AOK;
+    dinstr_ptr d, d2, e;
+    int i;
+    word_t argA, argB, val, dval;
+
+    /* Retire the first instruction of a fused pair */
+#define RETIRE_FIRST()						\
+    do {							\
+	if (++steps >= max_steps) {				\
+	    s->pc = d->valp;					\
+	    goto done;						\
+	}							\
+    } while (0)
+
+#define DISPATCH()						\
+    do {							\
+	if (++steps >= max_steps)				\
+	    goto done;						\
+	if ((uword_t) s->pc >= (uword_t) m->len)		\
+	    goto h_step;					\
+	d = &m->icache[s->pc];					\
+	if (!d->handler)					\
+	    goto resolve;					\
+	goto *d->handler;					\
+    } while (0)
+
+    if (max_steps <= 0)
+	goto done;
+
+ resolve:
+    /* Decode the instruction at PC and pick its handler.  Instructions
+       whose encoding already guarantees an error go to step_state.
+       The following instruction is handled first, so that the two can
+       be fused */
+    d = decode_instr(m, s->pc);
+    if (!d)
+	goto h_step;
+    d2 = decode_instr(m, d->valp);
+    for (i = 0; i < 2; i++) {
+	e = i == 0 ? d2 : d;
+	if (!e || (e == d2 && e->handler))
+	    continue;
+	switch (e->icode) {
+	case I_NOP:
+	    e->handler = &&h_nop;
+	    break;
+	case I_HALT:
+	    e->handler = &&h_halt;
+	    break;
+	case I_RRMOVQ:
+	    e->handler = e->ok1 && reg_valid(e->ra) && reg_valid(e->rb) ?
+		rrmovq_handlers[e->ifun] : &&h_step;
+	    break;
+	case I_IRMOVQ:
+	    e->handler = e->ok1 && e->okc && reg_valid(e->rb) ?
+		&&h_irmovq : &&h_step;
+	    break;
+	case I_RMMOVQ:
+	    e->handler = e->ok1 && e->okc && reg_valid(e->ra) ?
+		&&h_rmmovq : &&h_step;
+	    break;
+	case I_MRMOVQ:
+	    e->handler = e->ok1 && e->okc && reg_valid(e->ra) ?
+		&&h_mrmovq : &&h_step;
+	    break;
+	case I_ALU:
+	    e->handler = e->ok1 && reg_valid(e->ra) && reg_valid(e->rb) ?
+		alu_handlers[e->ifun] : &&h_step;
+	    break;
+	case I_JMP:
+	    e->handler = e->ok1 && e->okc ? jmp_handlers[e->ifun] : &&h_step;
+	    break;
+	case I_CALL:
+	    e->handler = e->okc ? &&h_call : &&h_step;
+	    break;
+	case I_RET:
+	    e->handler = &&h_ret;
+	    break;
+	case I_PUSHQ:
+	    e->handler = e->ok1 && reg_valid(e->ra) ? &&h_pushq : &&h_step;
+	    break;
+	case I_POPQ:
+	    e->handler = e->ok1 && reg_valid(e->ra) ? &&h_popq : &&h_step;
+	    break;
+	case I_IADDQ:
+	    e->handler = e->ok1 && e->okc && reg_valid(e->rb) ?
+		&&h_iaddq : &&h_step;
+	    break;
+	default:
+	    e->handler = &&h_step;
+	    break;
+	}
+    }
+    if (d2) {
+	if (d2->handler == cjmp_handlers[d2->ifun & 7]) {
+	    if (d->handler == &&h_subq)
+		d->handler = &&h_subq_jxx;
+	    else if (d->handler == &&h_andq)
+		d->handler = &&h_andq_jxx;
+	} else if (d2->handler == &&h_addq) {
+	    if (d->handler == &&h_mrmovq)
+		d->handler = &&h_mrmovq_addq;
+	    else if (d->handler == &&h_irmovq)
+		d->handler = &&h_irmovq_addq;
+	}
+    }
+    goto *d->handler;
+
+ unfuse:
+    /* The second instruction of a fused pair has changed */
+    d->handler = NULL;
+    goto resolve;
+
+ h_step:
+    /* Let the reference interpreter execute (and report on) this one */
+    status = step_state(s, error_file);
+    if (status != STAT_AOK) {
+	steps++;
+	goto done;
+    }
+    DISPATCH();
+
+ h_nop:
+    s->pc = d->valp;
+    DISPATCH();
+
+ h_halt:
+    status = STAT_HLT;
+    steps++;
+    goto done;
+
+ h_rrmovq:
+    regs[d->rb] = regs[d->ra];
+    s->pc = d->valp;
+    DISPATCH();
+
+#define CMOV(label, cond)					\
+ label:								\
+    if (cond_holds(get_cc(&s->cc), cond))			\
+	regs[d->rb] = regs[d->ra];				\
+    s->pc = d->valp;						\
+    DISPATCH();
+
+    CMOV(h_cmovle, C_LE)
+    CMOV(h_cmovl, C_L)
+    CMOV(h_cmove, C_E)
+    CMOV(h_cmovne, C_NE)
+    CMOV(h_cmovge, C_GE)
+    CMOV(h_cmovg, C_G)
+
+ h_irmovq:
+    regs[d->rb] = d->valc;
+    s->pc = d->valp;
+    DISPATCH();
+
+ h_rmmovq:
+    dval = d->valc + BASE_VAL(d);
+    if (!WORD_OK(m, dval))
+	goto h_step;
+    /* The store may invalidate d itself */
+    s->pc = d->valp;
+    set_word_val(m, dval, regs[d->ra]);
+    DISPATCH();
+
+ h_mrmovq:
+    dval = d->valc + BASE_VAL(d);
+    if (!get_word_val(m, dval, &val))
+	goto h_step;
+    regs[d->ra] = val;
+    s->pc = d->valp;
+    DISPATCH();
+
+ h_addq:
+    argA = regs[d->ra];
+    argB = regs[d->rb];
+    val = argA + argB;
+    regs[d->rb] = val;
+    SET_CC(s->cc, add_cc(argA, argB, val));
+    s->pc = d->valp;
+    DISPATCH();
+
+ h_subq:
+    argA = regs[d->ra];
+    argB = regs[d->rb];
+    val = argB - argA;
+    regs[d->rb] = val;
+    SET_CC(s->cc, sub_cc(argA, argB, val));
+    s->pc = d->valp;
+    DISPATCH();
+
+ h_andq:
+    val = regs[d->ra] & regs[d->rb];
+    regs[d->rb] = val;
+    SET_CC(s->cc, PACK_CC(val == 0, val < 0, 0));
+    s->pc = d->valp;
+    DISPATCH();
+
+ h_xorq:
+    val = regs[d->ra] ^ regs[d->rb];
+    regs[d->rb] = val;
+    SET_CC(s->cc, PACK_CC(val == 0, val < 0, 0));
+    s->pc = d->valp;
+    DISPATCH();
+
+ h_mulq:
+ h_divq:
+    argA = regs[d->ra];
+    argB = regs[d->rb];
+    val = compute_alu(d->ifun, argA, argB);
+    regs[d->rb] = val;
+    DEFER_CC(s->cc, d->ifun, argA, argB, val);
+    s->pc = d->valp;
+    DISPATCH();
+
+#define JXX(label, cond)					\
+ label:								\
+    s->pc = cond_holds(get_cc(&s->cc), cond) ?			\
+	d->valc : d->valp;					\
+    DISPATCH();
+
+ h_jmp:
+    s->pc = d->valc;
+    DISPATCH();
+
+    JXX(h_jle, C_LE)
+    JXX(h_jl, C_L)
+    JXX(h_je, C_E)
+    JXX(h_jne, C_NE)
+    JXX(h_jge, C_GE)
+    JXX(h_jg, C_G)
+
+ h_call:
+    dval = regs[REG_RSP] - 8;
+    if (!WORD_OK(m, dval))
+	goto h_step;
+    regs[REG_RSP] = dval;
+    s->pc = d->valc;
+    set_word_val(m, dval, d->valp);
+    DISPATCH();
+
+ h_ret:
+    dval = regs[REG_RSP];
+    if (!get_word_val(m, dval, &val))
+	goto h_step;
+    regs[REG_RSP] = dval + 8;
+    s->pc = val;
+    DISPATCH();
+
+ h_pushq:
+    dval = regs[REG_RSP] - 8;
+    if (!WORD_OK(m, dval))
+	goto h_step;
+    val = regs[d->ra];
+    regs[REG_RSP] = dval;
+    s->pc = d->valp;
+    set_word_val(m, dval, val);
+    DISPATCH();
+
+ h_popq:
+    dval = regs[REG_RSP];
+    if (!get_word_val(m, dval, &val))
+	goto h_step;
+    regs[REG_RSP] = dval + 8;
+    regs[d->ra] = val;
+    s->pc = d->valp;
+    DISPATCH();
+
+ h_iaddq:
+    argB = regs[d->rb];
+    val = argB + d->valc;
+    regs[d->rb] = val;
+    SET_CC(s->cc, add_cc(d->valc, argB, val));
+    s->pc = d->valp;
+    DISPATCH();
+
+ h_subq_jxx:
+    d2 = d + d->len;
+    if (d2->handler != cjmp_handlers[d2->ifun & 7])
+	goto unfuse;
+    argA = regs[d->ra];
+    argB = regs[d->rb];
+    val = argB - argA;
+    regs[d->rb] = val;
+    SET_CC(s->cc, sub_cc(argA, argB, val));
+    RETIRE_FIRST();
+    s->pc = cond_holds(get_cc(&s->cc), d2->ifun) ?
+	d2->valc : d2->valp;
+    DISPATCH();
+
+ h_andq_jxx:
+    d2 = d + d->len;
+    if (d2->handler != cjmp_handlers[d2->ifun & 7])
+	goto unfuse;
+    val = regs[d->ra] & regs[d->rb];
+    regs[d->rb] = val;
+    SET_CC(s->cc, PACK_CC(val == 0, val < 0, 0));
+    RETIRE_FIRST();
+    s->pc = cond_holds(get_cc(&s->cc), d2->ifun) ?
+	d2->valc : d2->valp;
+    DISPATCH();
+
+ h_mrmovq_addq:
+    d2 = d + d->len;
+    if (d2->handler != &&h_addq)
+	goto unfuse;
+    dval = d->valc + BASE_VAL(d);
+    if (!get_word_val(m, dval, &val))
+	goto h_step;
+    regs[d->ra] = val;
+    RETIRE_FIRST();
+    argA = regs[d2->ra];
+    argB = regs[d2->rb];
+    val = argA + argB;
+    regs[d2->rb] = val;
+    SET_CC(s->cc, add_cc(argA, argB, val));
+    s->pc = d2->valp;
+    DISPATCH();
+
+ h_irmovq_addq:
+    d2 = d + d->len;
+    if (d2->handler != &&h_addq)
+	goto unfuse;
+    regs[d->rb] = d->valc;
+    RETIRE_FIRST();
+    argA = regs[d2->ra];
+    argB = regs[d2->rb];
+    val = argA + argB;
+    regs[d2->rb] = val;
+    SET_CC(s->cc, add_cc(argA, argB, val));
+    s->pc = d2->valp;
+    DISPATCH();
+
+ done:
+    /* Handlers write the registers directly */
+    rehash_reg(s->r);
+    if (statusp)
+	*statusp = status;
+    return steps;
+#undef RETIRE_FIRST
+#undef DISPATCH
+#undef CMOV
+#undef JXX
+}
+
+#else /* !__GNUC__ */
+
+/* Without label addresses, fall back on the reference interpreter */
+word_t run_threaded(state_ptr s, word_t max_steps, stat_t *statusp,
+		    FILE *error_file)
+{
+    word_t steps;
+    stat_t status = STAT_AOK;
+    for (steps = 0; steps < max_steps && status == STAT_AOK; steps++)
+	status = step_state(s, error_file);
+    if (statusp)
+	*statusp = status;
+    return steps;
+}
+
+#endif /* __GNUC__ */
@@ -0,0 +1,359 @@
+/*
+ * Binary execution traces.
+ *
+ * The simulator encodes records into the batches of a ring (see
+ * trace_step in isacore.c), and a writer thread started here writes out
+ * each batch as it fills, so the simulator never waits on the file
+ * unless the whole ring is full.  The reader decodes the records again.
+ *
+ * The lockstep check hands records the other way, from the ISA model
+ * on its own thread to a pipeline simulator that compares them with
+ * the instructions it retires.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "isa.h"
+
+/* How long the writer sleeps when it finds the ring empty */
+#define IDLE_NSEC 50000
+
+/* Write out batches until the last one has been handed over */
+static void *trace_thread(void *arg)
+{
+    trace_t t = (trace_t) arg;
+    struct timespec idle = { 0, IDLE_NSEC };
+
+    for (;;) {
+	uword_t tail = t->tail;
+	trace_batch_rec *b;
+	if (tail == __atomic_load_n(&t->head, __ATOMIC_ACQUIRE)) {
+	    /* done is set after the last store to head */
+	    if (__atomic_load_n(&t->done, __ATOMIC_ACQUIRE) &&
+		tail == __atomic_load_n(&t->head, __ATOMIC_ACQUIRE))
+		break;
+	    nanosleep(&idle, NULL);
+	    continue;
+	}
+	b = &t->ring[tail % TRACE_RING];
+	fwrite(b->data, 1, b->len, t->out);
+	__atomic_store_n(&t->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+trace_t open_trace(FILE *out, reg_t r)
+{
+    trace_t t = (trace_t) malloc(sizeof(trace_writer_rec));
+    int version = TRACE_VERSION;
+    reg_id_t id;
+
+    t->out = out;
+    t->ring = (trace_batch_rec *) malloc(TRACE_RING * sizeof(trace_batch_rec));
+    t->ring[0].len = 0;
+    t->head = t->tail = 0;
+    t->done = 0;
+    t->pc = 0;
+    t->addr = 0;
+    for (id = REG_RAX; id < REG_NONE; id++)
+	t->regs[id] = get_reg_val(r, id);
+    t->steps = 0;
+
+    fwrite(TRACE_MAGIC, 1, 4, out);
+    fwrite(&version, sizeof(int), 1, out);
+    fwrite(t->regs, sizeof(word_t), REG_NONE, out);
+    t->bytes = 4 + sizeof(int) + REG_NONE * sizeof(word_t);
+
+    t->thread = malloc(sizeof(pthread_t));
+    if (pthread_create((pthread_t *) t->thread, NULL, trace_thread, t)) {
+	free(t->thread);
+	free((void *) t->ring);
+	free((void *) t);
+	return NULL;
+    }
+    return t;
+}
+
+void close_trace(trace_t t)
+{
+    if (t->ring[t->head % TRACE_RING].len)
+	__atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+    pthread_join(*(pthread_t *) t->thread, NULL);
+    fflush(t->out);
+    free(t->thread);
+    free((void *) t->ring);
+    free((void *) t);
+}
+
+bool_t start_trace(state_ptr s, FILE *out)
+{
+    stop_trace(s);
+    s->trace = open_trace(out, s->r);
+    return s->trace != NULL;
+}
+
+void stop_trace(state_ptr s)
+{
+    if (!s->trace)
+	return;
+    close_trace(s->trace);
+    s->trace = NULL;
+}
+
+/**************** Reading traces ************************/
+
+typedef struct trace_reader_rec {
+    FILE *in;
+    word_t pc;
+    word_t addr;
+    word_t regs[REG_NONE];
+} trace_reader_rec;
+
+/* Read a varint into *v.  Return FALSE at end of file or if it is too
+   long */
+static bool_t get_varint(FILE *in, uword_t *v)
+{
+    uword_t val = 0;
+    int shift;
+    for (shift = 0; shift < 64; shift += 7) {
+	int c = getc(in);
+	if (c == EOF)
+	    return FALSE;
+	val |= (uword_t) (c & 0x7f) << shift;
+	if (!(c & 0x80)) {
+	    *v = val;
+	    return TRUE;
+	}
+    }
+    return FALSE;
+}
+
+/* Undo ZIGZAG in isacore.c */
+#define UNZIGZAG(u) ((word_t) ((u) >> 1) ^ -(word_t) ((u) & 1))
+
+trace_reader_t open_trace_reader(FILE *in, reg_t r)
+{
+    trace_reader_t t;
+    char magic[4];
+    int version;
+    word_t regs[REG_NONE];
+    reg_id_t id;
+
+    if (fread(magic, 1, 4, in) != 4 || memcmp(magic, TRACE_MAGIC, 4) ||
+	fread(&version, sizeof(int), 1, in) != 1 ||
+	version != TRACE_VERSION ||
+	fread(regs, sizeof(word_t), REG_NONE, in) != REG_NONE)
+	return NULL;
+    t = (trace_reader_t) malloc(sizeof(trace_reader_rec));
+    t->in = in;
+    t->pc = 0;
+    t->addr = 0;
+    memcpy(t->regs, regs, sizeof(regs));
+    if (r)
+	for (id = REG_RAX; id < REG_NONE; id++)
+	    set_reg_val(r, id, regs[id]);
+    return t;
+}
+
+int read_trace(trace_reader_t t, trace_rec *rec)
+{
+    int tag = getc(t->in);
+    int c;
+    uword_t v;
+    int i;
+
+    if (tag == EOF)
+	return 0;
+    if (tag & ~(TRACE_REGS | TRACE_MEM | TRACE_STAT | TRACE_JUMP) ||
+	(tag & TRACE_REGS) == TRACE_REGS)
+	return -1;
+
+    rec->pc = t->pc;
+    if (tag & TRACE_JUMP) {
+	if (!get_varint(t->in, &v))
+	    return -1;
+	rec->pc += UNZIGZAG(v);
+    }
+    if ((c = getc(t->in)) == EOF)
+	return -1;
+    rec->instr = c;
+    t->pc = rec->pc + instr_length(rec->instr);
+
+    rec->status = STAT_AOK;
+    if (tag & TRACE_STAT) {
+	if ((c = getc(t->in)) == EOF)
+	    return -1;
+	rec->status = c;
+    }
+
+    rec->reg[0] = rec->reg[1] = REG_NONE;
+    if (tag & TRACE_REGS) {
+	if ((c = getc(t->in)) == EOF)
+	    return -1;
+	rec->reg[0] = HI4(c);
+	rec->reg[1] = LO4(c);
+	for (i = 0; i < (tag & TRACE_REGS); i++) {
+	    if (rec->reg[i] >= REG_NONE || !get_varint(t->in, &v))
+		return -1;
+	    t->regs[rec->reg[i]] += UNZIGZAG(v);
+	    rec->regval[i] = t->regs[rec->reg[i]];
+	}
+    }
+
+    rec->wrote = (tag & TRACE_MEM) != 0;
+    if (rec->wrote) {
+	if (!get_varint(t->in, &v))
+	    return -1;
+	t->addr += UNZIGZAG(v);
+	rec->addr = t->addr;
+	if (!get_varint(t->in, &v))
+	    return -1;
+	rec->word = UNZIGZAG(v);
+    }
+    return 1;
+}
+
+void close_trace_reader(trace_reader_t t)
+{
+    free((void *) t);
+}
+
+void print_step(FILE *out, trace_rec *rec)
+{
+    int i;
+    fprintf(out, "0x%04llx: %-7s", rec->pc, iname(rec->instr));
+    for (i = 0; i < 2 && rec->reg[i] != REG_NONE; i++)
+	fprintf(out, " %s=0x%llx", reg_name(rec->reg[i]), rec->regval[i]);
+    if (rec->wrote)
+	fprintf(out, " M[0x%llx]=0x%llx", rec->addr, rec->word);
+    if (rec->status != STAT_AOK)
+	fprintf(out, " Status '%s'", stat_name(rec->status));
+}
+
+/* Keep only the last write to each register of rec in ids and vals.
+   Return how many there are */
+static int last_writes(trace_rec *rec, byte_t *ids, word_t *vals)
+{
+    int n = 0;
+    int i;
+    for (i = 0; i < 2 && rec->reg[i] != REG_NONE; i++) {
+	if (n > 0 && ids[n-1] == rec->reg[i])
+	    n--;
+	ids[n] = rec->reg[i];
+	vals[n++] = rec->regval[i];
+    }
+    return n;
+}
+
+bool_t same_step(trace_rec *a, trace_rec *b)
+{
+    byte_t aid[2], bid[2];
+    word_t aval[2], bval[2];
+    int n, i;
+
+    if (a->pc != b->pc || a->instr != b->instr || a->status != b->status)
+	return FALSE;
+    n = last_writes(a, aid, aval);
+    if (n != last_writes(b, bid, bval))
+	return FALSE;
+    for (i = 0; i < n; i++)
+	if (aid[i] != bid[i] || aval[i] != bval[i])
+	    return FALSE;
+    if (a->wrote != b->wrote)
+	return FALSE;
+    return !a->wrote || (a->addr == b->addr && a->word == b->word);
+}
+
+/**************** Lockstep checking ************************/
+
+/* Steps the model can run ahead of the simulator */
+#define CHECK_RING 4096
+
+/* The model thread fills ring[head % CHECK_RING] and the simulator
+   takes records tail to head-1.  Each side keeps the last value it saw
+   of the other's index, so they share a cache line only when one
+   catches up with the other */
+typedef struct check_rec {
+    state_ptr s;
+    word_t max_steps;
+    trace_rec ring[CHECK_RING];
+    uword_t head;
+    uword_t tail;
+    uword_t seen_head;	/* Simulator's copy of head */
+    uword_t seen_tail;	/* Model's copy of tail */
+    int done;		/* Model has queued its last step */
+    int stop;		/* Simulator wants no more steps */
+    pthread_t thread;
+} check_rec;
+
+static void *check_thread(void *arg)
+{
+    check_t c = (check_t) arg;
+    word_t steps;
+
+    for (steps = 0; steps < c->max_steps; steps++) {
+	uword_t head = c->head;
+	stat_t status;
+	while (head - c->seen_tail == CHECK_RING) {
+	    if (__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE))
+		goto done;
+	    sched_yield();
+	    c->seen_tail = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+	}
+	status = record_step(c->s, &c->ring[head % CHECK_RING]);
+	__atomic_store_n(&c->head, head + 1, __ATOMIC_RELEASE);
+	if (status != STAT_AOK)
+	    break;
+    }
+ done:
+    __atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+check_t start_check(state_ptr s, word_t max_steps)
+{
+    check_t c = (check_t) malloc(sizeof(check_rec));
+    c->s = s;
+    c->max_steps = max_steps;
+    c->head = c->tail = 0;
+    c->seen_head = c->seen_tail = 0;
+    c->done = 0;
+    c->stop = 0;
+    if (pthread_create(&c->thread, NULL, check_thread, c)) {
+	free((void *) c);
+	return NULL;
+    }
+    return c;
+}
+
+bool_t check_step(check_t c, trace_rec *rec, trace_rec *expect)
+{
+    uword_t tail = c->tail;
+    while (tail == c->seen_head) {
+	/* done is set after the last store to head */
+	int done = __atomic_load_n(&c->done, __ATOMIC_ACQUIRE);
+	c->seen_head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+	if (tail != c->seen_head)
+	    break;
+	if (done) {
+	    expect->status = STAT_BUB;
+	    return FALSE;
+	}
+	sched_yield();
+    }
+    *expect = c->ring[tail % CHECK_RING];
+    __atomic_store_n(&c->tail, tail + 1, __ATOMIC_RELEASE);
+    return same_step(rec, expect);
+}
+
+void stop_check(check_t c)
+{
+    __atomic_store_n(&c->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(c->thread, NULL);
+    free((void *) c);
+}
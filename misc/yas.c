@@ -9,6 +9,8 @@
 
 void add_symbol(char *, int);
 int find_symbol(char *);
+word_t symbol_ref(char *, int, int);
+void export_symbol(char *);
 int instr_size(char *);
 
 int gui_mode = 0;
@@ -22,6 +24,12 @@ int vcode = 0;
 /* Should it generate code for banked memory? */
 int block_factor = 0;
 
+/* Generate a binary object (.ybo) rather than a .yo file? */
+int bcode = 0;
+
+/* Make that a relocatable object for yld? */
+int rcode = 0;
+
 int lineno = 1; /* Line number of input file */
 int bytepos = 0; /* Address of current instruction being processed */
 int error_mode = 0; /* Am I trying to finish off a line with an error? */
@@ -130,9 +138,76 @@ static void hexstuff(char *dest, word_t value, int len)
     }
 }
 
+/* Growable buffer for one part of a binary object */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} obj_buf_rec, *obj_buf_ptr;
+
+/* Parts of the binary object, gathered in pass 2 */
+obj_buf_rec obj_segs;   /* Segment records */
+obj_buf_rec obj_code;   /* Code of all segments, in order */
+obj_buf_rec obj_lines;  /* Line table, as it is written */
+word_t obj_line_cnt = 0;
+obj_buf_rec obj_rels;   /* Relocation records */
+word_t obj_align = 1;   /* Largest .align */
+
+/* Append len bytes from src, or zeros if src is NULL */
+static void buf_add(obj_buf_ptr b, void *src, size_t len)
+{
+    if (b->len + len > b->cap) {
+	while (b->len + len > b->cap)
+	    b->cap = b->cap ? 2 * b->cap : 4096;
+	b->data = (char *) realloc(b->data, b->cap);
+    }
+    if (src)
+	memcpy(b->data + b->len, src, len);
+    else
+	memset(b->data + b->len, 0, len);
+    b->len += len;
+}
+
+/* Pad to the alignment of the next record */
+static void buf_pad(obj_buf_ptr b)
+{
+    buf_add(b, NULL, YBO_PAD(b->len) - b->len);
+}
+
+/* Add the code of the current line to the binary object */
+static void obj_add_code(int pos)
+{
+    ybo_seg_rec *last = NULL;
+    ybo_line_rec line;
+    if (obj_segs.len)
+	last = (ybo_seg_rec *) (obj_segs.data + obj_segs.len) - 1;
+    if (!last || last->addr + last->len != pos) {
+	ybo_seg_rec seg;
+	seg.addr = pos;
+	seg.len = 0;
+	buf_add(&obj_segs, &seg, sizeof(seg));
+	last = (ybo_seg_rec *) (obj_segs.data + obj_segs.len) - 1;
+    }
+    buf_add(&obj_code, code, bcount);
+    last->len += bcount;
+
+    line.addr = pos;
+    line.cnt = bcount;
+    line.text_len = strlen(input_line);
+    buf_add(&obj_lines, &line, sizeof(line));
+    buf_add(&obj_lines, input_line, line.text_len);
+    buf_pad(&obj_lines);
+    obj_line_cnt++;
+}
+
 void print_code(FILE *out, int pos)
 {
     char outstring[33];
+    if (bcode) {
+	if (tcount && bcount)
+	    obj_add_code(pos);
+	return;
+    }
     if (pos > 0xFFF) {
 	/* Printing format:
 	   0xHHHH: cccccccccccccccccccc | <line>
@@ -231,7 +306,7 @@ void get_num(int codepos, int bytes, int offset)
     if (tokens[tpos].type == TOK_NUM) {
 	val = tokens[tpos].ival;
     } else if (tokens[tpos].type == TOK_IDENT) {
-	val = find_symbol(tokens[tpos].sval);
+	val = symbol_ref(tokens[tpos].sval, codepos, bytes);
     } else {
 	fail("Number Expected");
 	return;
@@ -264,7 +339,7 @@ void get_mem(int codepos)
 	val = tokens[tpos++].ival;
 	type = tokens[tpos].type;
     } else if (type == TOK_IDENT) {
-	val = find_symbol(tokens[tpos++].sval);
+	val = symbol_ref(tokens[tpos++].sval, codepos + 1, 8);
 	type = tokens[tpos].type;    
     }
     /* Check for optional register */
@@ -372,6 +447,22 @@ void finish_line()
 	bytepos = ((bytepos+a-1)/a)*a;
 
 	if (pass > 1) {
+	    if (a > obj_align)
+		obj_align = a;
+	    print_code(outfile, bytepos);
+	}
+	start_line();
+	return;
+    }
+    /* Process .global */
+    if (strcmp(tokens[tpos].sval, ".global") == 0) {
+	if (tokens[++tpos].type != TOK_IDENT) {
+	    fail("Expecting Label");
+	    start_line();
+	    return;
+	}
+	if (pass > 1) {
+	    export_symbol(tokens[tpos].sval);
 	    print_code(outfile, bytepos);
 	}
 	start_line();
@@ -500,6 +591,7 @@ int symbol_cnt = INIT_CNT;
 struct {
     char *name;
     int pos;
+    int flags;  /* YBO_SYM_EXPORT or YBO_SYM_IMPORT */
 } symbol_table[STAB];
 
 void add_symbol(char *name, int p)
@@ -508,19 +600,112 @@ void add_symbol(char *name, int p)
     strcpy(t, name);
     symbol_table[symbol_cnt].name = t;
     symbol_table[symbol_cnt].pos = p;
+    symbol_table[symbol_cnt].flags = 0;
     symbol_cnt++;
 }
 
-int find_symbol(char *name)
+/* Index of the named symbol, or -1 */
+static int symbol_index(char *name)
 {
     int i;
     for (i = 0; i < symbol_cnt; i++)
 	if (strcmp(name, symbol_table[i].name) == 0)
-	    return symbol_table[i].pos;
+	    return i;
+    return -1;
+}
+
+int find_symbol(char *name)
+{
+    int i = symbol_index(name);
+    if (i >= 0)
+	return symbol_table[i].pos;
     fail("Can't find label");
     return -1;
 }
 
+/* Value of a label used as an operand of bytes bytes at codepos within
+   the current instruction.  In a relocatable object the use is recorded
+   for yld, and a label this file does not define is imported */
+word_t symbol_ref(char *name, int codepos, int bytes)
+{
+    ybo_rel_rec rel;
+    int i;
+    if (!rcode)
+	return find_symbol(name);
+    i = symbol_index(name);
+    if (i < 0) {
+	add_symbol(name, 0);
+	i = symbol_cnt - 1;
+	symbol_table[i].flags = YBO_SYM_IMPORT;
+    }
+    rel.addr = bytepos - bcount + codepos;
+    rel.sym = i - INIT_CNT;
+    rel.size = bytes;
+    buf_add(&obj_rels, &rel, sizeof(rel));
+    return symbol_table[i].pos;
+}
+
+/* Make a label defined in this file visible to other objects */
+void export_symbol(char *name)
+{
+    int i = symbol_index(name);
+    if (i < 0 || (symbol_table[i].flags & YBO_SYM_IMPORT))
+	fail("Can't find label");
+    else
+	symbol_table[i].flags |= YBO_SYM_EXPORT;
+}
+
+/* Write the binary object gathered in pass 2 */
+static void write_obj(FILE *out)
+{
+    ybo_header_rec h;
+    ybo_seg_rec *seg = (ybo_seg_rec *) obj_segs.data;
+    size_t code_off = 0;
+    obj_buf_rec obj = { NULL, 0, 0 };
+    int i;
+
+    memcpy(h.magic, YBO_MAGIC, sizeof(h.magic));
+    h.version = YBO_VERSION;
+    h.flags = rcode ? YBO_RELOC : 0;
+    h.seg_cnt = obj_segs.len / sizeof(ybo_seg_rec);
+    h.line_cnt = obj_line_cnt;
+    h.sym_cnt = symbol_cnt - INIT_CNT;
+    h.rel_cnt = obj_rels.len / sizeof(ybo_rel_rec);
+    h.align = obj_align;
+    /* The object extends to its last byte of code or label */
+    h.size = 0;
+    for (i = 0; i < h.seg_cnt; i++)
+	if (seg[i].addr + seg[i].len > h.size)
+	    h.size = seg[i].addr + seg[i].len;
+    for (i = INIT_CNT; i < symbol_cnt; i++)
+	if (!(symbol_table[i].flags & YBO_SYM_IMPORT) &&
+	    symbol_table[i].pos > h.size)
+	    h.size = symbol_table[i].pos;
+    buf_add(&obj, &h, sizeof(h));
+    for (i = 0; i < h.seg_cnt; i++) {
+	buf_add(&obj, &seg[i], sizeof(ybo_seg_rec));
+	buf_add(&obj, obj_code.data + code_off, seg[i].len);
+	buf_pad(&obj);
+	code_off += seg[i].len;
+    }
+    buf_add(&obj, obj_lines.data, obj_lines.len);
+    for (i = INIT_CNT; i < symbol_cnt; i++) {
+	ybo_sym_rec sym;
+	sym.pos = symbol_table[i].pos;
+	sym.flags = symbol_table[i].flags;
+	sym.name_len = strlen(symbol_table[i].name);
+	buf_add(&obj, &sym, sizeof(sym));
+	buf_add(&obj, symbol_table[i].name, sym.name_len);
+	buf_pad(&obj);
+    }
+    buf_add(&obj, obj_rels.data, obj_rels.len);
+    if (fwrite(obj.data, 1, obj.len, out) != obj.len) {
+	fprintf(stderr, "Error writing binary object\n");
+	hit_error = 1;
+    }
+    free((void *) obj.data);
+}
+
 int yywrap()
 {
     int i;
@@ -540,8 +725,10 @@ int yylex();
 
 static void usage(char *pname)
 {
-    printf("Usage: %s [-V[n]] file.ys\n", pname);
+    printf("Usage: %s [-V[n] | -b | -c] file.ys\n", pname);
     printf("   -V[n]  Generate memory initialization in Verilog format (n-way blocking)\n");
+    printf("   -b     Generate binary object file.ybo\n");
+    printf("   -c     Generate relocatable object file.ybo, to be linked by yld\n");
     exit(0);
 }
 
@@ -567,6 +754,14 @@ int main(int argc, char *argv[])
 	}
 	nextarg++;
 	break;
+      case 'b':
+	bcode = 1;
+	nextarg++;
+	break;
+      case 'c':
+	rcode = bcode = 1;
+	nextarg++;
+	break;
       default:
 	usage(argv[0]);
       }
@@ -591,8 +786,8 @@ int main(int argc, char *argv[])
       outfile = stdout;
     } else {
       strncpy(outfname, argv[nextarg], rootlen);
-      strcpy(outfname+rootlen, ".yo");
-      outfile = fopen(outfname, "w");
+      strcpy(outfname+rootlen, bcode ? ".ybo" : ".yo");
+      outfile = fopen(outfname, bcode ? "wb" : "w");
       if (!outfile) {
 	fprintf(stderr, "Can't open output file '%s'\n", outfname);
 	exit(1);
@@ -619,6 +814,8 @@ int main(int argc, char *argv[])
 
     yylex();
     fclose(yyin);
+    if (bcode)
+	write_obj(outfile);
     fclose(outfile);
     return hit_error;
 }
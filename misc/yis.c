@@ -2,35 +2,386 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "isa.h"
 
 /* YIS never runs in GUI mode */
 int gui_mode = 0;
 
+/* Default length of the undo log used by -b and -w */
+#define UNDO_SIZE (1 << 16)
+
 void usage(char *pname)
 {
-    printf("Usage: %s code_file [max_steps]\n", pname);
+    printf("Usage: %s [-djlH] [-m size] [-s input_list [-t threads]]\n"
+	   "          [-b steps] [-w addr] [-u size] [-r file@addr]\n"
+	   "          [-c file@addr] [-o file@addr:len] [-p file] [-x file]\n"
+	   "          code_file [max_steps]\n",
+	   pname);
+    printf("   -b     After the run, step back and report the state steps\n");
+    printf("          instructions earlier\n");
+    printf("   -c     Map host file copy-on-write at addr, after loading code_file\n");
+    printf("   -d     Use the direct-threaded interpreter\n");
+    printf("   -H     Print a hash of the final state, and of the state -b\n"
+	   "          or -w backs up to\n");
+    printf("   -j     Translate to host code where possible (x86-64 only)\n");
+    printf("   -l     Run in lockstep vector lanes, %d inputs of -s at a time\n",
+	   LANES);
+    printf("   -m     Size of memory, such as 64K, 16M or 1G (default %d)\n",
+	   MEM_SIZE);
+    printf("   -o     Save len bytes at addr to host file after the run\n");
+    printf("   -p     Send stores to the output port at 0x%llx to file ('-' for\n"
+	   "          standard output)\n", IO_BASE);
+    printf("   -r     Map host file read-only at addr, after loading code_file\n");
+    printf("   -s     Run once for each .yo input file listed in input_list,\n");
+    printf("          loaded over code_file.  Print one line per input.\n");
+    printf("          Can't be combined with -b, -H, -o, -p, -w or -x\n");
+    printf("   -t     Number of threads used by -s (default: one per CPU)\n");
+    printf("   -u     Number of steps -b and -w can go back (default %d)\n",
+	   UNDO_SIZE);
+    printf("   -w     After the run, step back to the last instruction that\n");
+    printf("          wrote the word at addr\n");
+    printf("   -x     Write a binary trace of every step to file, for ytrace\n");
+    printf("   -b, -w and -x always use the plain interpreter, and -H\n"
+	   "          turns -j into -d\n");
     exit(0);
 }
 
+/* Ways of running the simulator */
+typedef enum { RUN_STATE, RUN_THREADED, RUN_JIT, RUN_LANES } engine_t;
+
+/* Run with the given engine.  Error messages go to error_file, if
+   nonnull */
+static word_t run_engine(engine_t engine, state_ptr s, word_t max_steps,
+			 stat_t *statusp, FILE *error_file)
+{
+    run_result res;
+    switch (engine) {
+    case RUN_JIT:
+	return run_jit(s, max_steps, statusp, error_file);
+    case RUN_THREADED:
+	return run_threaded(s, max_steps, statusp, error_file);
+    case RUN_LANES:
+	run_lanes(&s, 1, max_steps, &res);
+	break;
+    default:
+	run_state(s, max_steps, &res);
+	break;
+    }
+    *statusp = res.status;
+    if (error_file)
+	fputs(res.msg, error_file);
+    return res.steps;
+}
+
+/********************** Input sweep *************************/
+
+/* Runs of one program over many inputs.  Every run maps the same memory
+   image, so the code file is loaded and decoded only once, and a run's
+   memory only gets its own copy of the pages it writes */
+typedef struct {
+    mem_image_t img;
+    engine_t engine;
+    word_t max_steps;
+    char **inputs;
+    char **results;	/* Result line for each input */
+    int count;
+    int next;		/* Next input to run */
+    pthread_mutex_t lock;
+} sweep_rec, *sweep_ptr;
+
+/* Longest result line, not counting the input name */
+#define RESULT_LEN (100 + REG_NONE * 24)
+
+/* Set up s to run input.  Return error message, or NULL if ready */
+static char *sweep_load(sweep_ptr sw, char *input, state_ptr s)
+{
+    FILE *input_file;
+
+    s->m = map_mem_image(sw->img);
+    if (!s->m)
+	return "Can't map memory image";
+    input_file = fopen(input, "r");
+    if (!input_file || !load_mem(s->m, input_file, 0)) {
+	if (input_file)
+	    fclose(input_file);
+	free_mem(s->m);
+	return "Can't load input file";
+    }
+    fclose(input_file);
+
+    s->pc = 0;
+    s->r = init_reg();
+    SET_CC(s->cc, DEFAULT_CC);
+    s->snaps = NULL;
+    s->undo = NULL;
+    s->trace = NULL;
+    return NULL;
+}
+
+/* Result line for a run of input that ended in state s */
+static char *sweep_result(char *input, state_ptr s, word_t step, stat_t e)
+{
+    char *result = (char *) malloc(strlen(input) + RESULT_LEN);
+    char *r = result + sprintf(result, "%s: ", input);
+    reg_id_t id;
+
+    r += sprintf(r, "Stopped in %lld steps at PC = 0x%llx.  Status '%s', CC %s",
+		 step, s->pc, stat_name(e), cc_name(get_cc(&s->cc)));
+    for (id = REG_RAX; id < REG_NONE; id++) {
+	word_t val = get_reg_val(s->r, id);
+	if (val)
+	    r += sprintf(r, " %s=0x%llx", reg_name(id), val);
+    }
+    sprintf(r, "\n");
+    return result;
+}
+
+/* Run inputs first .. first+cnt-1, cnt <= LANES */
+static void sweep_batch(sweep_ptr sw, int first, int cnt)
+{
+    state_rec states[LANES];
+    state_ptr ready[LANES];
+    run_result res[LANES];
+    int index[LANES];
+    int n = 0;
+    int i;
+
+    for (i = first; i < first + cnt; i++) {
+	char *err = sweep_load(sw, sw->inputs[i], &states[n]);
+	if (err) {
+	    sw->results[i] =
+		(char *) malloc(strlen(sw->inputs[i]) + strlen(err) + 4);
+	    sprintf(sw->results[i], "%s: %s\n", sw->inputs[i], err);
+	    continue;
+	}
+	ready[n] = &states[n];
+	index[n++] = i;
+    }
+
+    /* The status is reported instead of the error message */
+    if (sw->engine == RUN_LANES)
+	run_lanes(ready, n, sw->max_steps, res);
+    else
+	for (i = 0; i < n; i++)
+	    res[i].steps = run_engine(sw->engine, ready[i], sw->max_steps,
+				      &res[i].status, NULL);
+
+    for (i = 0; i < n; i++) {
+	sw->results[index[i]] = sweep_result(sw->inputs[index[i]], ready[i],
+					     res[i].steps, res[i].status);
+	free_reg(ready[i]->r);
+	free_mem(ready[i]->m);
+    }
+}
+
+static void *sweep_thread(void *arg)
+{
+    sweep_ptr sw = (sweep_ptr) arg;
+    /* Lanes take inputs in groups */
+    int batch = sw->engine == RUN_LANES ? LANES : 1;
+    for (;;) {
+	int i;
+	pthread_mutex_lock(&sw->lock);
+	i = sw->next;
+	sw->next += batch;
+	pthread_mutex_unlock(&sw->lock);
+	if (i >= sw->count)
+	    return NULL;
+	sweep_batch(sw, i, i + batch <= sw->count ? batch : sw->count - i);
+    }
+}
+
+/* Read input file names, one per line.  Return number read */
+static int read_inputs(FILE *list_file, char ***inputsp)
+{
+    char buf[4096];
+    int count = 0;
+    int size = 64;
+    char **inputs = (char **) malloc(size * sizeof(char *));
+    while (fgets(buf, sizeof(buf), list_file)) {
+	int len = strcspn(buf, "\r\n");
+	if (len == 0)
+	    continue;
+	buf[len] = '\0';
+	if (count == size) {
+	    size *= 2;
+	    inputs = (char **) realloc(inputs, size * sizeof(char *));
+	}
+	inputs[count++] = strdup(buf);
+    }
+    *inputsp = inputs;
+    return count;
+}
+
+/* Run the program in m once for each input listed in list_file */
+static int sweep(mem_t m, FILE *list_file, engine_t engine, word_t max_steps,
+		 int nthreads)
+{
+    sweep_rec sw;
+    pthread_t *threads;
+    word_t code_end;
+    int i;
+
+    /* Decode everything up to the last byte loaded */
+    for (code_end = m->len; code_end > 0; code_end--)
+	if (m->contents[code_end-1])
+	    break;
+    sw.img = save_mem_image(m, code_end);
+    if (!sw.img) {
+	fprintf(stderr, "Can't save memory image\n");
+	return 1;
+    }
+    sw.engine = engine;
+    sw.max_steps = max_steps;
+    sw.count = read_inputs(list_file, &sw.inputs);
+    sw.results = (char **) calloc(sw.count, sizeof(char *));
+    sw.next = 0;
+    pthread_mutex_init(&sw.lock, NULL);
+
+    if (nthreads > sw.count)
+	nthreads = sw.count;
+    threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++)
+	pthread_create(&threads[i], NULL, sweep_thread, &sw);
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+
+    for (i = 0; i < sw.count; i++) {
+	fputs(sw.results[i], stdout);
+	free(sw.results[i]);
+	free(sw.inputs[i]);
+    }
+    pthread_mutex_destroy(&sw.lock);
+    free(threads);
+    free(sw.results);
+    free(sw.inputs);
+    free_mem_image(sw.img);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     FILE *code_file;
+    FILE *list_file = NULL;
     int max_steps = 10000;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    word_t mem_size = MEM_SIZE;
+    int c;
+    engine_t engine = RUN_STATE;
+    word_t back = 0;
+    word_t watch = 0;
+    bool_t watching = FALSE;
+    bool_t hashing = FALSE;
+    word_t undo_size = UNDO_SIZE;
+    char **maps = (char **) malloc(argc * sizeof(char *));
+    bool_t *writable = (bool_t *) malloc(argc * sizeof(bool_t));
+    char **saves = (char **) malloc(argc * sizeof(char *));
+    int map_cnt = 0, save_cnt = 0;
+    FILE *port_file = NULL;
+    FILE *trace_file = NULL;
+    int i;
 
-    state_ptr s = new_state(MEM_SIZE);
-    mem_t saver = copy_reg(s->r);
-    mem_t savem;
+    state_ptr s;
+    state_snap_t start;
     int step = 0;
 
     stat_t e = STAT_AOK;
 
-    if (argc < 2 || argc > 3)
+    while ((c = getopt(argc, argv, "b:c:djlHm:o:p:r:s:t:u:w:x:")) != -1) {
+	switch(c) {
+	case 'b':
+	    back = strtoll(optarg, NULL, 0);
+	    break;
+	case 'c':
+	case 'r':
+	    writable[map_cnt] = c == 'c';
+	    maps[map_cnt++] = optarg;
+	    break;
+	case 'd':
+	    if (engine == RUN_STATE)
+		engine = RUN_THREADED;
+	    break;
+	case 'H':
+	    hashing = TRUE;
+	    break;
+	case 'j':
+	    engine = RUN_JIT;
+	    break;
+	case 'l':
+	    engine = RUN_LANES;
+	    break;
+	case 'm':
+	    mem_size = parse_mem_size(optarg);
+	    if (!mem_size) {
+		fprintf(stderr, "Invalid memory size '%s'\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'o':
+	    saves[save_cnt++] = optarg;
+	    break;
+	case 'p':
+	    port_file = strcmp(optarg, "-") ? fopen(optarg, "w") : stdout;
+	    if (!port_file) {
+		fprintf(stderr, "Can't open port file '%s'\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 's':
+	    list_file = fopen(optarg, "r");
+	    if (!list_file) {
+		fprintf(stderr, "Can't open input list '%s'\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'u':
+	    undo_size = strtoll(optarg, NULL, 0);
+	    if (undo_size < 1) {
+		fprintf(stderr, "Invalid undo log size '%s'\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'w':
+	    watch = strtoll(optarg, NULL, 0);
+	    watching = TRUE;
+	    break;
+	case 'x':
+	    trace_file = fopen(optarg, "wb");
+	    if (!trace_file) {
+		fprintf(stderr, "Can't open trace file '%s'\n", optarg);
+		exit(1);
+	    }
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    if (optind >= argc || optind < argc - 2)
 	usage(argv[0]);
-    code_file = fopen(argv[1], "r");
+
+    /* A sweep only reports each input's final state */
+    if (list_file && (back > 0 || watching || hashing || save_cnt > 0 ||
+		      port_file || trace_file)) {
+	fprintf(stderr, "-s can't be combined with -b, -H, -o, -p, -w or -x\n");
+	exit(1);
+    }
+
+    /* Memory beyond MEM_SIZE is allocated a page at a time */
+    s = new_state(0);
+    free_mem(s->m);
+    s->m = init_sparse_mem(MEM_SIZE, mem_size);
+
+    code_file = fopen(argv[optind], "r");
     if (!code_file) {
-	fprintf(stderr, "Can't open code file '%s'\n", argv[1]);
+	fprintf(stderr, "Can't open code file '%s'\n", argv[optind]);
 	exit(1);
     }
 
@@ -39,30 +390,88 @@ int main(int argc, char *argv[])
 	return 1;
     }
 
-    savem = copy_mem(s->m);
-  
-    if (argc > 2)
-	max_steps = atoi(argv[2]);
+    for (i = 0; i < map_cnt; i++)
+	if (!map_mem_file(s->m, maps[i], writable[i]))
+	    return 1;
+
+    if (optind + 1 < argc)
+	max_steps = atoi(argv[optind+1]);
+
+    if (list_file) {
+	int result;
+	if (nthreads < 1)
+	    nthreads = 1;
+	result = sweep(s->m, list_file, engine, max_steps, nthreads);
+	fclose(list_file);
+	free_state(s);
+	return result;
+    }
+
+    /* Hashing from the start keeps the cost of the hash to each store */
+    if (hashing)
+	start_mem_hash(s->m);
+    start = snapshot_state(s, "start");
+    if (port_file)
+	attach_port(s->m, port_file);
+
+    /* Only the interpreter logs its steps */
+    if (back > 0 || watching) {
+	start_undo(s, undo_size);
+	engine = RUN_STATE;
+    }
+    if (trace_file) {
+	if (!start_trace(s, trace_file)) {
+	    fprintf(stderr, "Can't start trace writer\n");
+	    exit(1);
+	}
+	engine = RUN_STATE;
+    }
 
-    for (step = 0; step < max_steps && e == STAT_AOK; step++)
-	e = step_state(s, stdout);
+    step = run_engine(engine, s, max_steps, &e, stdout);
+    flush_port(s->m);
+    if (trace_file) {
+	stop_trace(s);
+	fclose(trace_file);
+    }
 
     printf("Stopped in %d steps at PC = 0x%llx.  Status '%s', CC %s\n",
-	   step, s->pc, stat_name(e), cc_name(s->cc));
+	   step, s->pc, stat_name(e), cc_name(get_cc(&s->cc)));
 
     printf("Changes to registers:\n");
-    diff_reg(saver, s->r, stdout);
+    diff_reg(&start->r, s->r, stdout);
 
     printf("\nChanges to memory:\n");
-#ifdef SNU
-	diff_mem(savem, s->m, stdout, (word_t) 0);
-#else
-    diff_mem(savem, s->m, stdout);
-#endif
+    diff_mem_snap(start->m, stdout, (word_t) 0, FALSE);
+    if (hashing)
+	printf("State hash = 0x%016llx\n", state_hash(s));
+
+    for (i = 0; i < save_cnt; i++)
+	save_mem_file(s->m, saves[i]);
+
+    if (back > 0 || watching) {
+	if (watching) {
+	    bool_t found;
+	    word_t done = undo_to_write(s, watch, &found);
+	    step -= done;
+	    if (found)
+		printf("\nWord at 0x%llx last written by step %d, "
+		       "at PC = 0x%llx\n", watch, step + 1, s->pc);
+	    else
+		printf("\nNo write to word at 0x%llx in the last %lld steps\n",
+		       watch, done);
+	}
+	step -= undo_steps(s, back);
+	printf("\nBacked up to step %d at PC = 0x%llx.  CC %s\n",
+	       step, s->pc, cc_name(get_cc(&s->cc)));
+	printf("Changes to registers:\n");
+	diff_reg(&start->r, s->r, stdout);
+	printf("\nChanges to memory:\n");
+	diff_mem_snap(start->m, stdout, (word_t) 0, FALSE);
+	if (hashing)
+	    printf("State hash = 0x%016llx\n", state_hash(s));
+    }
 
     free_state(s);
-    free_reg(saver);
-    free_mem(savem);
 
     return 0;
 }
@@ -0,0 +1,371 @@
+/*
+ * Linker for relocatable Y86-64 objects, as written by yas -c.
+ *
+ * Objects are laid out in the order given.  Each is placed at the next
+ * multiple of its alignment (its largest .align) after the one before,
+ * unless -p gives its address, and covers its addresses up to its last
+ * byte of code or label, so that .pos and .align within it keep their
+ * meaning relative to its base.  The first object is normally the main
+ * program, placed at address 0 where execution starts.
+ *
+ * Labels named by .global are visible to every object, and a label an
+ * object uses but does not define must be one of those.  All other
+ * labels stay local to their object.  Every use of a label is then
+ * patched with its final address.  The linked program is written as a
+ * .yo file, or as a binary image if the output name ends in .ybo:
+ *
+ *   yas -c main.ys; yas -c sort.ys
+ *   yld -o prog.yo main.ybo sort.ybo
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+
+/* Upper limit on the number of objects */
+#define MAX_OBJ 1000
+
+/* A relocatable object, read whole into data */
+typedef struct {
+    char *name;
+    char *data;
+    size_t size;
+    ybo_header_rec *h;
+    ybo_seg_rec **segs;		/* Each followed by its code */
+    ybo_line_rec **lines;	/* Each followed by its text */
+    ybo_sym_rec **syms;
+    char **sym_names;
+    ybo_rel_rec *rels;
+    word_t base;		/* Address chosen for it */
+} obj_rec, *obj_ptr;
+
+obj_rec objs[MAX_OBJ];
+int obj_cnt = 0;
+
+/* Symbols exported by all the objects */
+typedef struct {
+    char *name;
+    word_t addr;
+    obj_ptr obj;
+} global_rec;
+
+global_rec *globals = NULL;
+int global_cnt = 0;
+
+void usage(char *pname)
+{
+    printf("Usage: %s -o out_file [-p addr] [-a align] obj_file ...\n",
+	   pname);
+    printf("   -o out_file  Write the program to out_file, as a .yo file unless it ends in .ybo\n");
+    printf("   -p addr      Place the next object at addr\n");
+    printf("   -a align     Align the next object to a multiple of align\n");
+    exit(0);
+}
+
+/* Take the record of len bytes at *offp from o, and step past it */
+static void *take(obj_ptr o, size_t *offp, word_t len)
+{
+    void *rec = o->data + *offp;
+    if (len < 0 || len > o->size - *offp) {
+	fprintf(stderr, "Object file '%s' is truncated\n", o->name);
+	exit(1);
+    }
+    *offp += len;
+    *offp = YBO_PAD(*offp) < o->size ? YBO_PAD(*offp) : o->size;
+    return rec;
+}
+
+void read_obj(obj_ptr o, char *name)
+{
+    FILE *f = fopen(name, "rb");
+    size_t off = 0, cap = 0, n;
+    word_t i;
+
+    if (!f) {
+	fprintf(stderr, "Can't open object file '%s'\n", name);
+	exit(1);
+    }
+    o->name = name;
+    o->data = NULL;
+    o->size = 0;
+    do {
+	if (o->size == cap) {
+	    cap = cap ? 2 * cap : 4096;
+	    o->data = (char *) realloc(o->data, cap);
+	}
+	n = fread(o->data + o->size, 1, cap - o->size, f);
+	o->size += n;
+    } while (n > 0);
+    fclose(f);
+
+    o->h = (ybo_header_rec *) take(o, &off, sizeof(ybo_header_rec));
+    if (memcmp(o->h->magic, YBO_MAGIC, sizeof(o->h->magic)) ||
+	o->h->version != YBO_VERSION) {
+	fprintf(stderr, "'%s' is not an object file\n", name);
+	exit(1);
+    }
+    if (!(o->h->flags & YBO_RELOC)) {
+	fprintf(stderr, "'%s' is not relocatable.  Assemble it with yas -c\n",
+		name);
+	exit(1);
+    }
+    if (o->h->align <= 0)
+	o->h->align = 1;
+
+    o->segs = (ybo_seg_rec **) calloc(o->h->seg_cnt + 1, sizeof(void *));
+    for (i = 0; i < o->h->seg_cnt; i++) {
+	o->segs[i] = (ybo_seg_rec *) take(o, &off, sizeof(ybo_seg_rec));
+	take(o, &off, o->segs[i]->len);
+    }
+    o->lines = (ybo_line_rec **) calloc(o->h->line_cnt + 1, sizeof(void *));
+    for (i = 0; i < o->h->line_cnt; i++) {
+	o->lines[i] = (ybo_line_rec *) take(o, &off, sizeof(ybo_line_rec));
+	take(o, &off, o->lines[i]->text_len);
+    }
+    o->syms = (ybo_sym_rec **) calloc(o->h->sym_cnt + 1, sizeof(void *));
+    o->sym_names = (char **) calloc(o->h->sym_cnt + 1, sizeof(char *));
+    for (i = 0; i < o->h->sym_cnt; i++) {
+	word_t len;
+	o->syms[i] = (ybo_sym_rec *) take(o, &off, sizeof(ybo_sym_rec));
+	len = o->syms[i]->name_len;
+	o->sym_names[i] = (char *) malloc(len + 1);
+	memcpy(o->sym_names[i], take(o, &off, len), len);
+	o->sym_names[i][len] = '\0';
+    }
+    o->rels = (ybo_rel_rec *)
+	take(o, &off, o->h->rel_cnt * sizeof(ybo_rel_rec));
+}
+
+/* Code of the cnt bytes at addr, relative to o's base, or NULL if they
+   are not all in one segment */
+byte_t *obj_code(obj_ptr o, word_t addr, word_t cnt)
+{
+    word_t i;
+    for (i = 0; i < o->h->seg_cnt; i++) {
+	ybo_seg_rec *s = o->segs[i];
+	if (addr >= s->addr && cnt <= s->len && addr - s->addr <= s->len - cnt)
+	    return (byte_t *) (s + 1) + (addr - s->addr);
+    }
+    return NULL;
+}
+
+global_rec *find_global(char *name)
+{
+    int i;
+    for (i = 0; i < global_cnt; i++)
+	if (strcmp(name, globals[i].name) == 0)
+	    return &globals[i];
+    return NULL;
+}
+
+/* Choose the base of each object and collect the exported symbols */
+void layout(word_t *place, word_t *align)
+{
+    word_t pos = 0;
+    int i, j;
+    word_t k;
+
+    for (i = 0; i < obj_cnt; i++) {
+	obj_ptr o = &objs[i];
+	word_t a = o->h->align > align[i] ? o->h->align : align[i];
+	if (place[i] >= 0)
+	    pos = place[i];
+	o->base = (pos + a - 1) / a * a;
+	pos = o->base + o->h->size;
+	for (j = 0; j < i; j++) {
+	    obj_ptr p = &objs[j];
+	    if (o->base < p->base + p->h->size &&
+		p->base < o->base + o->h->size) {
+		fprintf(stderr, "Objects '%s' and '%s' overlap\n",
+			p->name, o->name);
+		exit(1);
+	    }
+	}
+	for (k = 0; k < o->h->sym_cnt; k++) {
+	    global_rec *g;
+	    if (!(o->syms[k]->flags & YBO_SYM_EXPORT))
+		continue;
+	    g = find_global(o->sym_names[k]);
+	    if (g) {
+		fprintf(stderr, "Symbol '%s' is defined in '%s' and '%s'\n",
+			o->sym_names[k], g->obj->name, o->name);
+		exit(1);
+	    }
+	    globals = (global_rec *)
+		realloc(globals, (global_cnt + 1) * sizeof(global_rec));
+	    globals[global_cnt].name = o->sym_names[k];
+	    globals[global_cnt].addr = o->base + o->syms[k]->pos;
+	    globals[global_cnt].obj = o;
+	    global_cnt++;
+	}
+    }
+}
+
+/* Patch every use of a label with its final address */
+void relocate(obj_ptr o)
+{
+    word_t i;
+    int b;
+    for (i = 0; i < o->h->rel_cnt; i++) {
+	ybo_rel_rec *r = &o->rels[i];
+	byte_t *code = obj_code(o, r->addr, r->size);
+	word_t val;
+	if (r->sym < 0 || r->sym >= o->h->sym_cnt || !code || r->size > 8) {
+	    fprintf(stderr, "Bad relocation at 0x%llx in '%s'\n",
+		    r->addr, o->name);
+	    exit(1);
+	}
+	if (o->syms[r->sym]->flags & YBO_SYM_IMPORT) {
+	    global_rec *g = find_global(o->sym_names[r->sym]);
+	    if (!g) {
+		fprintf(stderr, "Undefined symbol '%s' used in '%s'\n",
+			o->sym_names[r->sym], o->name);
+		exit(1);
+	    }
+	    val = g->addr;
+	} else
+	    val = o->base + o->syms[r->sym]->pos;
+	for (b = 0; b < r->size; b++)
+	    code[b] = (val >> (b * 8)) & 0xFF;
+    }
+}
+
+/* Write the program in .yo form, one line per line of source that
+   generated code */
+void write_yo(FILE *out)
+{
+    int i, b;
+    word_t k;
+    for (i = 0; i < obj_cnt; i++) {
+	obj_ptr o = &objs[i];
+	fprintf(out, "                            | # %s\n", o->name);
+	for (k = 0; k < o->h->line_cnt; k++) {
+	    ybo_line_rec *l = o->lines[k];
+	    byte_t *code = obj_code(o, l->addr, l->cnt);
+	    char hex[2 * MAX_INSTR_LEN + 1];
+	    int cnt = l->cnt < MAX_INSTR_LEN ? l->cnt : MAX_INSTR_LEN;
+	    if (!code)
+		continue;
+	    for (b = 0; b < cnt; b++)
+		sprintf(hex + 2 * b, "%.2x", code[b]);
+	    hex[2 * cnt] = '\0';
+	    fprintf(out, "0x%.3llx: %-20s | %.*s\n", o->base + l->addr, hex,
+		    (int) l->text_len, (char *) (l + 1));
+	}
+    }
+}
+
+/* Write len bytes from src, padded to the next record */
+static void put(FILE *out, void *src, word_t len)
+{
+    static char zeros[YBO_ALIGN];
+    fwrite(src, 1, len, out);
+    fwrite(zeros, 1, YBO_PAD(len) - len, out);
+}
+
+/* Write the program as a binary image, with the line table and the
+   labels defined by each object */
+void write_ybo(FILE *out)
+{
+    ybo_header_rec h;
+    int i;
+    word_t k;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, YBO_MAGIC, sizeof(h.magic));
+    h.version = YBO_VERSION;
+    h.align = 1;
+    for (i = 0; i < obj_cnt; i++) {
+	obj_ptr o = &objs[i];
+	h.seg_cnt += o->h->seg_cnt;
+	h.line_cnt += o->h->line_cnt;
+	for (k = 0; k < o->h->sym_cnt; k++)
+	    if (!(o->syms[k]->flags & YBO_SYM_IMPORT))
+		h.sym_cnt++;
+	if (o->base + o->h->size > h.size)
+	    h.size = o->base + o->h->size;
+    }
+    put(out, &h, sizeof(h));
+    for (i = 0; i < obj_cnt; i++)
+	for (k = 0; k < objs[i].h->seg_cnt; k++) {
+	    ybo_seg_rec s = *objs[i].segs[k];
+	    s.addr += objs[i].base;
+	    put(out, &s, sizeof(s));
+	    put(out, objs[i].segs[k] + 1, s.len);
+	}
+    for (i = 0; i < obj_cnt; i++)
+	for (k = 0; k < objs[i].h->line_cnt; k++) {
+	    ybo_line_rec l = *objs[i].lines[k];
+	    l.addr += objs[i].base;
+	    put(out, &l, sizeof(l));
+	    put(out, objs[i].lines[k] + 1, l.text_len);
+	}
+    for (i = 0; i < obj_cnt; i++)
+	for (k = 0; k < objs[i].h->sym_cnt; k++) {
+	    ybo_sym_rec s = *objs[i].syms[k];
+	    if (s.flags & YBO_SYM_IMPORT)
+		continue;
+	    s.pos += objs[i].base;
+	    put(out, &s, sizeof(s));
+	    put(out, objs[i].sym_names[k], s.name_len);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+    char *out_name = NULL;
+    FILE *outfile;
+    word_t place = -1, align = 1;
+    word_t places[MAX_OBJ], aligns[MAX_OBJ];
+    int len, i;
+
+    for (i = 1; i < argc; i++) {
+	if (argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i+1 < argc) {
+	    switch (argv[i][1]) {
+	    case 'o':
+		out_name = argv[++i];
+		break;
+	    case 'p':
+		place = strtoll(argv[++i], NULL, 0);
+		break;
+	    case 'a':
+		align = strtoll(argv[++i], NULL, 0);
+		if (align <= 0)
+		    usage(argv[0]);
+		break;
+	    default:
+		usage(argv[0]);
+	    }
+	    continue;
+	}
+	if (argv[i][0] == '-' || obj_cnt == MAX_OBJ)
+	    usage(argv[0]);
+	read_obj(&objs[obj_cnt], argv[i]);
+	places[obj_cnt] = place;
+	aligns[obj_cnt] = align;
+	obj_cnt++;
+	place = -1;
+	align = 1;
+    }
+    if (!out_name || obj_cnt == 0)
+	usage(argv[0]);
+
+    layout(places, aligns);
+    for (i = 0; i < obj_cnt; i++)
+	relocate(&objs[i]);
+
+    outfile = fopen(out_name, "wb");
+    if (!outfile) {
+	fprintf(stderr, "Can't open output file '%s'\n", out_name);
+	exit(1);
+    }
+    len = strlen(out_name);
+    if (len > 4 && strcmp(out_name + len - 4, ".ybo") == 0)
+	write_ybo(outfile);
+    else
+	write_yo(outfile);
+    fclose(outfile);
+    return 0;
+}
@@ -0,0 +1,606 @@
+/*
+ * Ahead-of-time translator from Y86-64 object code (.yo) to C.
+ *
+ * The control-flow graph is recovered by following every statically
+ * known successor from address 0: fall-through, jump and call targets,
+ * and the return point of each call.  Every basic block becomes a
+ * labeled block of C operating on local copies of the program registers
+ * and the memory image.  Targets of ret are looked up through a switch
+ * over the block addresses.
+ *
+ * Anything the translation does not cover -- halt, faulting
+ * instructions, code that was not found statically, code that the
+ * program overwrites, and the last few steps before max_steps -- is
+ * executed by step_state, so the generated program reports exactly
+ * what yis would.  It must be linked with the isa.o and isacore.o
+ * built for yis, e.g.
+ *
+ *   yo2c prog.yo > prog.c
+ *   gcc -O2 -I../misc prog.c ../misc/isa.o ../misc/isacore.o -o prog
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "isa.h"
+
+/* yo2c never runs in GUI mode */
+int gui_mode = 0;
+
+FILE *outfile;
+
+mem_t mem;
+byte_t *reached;	/* Address was found as an instruction */
+byte_t *leader;		/* Address starts a basic block */
+byte_t *npred;		/* Number of fall-through predecessors */
+
+void usage(char *pname)
+{
+    printf("Usage: %s [-o c_file] code_file\n", pname);
+    printf("   -o c_file  Write C code to c_file rather than stdout\n");
+    exit(0);
+}
+
+/* Name of a register as a C identifier */
+char *cname(reg_id_t id)
+{
+    return reg_name(id) + 1;
+}
+
+/* Can d be executed by the translated code?  Other instructions are
+   handed to step_state */
+bool_t translatable(dinstr_ptr d)
+{
+    if (!d->ok1 || !d->okc)
+	return FALSE;
+    switch (d->icode) {
+    case I_NOP:
+    case I_RET:
+	return TRUE;
+    case I_RRMOVQ:
+	return d->ifun <= C_G && reg_valid(d->ra) && reg_valid(d->rb);
+    case I_IRMOVQ:
+    case I_IADDQ:
+	return reg_valid(d->rb);
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+	return reg_valid(d->ra) && (d->rb == REG_NONE || reg_valid(d->rb));
+    case I_ALU:
+	return d->ifun < A_NONE && reg_valid(d->ra) && reg_valid(d->rb);
+    case I_JMP:
+	return d->ifun <= C_G;
+    case I_CALL:
+	return TRUE;
+    case I_PUSHQ:
+    case I_POPQ:
+	return reg_valid(d->ra);
+    default:
+	return FALSE;
+    }
+}
+
+/* Does control continue to valp after d? */
+bool_t falls_through(dinstr_ptr d)
+{
+    return !(d->icode == I_RET || d->icode == I_CALL ||
+	     (d->icode == I_JMP && d->ifun == C_YES));
+}
+
+bool_t in_mem(word_t pc)
+{
+    return pc >= 0 && pc < mem->len;
+}
+
+/* Find every instruction reachable from address 0 */
+void find_code()
+{
+    word_t *stack = (word_t *) malloc(sizeof(word_t) * (mem->len + 1));
+    int top = 0;
+
+    leader[0] = 1;
+    stack[top++] = 0;
+    while (top > 0) {
+	word_t pc = stack[--top];
+	dinstr_ptr d;
+	if (reached[pc])
+	    continue;
+	reached[pc] = 1;
+	d = decode_instr(mem, pc);
+	if (!translatable(d))
+	    continue;
+	if (d->icode == I_JMP || d->icode == I_CALL) {
+	    if (in_mem(d->valc)) {
+		leader[d->valc] = 1;
+		if (!reached[d->valc])
+		    stack[top++] = d->valc;
+	    }
+	}
+	if (d->icode == I_CALL || (d->icode == I_JMP && d->ifun != C_YES)) {
+	    /* Return point or not-taken branch */
+	    if (in_mem(d->valp))
+		leader[d->valp] = 1;
+	}
+	if (d->icode == I_CALL || falls_through(d)) {
+	    if (!in_mem(d->valp))
+		continue;
+	    if (falls_through(d) && npred[d->valp] < 2)
+		npred[d->valp]++;
+	    if (!reached[d->valp])
+		stack[top++] = d->valp;
+	}
+    }
+    free(stack);
+}
+
+/* Does a translated block start at pc? */
+bool_t is_block(word_t pc)
+{
+    return in_mem(pc) && reached[pc] && (leader[pc] || npred[pc] > 1) &&
+	translatable(decode_instr(mem, pc));
+}
+
+/* Transfer control to pc */
+void emit_goto(word_t pc)
+{
+    if (is_block(pc))
+	fprintf(outfile, "goto L_%llx;\n", pc);
+    else
+	fprintf(outfile, "{ pc = 0x%llx; goto interp; }\n", pc);
+}
+
+/* Leave the block before instruction at pc, which has cnt instructions
+   (including itself) left in the block */
+void emit_exit(word_t pc, int cnt)
+{
+    fprintf(outfile, "{ pc = 0x%llx; steps -= %d; goto interp; }\n",
+	    pc, cnt);
+}
+
+/* Check the store just made to address a */
+void emit_store_check(word_t npc, int cnt)
+{
+    fprintf(outfile,
+	    "\tif (a < ghi && a + 8 > glo) "
+	    "{ pc = 0x%llx; steps -= %d; goto stored; }\n", npc, cnt);
+}
+
+char *cond_expr[] = {
+    "1", "(sf ^ of) | zf", "sf ^ of", "zf", "!zf", "!(sf ^ of)",
+    "!(sf ^ of) && !zf"
+};
+
+char *alu_macro[] = { "ADDQ", "SUBQ", "ANDQ", "XORQ", "MULQ", "DIVQ" };
+
+/* Emit code for d at pc, cnt instructions from the end of its block */
+void emit_instr(word_t pc, dinstr_ptr d, int cnt)
+{
+    switch (d->icode) {
+    case I_NOP:
+	break;
+    case I_RRMOVQ:
+	if (d->ifun == C_YES)
+	    fprintf(outfile, "\t%s = %s;\n", cname(d->rb), cname(d->ra));
+	else
+	    fprintf(outfile, "\tif (%s) %s = %s;\n",
+		    cond_expr[d->ifun], cname(d->rb), cname(d->ra));
+	break;
+    case I_IRMOVQ:
+	fprintf(outfile, "\t%s = 0x%llxLL;\n", cname(d->rb), d->valc);
+	break;
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+	if (d->rb == REG_NONE)
+	    fprintf(outfile, "\ta = 0x%llxLL;\n", d->valc);
+	else
+	    fprintf(outfile, "\ta = (word_t) ((uword_t) %s + 0x%llxULL);\n",
+		    cname(d->rb), d->valc);
+	fprintf(outfile, "\tif ((uword_t) a > mlimit) ");
+	emit_exit(pc, cnt);
+	if (d->icode == I_MRMOVQ) {
+	    fprintf(outfile, "\t%s = get_word(mem, a);\n", cname(d->ra));
+	} else {
+	    fprintf(outfile, "\tif (!READY(a)) ");
+	    emit_exit(pc, cnt);
+	    fprintf(outfile, "\tput_word(mem, a, %s);\n", cname(d->ra));
+	    emit_store_check(d->valp, cnt - 1);
+	}
+	break;
+    case I_ALU:
+	fprintf(outfile, "\t%s(%s, %s);\n", alu_macro[d->ifun],
+		cname(d->rb), cname(d->ra));
+	break;
+    case I_IADDQ:
+	fprintf(outfile, "\tADDQ(%s, 0x%llxLL);\n", cname(d->rb), d->valc);
+	break;
+    case I_JMP:
+	if (d->ifun != C_YES) {
+	    fprintf(outfile, "\tif (%s) ", cond_expr[d->ifun]);
+	    emit_goto(d->valc);
+	    fprintf(outfile, "\t");
+	    emit_goto(d->valp);
+	} else {
+	    fprintf(outfile, "\t");
+	    emit_goto(d->valc);
+	}
+	break;
+    case I_CALL:
+	fprintf(outfile, "\ta = (word_t) ((uword_t) rsp - 8);\n");
+	fprintf(outfile, "\tif ((uword_t) a > mlimit) ");
+	emit_exit(pc, cnt);
+	fprintf(outfile, "\tif (!READY(a)) ");
+	emit_exit(pc, cnt);
+	fprintf(outfile, "\trsp = a;\n");
+	fprintf(outfile, "\tput_word(mem, a, 0x%llxLL);\n", d->valp);
+	emit_store_check(d->valc, 0);
+	fprintf(outfile, "\t");
+	emit_goto(d->valc);
+	break;
+    case I_RET:
+	fprintf(outfile, "\ta = rsp;\n");
+	fprintf(outfile, "\tif ((uword_t) a > mlimit) ");
+	emit_exit(pc, cnt);
+	fprintf(outfile, "\tpc = get_word(mem, a);\n");
+	fprintf(outfile, "\trsp = (word_t) ((uword_t) a + 8);\n");
+	fprintf(outfile, "\tgoto dispatch;\n");
+	break;
+    case I_PUSHQ:
+	fprintf(outfile, "\ta = (word_t) ((uword_t) rsp - 8);\n");
+	fprintf(outfile, "\tif ((uword_t) a > mlimit) ");
+	emit_exit(pc, cnt);
+	fprintf(outfile, "\tif (!READY(a)) ");
+	emit_exit(pc, cnt);
+	fprintf(outfile, "\tput_word(mem, a, %s);\n", cname(d->ra));
+	fprintf(outfile, "\trsp = a;\n");
+	emit_store_check(d->valp, cnt - 1);
+	break;
+    case I_POPQ:
+	fprintf(outfile, "\ta = rsp;\n");
+	fprintf(outfile, "\tif ((uword_t) a > mlimit) ");
+	emit_exit(pc, cnt);
+	fprintf(outfile, "\trsp = (word_t) ((uword_t) a + 8);\n");
+	fprintf(outfile, "\t%s = get_word(mem, a);\n", cname(d->ra));
+	break;
+    }
+}
+
+/* Does the block holding d continue with the instruction after it? */
+bool_t block_continues(dinstr_ptr d)
+{
+    return falls_through(d) && d->icode != I_JMP && in_mem(d->valp) &&
+	translatable(decode_instr(mem, d->valp)) && !is_block(d->valp);
+}
+
+void emit_block(word_t pc)
+{
+    word_t start = pc;
+    int cnt = 1;
+    int i;
+
+    while (block_continues(decode_instr(mem, pc))) {
+	pc = decode_instr(mem, pc)->valp;
+	cnt++;
+    }
+
+    pc = start;
+    fprintf(outfile, "\n L_%llx:\n", pc);
+    fprintf(outfile, "    if (max_steps - steps < %d) ", cnt);
+    fprintf(outfile, "{ pc = 0x%llx; goto interp; }\n", pc);
+    fprintf(outfile, "    steps += %d;\n", cnt);
+    for (i = cnt; i > 0; i--) {
+	dinstr_ptr d = decode_instr(mem, pc);
+	emit_instr(pc, d, i);
+	if (i == 1 && falls_through(d) && d->icode != I_JMP) {
+	    fprintf(outfile, "\t");
+	    emit_goto(d->valp);
+	}
+	pc = d->valp;
+    }
+}
+
+/* Fixed part of the generated program, before the translated code */
+char *prologue =
+"/* Number of steps to run when none is given */\n"
+"#define DEFAULT_STEPS 10000\n"
+"\n"
+"int gui_mode = 0;\n"
+"\n"
+"static inline word_t get_word(byte_t *mem, word_t a)\n"
+"{\n"
+"    uword_t val = 0;\n"
+"    int i;\n"
+"    for (i = 7; i >= 0; i--)\n"
+"\tval = (val << 8) | mem[a+i];\n"
+"    return (word_t) val;\n"
+"}\n"
+"\n"
+"static inline void put_word(byte_t *mem, word_t a, word_t val)\n"
+"{\n"
+"    int i;\n"
+"    for (i = 0; i < 8; i++) {\n"
+"\tmem[a+i] = (byte_t) val;\n"
+"\tval = (word_t) ((uword_t) val >> 8);\n"
+"    }\n"
+"}\n"
+"\n"
+"/* Can the word at a be stored directly?  See PAGE_READY */\n"
+"#define READY(a) (page_gen[(a) >> MEM_PAGE_SHIFT] == gen &&\t\t\\\n"
+"\t\t  page_gen[((a) + 7) >> MEM_PAGE_SHIFT] == gen)\n"
+"\n"
+"/* Arithmetic with condition codes as computed by compute_cc */\n"
+"#define ADDQ(dst, src) do {\t\t\t\t\t\t\\\n"
+"\tword_t a_ = (src), b_ = dst;\t\t\t\t\t\\\n"
+"\tdst = (word_t) ((uword_t) b_ + (uword_t) a_);\t\t\t\\\n"
+"\tzf = dst == 0; sf = dst < 0;\t\t\t\t\t\\\n"
+"\tof = (a_ < 0) == (b_ < 0) && (dst < 0) != (a_ < 0);\t\t\\\n"
+"    } while (0)\n"
+"#define SUBQ(dst, src) do {\t\t\t\t\t\t\\\n"
+"\tword_t a_ = (src), b_ = dst;\t\t\t\t\t\\\n"
+"\tdst = (word_t) ((uword_t) b_ - (uword_t) a_);\t\t\t\\\n"
+"\tzf = dst == 0; sf = dst < 0;\t\t\t\t\t\\\n"
+"\tof = (a_ > 0) == (b_ < 0) && (dst < 0) != (b_ < 0);\t\t\\\n"
+"    } while (0)\n"
+"#define ANDQ(dst, src) do {\t\t\t\t\t\t\\\n"
+"\tdst &= (src); zf = dst == 0; sf = dst < 0; of = 0;\t\t\\\n"
+"    } while (0)\n"
+"#define XORQ(dst, src) do {\t\t\t\t\t\t\\\n"
+"\tdst ^= (src); zf = dst == 0; sf = dst < 0; of = 0;\t\t\\\n"
+"    } while (0)\n"
+"#define ALUQ(op, dst, src) do {\t\t\t\t\t\t\\\n"
+"\tword_t a_ = (src), b_ = dst;\t\t\t\t\t\\\n"
+"\tcc_t cc_;\t\t\t\t\t\t\t\\\n"
+"\tdst = compute_alu(op, a_, b_);\t\t\t\t\t\\\n"
+"\tcc_ = compute_cc(op, a_, b_);\t\t\t\t\t\\\n"
+"\tzf = GET_ZF(cc_); sf = GET_SF(cc_); of = GET_OF(cc_);\t\t\\\n"
+"    } while (0)\n"
+"#define MULQ(dst, src) ALUQ(A_MUL, dst, src)\n"
+"#define DIVQ(dst, src) ALUQ(A_DIV, dst, src)\n"
+"\n"
+"/*\n"
+" * Execute one instruction with the reference interpreter.  Extend\n"
+" * [*glo, *ghi) to cover the decoded instruction, and set *smc if the\n"
+" * instruction wrote over translated code.\n"
+" */\n"
+"static stat_t interp_step(state_ptr s, word_t *glo, word_t *ghi, int *smc)\n"
+"{\n"
+"    dinstr_ptr d = decode_instr(s->m, s->pc);\n"
+"    bool_t store = FALSE;\n"
+"    word_t a = 0;\n"
+"    stat_t status;\n"
+"\n"
+"    if (d) {\n"
+"\tif (s->pc < *glo)\n"
+"\t    *glo = s->pc;\n"
+"\tif (s->pc + MAX_INSTR_LEN > *ghi)\n"
+"\t    *ghi = s->pc + MAX_INSTR_LEN;\n"
+"\tif (d->icode == I_RMMOVQ) {\n"
+"\t    store = TRUE;\n"
+"\t    a = d->valc + get_reg_val(s->r, d->rb);\n"
+"\t} else if (d->icode == I_CALL || d->icode == I_PUSHQ) {\n"
+"\t    store = TRUE;\n"
+"\t    a = get_reg_val(s->r, REG_RSP) - 8;\n"
+"\t}\n"
+"    }\n"
+"    status = step_state(s, stdout);\n"
+"    if (status == STAT_AOK && store && a < CODE_HI && a + 8 > CODE_LO)\n"
+"\t*smc = 1;\n"
+"    return status;\n"
+"}\n";
+
+/* Fixed part of the generated program, after the translated code */
+char *epilogue =
+"\n"
+" stored:\n"
+"    /* A store hit decoded or translated code */\n"
+"    if (s->m->icache)\n"
+"\tinvalidate_icache(s->m, a, 8);\n"
+"    if (a < CODE_HI && a + 8 > CODE_LO)\n"
+"\tsmc = 1;\n"
+"    goto dispatch;\n"
+"\n"
+" done:\n"
+"    SAVE_STATE();\n"
+"    *statusp = status;\n"
+"    return steps;\n"
+"}\n"
+"\n"
+"int main(int argc, char *argv[])\n"
+"{\n"
+"    int max_steps = DEFAULT_STEPS;\n"
+"    state_ptr s = new_state(MEM_SIZE);\n"
+"    mem_t saver = copy_reg(s->r);\n"
+"    mem_snap_t savem;\n"
+"    word_t a;\n"
+"    word_t step;\n"
+"    stat_t e = STAT_AOK;\n"
+"\n"
+"    if (argc > 2) {\n"
+"\tprintf(\"Usage: %s [max_steps]\\n\", argv[0]);\n"
+"\texit(0);\n"
+"    }\n"
+"    if (argc > 1)\n"
+"\tmax_steps = atoi(argv[1]);\n"
+"\n"
+"    for (a = 0; a < sizeof(image); a += MEM_PAGE_SIZE)\n"
+"\tprepare_write(s->m, a);\n"
+"    memcpy(s->m->contents, image, sizeof(image));\n"
+"    savem = snapshot_mem(s->m);\n"
+"\n"
+"    step = run(s, max_steps, &e);\n"
+"\n"
+"    printf(\"Stopped in %lld steps at PC = 0x%llx.  Status '%s', CC %s\\n\",\n"
+"\t   step, s->pc, stat_name(e), cc_name(get_cc(&s->cc)));\n"
+"\n"
+"    printf(\"Changes to registers:\\n\");\n"
+"    diff_reg(saver, s->r, stdout);\n"
+"\n"
+"    printf(\"\\nChanges to memory:\\n\");\n"
+"    diff_mem_snap(savem, stdout, (word_t) 0, FALSE);\n"
+"\n"
+"    free_state(s);\n"
+"    free_reg(saver);\n"
+"    return 0;\n"
+"}\n";
+
+void emit_image()
+{
+    word_t len = mem->len;
+    word_t pos;
+    while (len > 0 && mem->contents[len-1] == 0)
+	len--;
+    fprintf(outfile, "/* Initial memory image */\n");
+    fprintf(outfile, "static const byte_t image[%lld] = {", len ? len : 1);
+    for (pos = 0; pos < len; pos++) {
+	if (pos % 12 == 0)
+	    fprintf(outfile, "\n   ");
+	fprintf(outfile, " 0x%.2x%s", mem->contents[pos],
+		pos + 1 < len ? "," : "");
+    }
+    fprintf(outfile, "\n};\n\n");
+}
+
+void emit_program(char *fname)
+{
+    word_t pc;
+    word_t lo = mem->len, hi = 0;
+    reg_id_t id;
+
+    /* Range of translated instructions */
+    for (pc = 0; pc < mem->len; pc++) {
+	if (reached[pc] && translatable(decode_instr(mem, pc))) {
+	    if (pc < lo)
+		lo = pc;
+	    if (pc + decode_instr(mem, pc)->len > hi)
+		hi = pc + decode_instr(mem, pc)->len;
+	}
+    }
+    if (lo > hi)
+	lo = hi = 0;
+
+    fprintf(outfile, "/* Translated from %s by yo2c */\n\n", fname);
+#ifdef SNU
+    fprintf(outfile, "#ifndef SNU\n#define SNU\n#endif\n\n");
+#endif
+    fprintf(outfile, "#include <stdio.h>\n#include <stdlib.h>\n");
+    fprintf(outfile, "#include <string.h>\n\n#include \"isa.h\"\n\n");
+    fprintf(outfile, "/* Bytes holding translated instructions */\n");
+    fprintf(outfile, "#define CODE_LO 0x%llxLL\n#define CODE_HI 0x%llxLL\n\n",
+	    lo, hi);
+    emit_image();
+    fputs(prologue, outfile);
+
+    fprintf(outfile, "\n#define LOAD_STATE() do {\t\t\t\t\t\t\\\n");
+    fprintf(outfile, "\tcc_t cc = get_cc(&s->cc);\t\t\t\t\t\\\n");
+    for (id = REG_RAX; id < REG_NONE; id++)
+	fprintf(outfile, "\t%s = get_reg_val(s->r, %d);\t\t\t\t\\\n",
+		cname(id), id);
+    fprintf(outfile, "\tzf = GET_ZF(cc); sf = GET_SF(cc); "
+	    "of = GET_OF(cc);\t\t\\\n");
+    fprintf(outfile, "\tpc = s->pc;\t\t\t\t\t\t\t\\\n    } while (0)\n");
+    fprintf(outfile, "#define SAVE_STATE() do {\t\t\t\t\t\t\\\n");
+    for (id = REG_RAX; id < REG_NONE; id++)
+	fprintf(outfile, "\tset_reg_val(s->r, %d, %s);\t\t\t\t\\\n",
+		id, cname(id));
+    fprintf(outfile, "\tSET_CC(s->cc, PACK_CC(zf, sf, of));\t\t\t\t\\\n");
+    fprintf(outfile, "\ts->pc = pc;\t\t\t\t\t\t\t\\\n    } while (0)\n");
+
+    fprintf(outfile, "\n/* Run for at most max_steps steps.  "
+	    "Return number of steps executed */\n");
+    fprintf(outfile, "static word_t run(state_ptr s, word_t max_steps, "
+	    "stat_t *statusp)\n{\n");
+    fprintf(outfile, "    word_t");
+    for (id = REG_RAX; id < REG_NONE; id++)
+	fprintf(outfile, " %s%s", cname(id), id + 1 < REG_NONE ? "," : ";\n");
+    fprintf(outfile, "    int zf, sf, of;\n");
+    fprintf(outfile, "    word_t pc, a;\n");
+    fprintf(outfile, "    word_t steps = 0;\n");
+    fprintf(outfile, "    stat_t status = STAT_AOK;\n");
+    fprintf(outfile, "    byte_t *mem = s->m->contents;\n");
+    fprintf(outfile, "    word_t *page_gen = s->m->page_gen;\n");
+    fprintf(outfile, "    word_t gen = s->m->gen;\n");
+    fprintf(outfile, "    uword_t mlimit = s->m->len - 8;\n");
+    fprintf(outfile, "    /* Stores in [glo, ghi) need to be checked */\n");
+    fprintf(outfile, "    word_t glo = CODE_LO, ghi = CODE_HI;\n");
+    fprintf(outfile, "    /* Set once translated code has been overwritten */\n");
+    fprintf(outfile, "    int smc = 0;\n\n");
+    fprintf(outfile, "    LOAD_STATE();\n\n");
+
+    fprintf(outfile, " dispatch:\n");
+    fprintf(outfile, "    if (smc)\n\tgoto interp;\n");
+    fprintf(outfile, "    switch (pc) {\n");
+    for (pc = 0; pc < mem->len; pc++)
+	if (is_block(pc))
+	    fprintf(outfile, "    case 0x%llx: goto L_%llx;\n", pc, pc);
+    fprintf(outfile, "    default: goto interp;\n    }\n\n");
+
+    fprintf(outfile, " interp:\n");
+    fprintf(outfile, "    if (steps >= max_steps)\n\tgoto done;\n");
+    fprintf(outfile, "    SAVE_STATE();\n");
+    fprintf(outfile, "    status = interp_step(s, &glo, &ghi, &smc);\n");
+    fprintf(outfile, "    steps++;\n");
+    fprintf(outfile, "    LOAD_STATE();\n");
+    fprintf(outfile, "    if (status != STAT_AOK)\n\tgoto done;\n");
+    fprintf(outfile, "    goto dispatch;\n");
+
+    for (pc = 0; pc < mem->len; pc++)
+	if (is_block(pc))
+	    emit_block(pc);
+
+    fputs(epilogue, outfile);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *code_file;
+    char *out_name = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "o:")) != -1) {
+	switch(c) {
+	case 'o':
+	    out_name = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    if (optind != argc - 1)
+	usage(argv[0]);
+    code_file = fopen(argv[optind], "r");
+    if (!code_file) {
+	fprintf(stderr, "Can't open code file '%s'\n", argv[optind]);
+	exit(1);
+    }
+
+    mem = init_mem(MEM_SIZE);
+    if (!load_mem(mem, code_file, 1)) {
+	printf("Exiting\n");
+	return 1;
+    }
+    fclose(code_file);
+
+    reached = (byte_t *) calloc(mem->len, 1);
+    leader = (byte_t *) calloc(mem->len, 1);
+    npred = (byte_t *) calloc(mem->len, 1);
+    find_code();
+
+    if (out_name) {
+	outfile = fopen(out_name, "w");
+	if (!outfile) {
+	    fprintf(stderr, "Can't open output file '%s'\n", out_name);
+	    exit(1);
+	}
+    } else
+	outfile = stdout;
+    emit_program(argv[optind]);
+    if (outfile != stdout)
+	fclose(outfile);
+
+    free(reached);
+    free(leader);
+    free(npred);
+    free_mem(mem);
+    return 0;
+}
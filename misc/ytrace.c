@@ -0,0 +1,105 @@
+/*
+ * Dump a binary execution trace written by yis -x or ssim -x.
+ *
+ * Each step is printed on one line with the registers and memory word
+ * it wrote, or with -s, only a summary of the whole trace.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "isa.h"
+
+/* ytrace never runs in GUI mode */
+int gui_mode = 0;
+
+void usage(char *pname)
+{
+    printf("Usage: %s [-s] trace_file\n", pname);
+    printf("   -s     Print only a summary of the trace\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *trace_file;
+    trace_reader_t t;
+    trace_rec rec;
+    reg_t r = init_reg();
+    bool_t summary = FALSE;
+    word_t counts[256];
+    word_t steps = 0, reg_writes = 0, mem_writes = 0;
+    long header;
+    int c, i, result;
+
+    while ((c = getopt(argc, argv, "s")) != -1) {
+	switch(c) {
+	case 's':
+	    summary = TRUE;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    if (optind != argc - 1)
+	usage(argv[0]);
+    trace_file = fopen(argv[optind], "rb");
+    if (!trace_file) {
+	fprintf(stderr, "Can't open trace file '%s'\n", argv[optind]);
+	exit(1);
+    }
+    t = open_trace_reader(trace_file, r);
+    if (!t) {
+	fprintf(stderr, "'%s' is not a trace file\n", argv[optind]);
+	exit(1);
+    }
+    header = ftell(trace_file);
+
+    if (!summary) {
+	reg_id_t id;
+	printf("Initial registers:");
+	for (id = REG_RAX; id < REG_NONE; id++)
+	    if (get_reg_val(r, id))
+		printf(" %s=0x%llx", reg_name(id), get_reg_val(r, id));
+	printf("\n");
+    }
+
+    for (i = 0; i < 256; i++)
+	counts[i] = 0;
+    while ((result = read_trace(t, &rec)) > 0) {
+	steps++;
+	counts[rec.instr]++;
+	for (i = 0; i < 2 && rec.reg[i] != REG_NONE; i++)
+	    reg_writes++;
+	if (rec.wrote)
+	    mem_writes++;
+	if (summary)
+	    continue;
+	printf("%8lld  ", steps);
+	print_step(stdout, &rec);
+	printf("\n");
+    }
+    if (result < 0)
+	fprintf(stderr, "Trace is truncated or corrupt after %lld steps\n",
+		steps);
+
+    if (summary) {
+	long bytes = ftell(trace_file);
+	printf("%lld steps, %ld bytes", steps, bytes);
+	if (steps)
+	    printf(" (%.2f per step after the header)",
+		   (double) (bytes - header) / steps);
+	printf("\n%lld register writes, %lld memory writes\n",
+	       reg_writes, mem_writes);
+	for (i = 0; i < 256; i++)
+	    if (counts[i])
+		printf("  %-7s %lld\n", iname(i), counts[i]);
+    }
+
+    close_trace_reader(t);
+    fclose(trace_file);
+    free_reg(r);
+    return result < 0;
+}
@@ -15,15 +15,19 @@ extern int plusmode;
 
 /* Both instruction and data memory */
 extern mem_t mem;
+/* Size of memory (-m) */
+extern word_t mem_size;
 
 /* Keep track of range of addresses that have been written */
 extern word_t minAddr;
 extern word_t memCnt;
 
 /* Register file */
-extern mem_t reg;
+extern reg_t reg;
 /* Condition code register */
-extern cc_t cc;
+extern lazy_cc_t cc;
+/* Input to it, which the last instruction leaves until the next cycle */
+extern lazy_cc_t cc_in;
 /* Program counter */
 extern word_t pc;
 
@@ -60,6 +64,17 @@ extern byte_t status;
 /* Log file */
 extern FILE *dumpfile;
 
+/* Trace of executed instructions, or NULL */
+extern trace_t sim_trace;
+
+/* ISA model that every instruction is compared with, or NULL */
+extern check_t sim_check;
+/* Set by the first instruction that differs from the model, which then
+   stops sim_run.  The instruction as executed and as the model did it */
+extern bool_t sim_diverged;
+extern trace_rec sim_retired;
+extern trace_rec sim_expected;
+
 
 /* Sets the simulator name (called from main routine in HCL file) */
 void set_simname(char *name);
@@ -74,6 +89,7 @@ void sim_reset();
   Run processor until one of following occurs:
   - An status error is encountered
   - max_instr instructions have completed
+  - An instruction differs from the ISA model, with sim_check on
 
   Return number of instructions executed.
   if statusp nonnull, then will be set to status of final instruction
@@ -81,9 +97,49 @@ void sim_reset();
 */
 word_t sim_run(word_t max_instr, byte_t *statusp, cc_t *ccp);
 
+/* Hash of the state after the instructions sim_run has executed, as
+   state_hash gives it for the ISA model.  The writes of the last one,
+   which update_state would do at the start of the next step, are
+   counted as done */
+uword_t sim_state_hash();
+
+/* Named snapshot of the processor state.  The memory is a copy-on-write
+   snapshot, so taking one costs no more than copying the registers */
+typedef struct sim_snap_rec {
+    char *name;
+    struct sim_snap_rec *next;
+    word_t pc;
+    lazy_cc_t cc;
+    byte_t status;
+    byte_t prev_icode;
+    byte_t prev_ifun;
+    word_t prev_valc;
+    word_t prev_valm;
+    word_t prev_valp;
+    bool_t prev_bcond;
+    word_t minAddr;
+    word_t memCnt;
+    reg_rec r;
+    mem_snap_t m;
+} sim_snap_rec, *sim_snap_t;
+
+/* Take a snapshot, replacing any earlier one with the same name */
+sim_snap_t sim_snapshot(char *name);
+
+/* Return snapshot with given name, or NULL if there is none */
+sim_snap_t sim_find_snapshot(char *name);
+
+/* Return the processor to snapshot snap, which is kept */
+void sim_restore(sim_snap_t snap);
+
+void sim_free_snapshot(sim_snap_t snap);
+
 /* If dumpfile set nonNULL, lots of status info printed out */
 void sim_set_dumpfile(FILE *file);
 
+/* If t set nonNULL, every instruction is added to trace t */
+void sim_set_trace(trace_t t);
+
 /*
  * sim_log dumps a formatted string to the dumpfile, if it exists
  * accepts variable argument list
@@ -46,6 +46,16 @@ word_t instr_limit = 1000000; /* Instruction limit [TTY only] (-l) */
 word_t instr_limit = 10000; /* Instruction limit [TTY only] (-l) */
 #endif
 bool_t do_check = FALSE; /* Test with YIS? [TTY only] (-t) */
+bool_t do_lockstep = FALSE; /* Test each instruction with YIS? [TTY only] (-k) */
+bool_t do_hash = FALSE;  /* Print the final state hash? [TTY only] (-H) */
+word_t mem_size = MEM_SIZE; /* Size of memory (-m) */
+char **file_maps;        /* Host files to map into memory [TTY only] (-r, -c) */
+bool_t *file_writable;   /* Whether each is copy-on-write (-c) */
+int file_map_cnt = 0;
+char **file_saves;       /* Memory to save to host files [TTY only] (-o) */
+int file_save_cnt = 0;
+FILE *port_file = NULL;  /* Output port file [TTY only] (-p) */
+FILE *trace_file = NULL; /* Binary trace file [TTY only] (-x) */
 
 #ifdef SNU
 int snu_mode = FALSE;	/* Print output for automatic grading server */
@@ -62,6 +72,8 @@ int snu_mode = FALSE;	/* Print output for automatic grading server */
 
 static void usage(char *name);           /* Print helpful usage message */
 static void run_tty_sim();               /* Run simulator in TTY mode */
+/* Report outcome of the lockstep check (-k) */
+static void report_lockstep(state_ptr s, word_t icount, cc_t result_cc);
 
 #ifdef HAS_GUI
 void addAppCommands(Tcl_Interp *interp); /* Add application-dependent commands */
@@ -90,11 +102,15 @@ int sim_main(int argc, char **argv)
     char *myargv[MAXARGS];
 
     
+    file_maps = (char **) malloc(argc * sizeof(char *));
+    file_writable = (bool_t *) malloc(argc * sizeof(bool_t));
+    file_saves = (char **) malloc(argc * sizeof(char *));
+
     /* Parse the command line arguments */
 #ifdef SNU
-    while ((c = getopt(argc, argv, "htgsl:v:")) != -1) {
+    while ((c = getopt(argc, argv, "hHtgksc:l:m:o:p:r:v:x:")) != -1) {
 #else
-    while ((c = getopt(argc, argv, "htgl:v:")) != -1) {
+    while ((c = getopt(argc, argv, "hHtgkc:l:m:o:p:r:v:x:")) != -1) {
 #endif
 	switch(c) {
 	case 'h':
@@ -103,6 +119,28 @@ int sim_main(int argc, char **argv)
 	case 'l':
 	    instr_limit = atoll(optarg);
 	    break;
+	case 'm':
+	    mem_size = parse_mem_size(optarg);
+	    if (!mem_size) {
+		printf("Invalid memory size %s\n", optarg);
+		usage(argv[0]);
+	    }
+	    break;
+	case 'r':
+	case 'c':
+	    file_writable[file_map_cnt] = c == 'c';
+	    file_maps[file_map_cnt++] = optarg;
+	    break;
+	case 'o':
+	    file_saves[file_save_cnt++] = optarg;
+	    break;
+	case 'p':
+	    port_file = strcmp(optarg, "-") ? fopen(optarg, "w") : stdout;
+	    if (!port_file) {
+		fprintf(stderr, "Can't open port file %s\n", optarg);
+		exit(1);
+	    }
+	    break;
 	case 'v':
 	    verbosity = atoi(optarg);
 	    if (verbosity < 0 || verbosity > 2) {
@@ -113,6 +151,19 @@ int sim_main(int argc, char **argv)
 	case 't':
 	    do_check = TRUE;
 	    break;
+	case 'k':
+	    do_lockstep = TRUE;
+	    break;
+	case 'H':
+	    do_hash = TRUE;
+	    break;
+	case 'x':
+	    trace_file = fopen(optarg, "wb");
+	    if (!trace_file) {
+		fprintf(stderr, "Can't open trace file %s\n", optarg);
+		exit(1);
+	    }
+	    break;
 	case 'g':
 	    gui_mode = TRUE;
 	    break;
@@ -222,8 +273,10 @@ static void run_tty_sim()
     status = STAT_AOK;
     cc_t result_cc = 0;
     word_t byte_cnt = 0;
-    mem_t mem0, reg0;
+    sim_snap_t start;
+    int i;
     state_ptr isa_state = NULL;
+    state_ptr check_state = NULL;
 
 
     /* In TTY mode, the default object file comes from stdin */
@@ -249,33 +302,65 @@ static void run_tty_sim()
 	printf("%lld bytes of code read\n", byte_cnt);
     }
     fclose(object_file);
-    if (do_check) {
-	isa_state = new_state(0);
-	free_mem(isa_state->r);
-	free_mem(isa_state->m);
-	isa_state->m = copy_mem(mem);
-	isa_state->r = copy_mem(reg);
-	isa_state->cc = cc;
-    }
+    for (i = 0; i < file_map_cnt; i++)
+	if (!map_mem_file(mem, file_maps[i], file_writable[i]))
+	    exit(1);
 
-    mem0 = copy_mem(mem);
-    reg0 = copy_mem(reg);
-    
+    /* Hashing from the start keeps the cost of the hash to each store */
+    if (do_hash)
+	start_mem_hash(mem);
+    /* Memory is only copied as the pipeline writes it */
+    start = sim_snapshot("start");
+    if (port_file)
+	attach_port(mem, port_file);
+    if (trace_file) {
+	trace_t t = open_trace(trace_file, reg);
+	if (!t) {
+	    fprintf(stderr, "Can't start trace writer\n");
+	    exit(1);
+	}
+	sim_set_trace(t);
+    }
+    if (do_lockstep) {
+	/* The ISA model runs on its own copy of the starting state */
+	check_state = new_state(0);
+	free_reg(check_state->r);
+	free_mem(check_state->m);
+	check_state->m = copy_mem(mem);
+	check_state->r = copy_reg(reg);
+	check_state->cc = cc;
+	check_state->pc = pc;
+	if (port_file)
+	    attach_port(check_state->m, NULL);
+	sim_check = start_check(check_state, instr_limit);
+	if (!sim_check) {
+	    fprintf(stderr, "Can't start ISA model thread\n");
+	    exit(1);
+	}
+    }
 
     icount = sim_run(instr_limit, &status, &result_cc);
+    flush_port(mem);
+    if (trace_file) {
+	close_trace(sim_trace);
+	sim_set_trace(NULL);
+	fclose(trace_file);
+    }
+    if (do_lockstep) {
+	stop_check(sim_check);
+	sim_check = NULL;
+    }
     if (verbosity > 0) {
 	printf("%lld instructions executed\n", icount);
 	printf("Status = %s\n", stat_name(status));
 	printf("Condition Codes: %s\n", cc_name(result_cc));
 	printf("Changed Register State:\n");
-	diff_reg(reg0, reg, stdout);
+	diff_reg(&start->r, reg, stdout);
 	printf("Changed Memory State:\n");
-#ifdef SNU
-	diff_mem(mem0, mem, stdout, (word_t) 0);
-#else
-	diff_mem(mem0, mem, stdout);
-#endif
+	diff_mem_snap(start->m, stdout, (word_t) 0, FALSE);
     }
+    if (do_hash)
+	printf("State hash = 0x%016llx\n", sim_state_hash());
 #ifdef SNU
 	if (snu_mode)
 	{
@@ -286,48 +371,60 @@ static void run_tty_sim()
 			exit(1);
 		}
 		fprintf(fp, "Changed Memory State:\n");
-		diff_mem(mem0, mem, fp, (word_t) 0x1000);
+		diff_mem_snap(start->m, fp, (word_t) 0x1000, FALSE);
 		fclose(fp);
 		printf("%lld instructions executed\n", icount);
 	}
 #endif
+    for (i = 0; i < file_save_cnt; i++)
+	save_mem_file(mem, file_saves[i]);
+
+    if (do_lockstep) {
+	report_lockstep(check_state, icount, result_cc);
+	free_state(check_state);
+    }
 
     if (do_check) {
-	byte_t e = STAT_AOK;
-	int step;
+	run_result res;
 	bool_t match = TRUE;
+	/* Rerun from the start with the ISA model on the same memory and
+	   registers, keeping the pipeline's final state in a snapshot */
+	sim_snap_t end = sim_snapshot("end");
+
+	sim_restore(start);
+	/* The pipeline's output has already been written */
+	if (port_file)
+	    attach_port(mem, NULL);
+	isa_state = new_state(0);
+	free_reg(isa_state->r);
+	free_mem(isa_state->m);
+	isa_state->m = mem;
+	isa_state->r = reg;
+	isa_state->cc = start->cc;
 
-	for (step = 0; step < instr_limit && e == STAT_AOK; step++) {
-	    e = step_state(isa_state, stdout);
-	}
+	run_state(isa_state, instr_limit, &res);
+	fputs(res.msg, stdout);
 
-	if (diff_reg(isa_state->r, reg, NULL)) {
+	if (diff_reg(reg, &end->r, NULL)) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Register != Pipeline Register File\n");
-		diff_reg(isa_state->r, reg, stdout);
+		diff_reg(reg, &end->r, stdout);
 	    }
 	}
-#ifdef SNU
-	if (diff_mem(isa_state->m, mem, NULL, (word_t) 0)) {
-#else
-	if (diff_mem(isa_state->m, mem, NULL)) {
-#endif
+	/* Live memory is the ISA model's, the snapshot the pipeline's */
+	if (diff_mem_snap(end->m, NULL, (word_t) 0, TRUE)) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Memory != Pipeline Memory\n");
-#ifdef SNU
-		diff_mem(isa_state->m, mem, stdout, (word_t) 0);
-#else
-		diff_mem(isa_state->m, mem, stdout);
-#endif
+		diff_mem_snap(end->m, stdout, (word_t) 0, TRUE);
 	    }
 	}
-	if (isa_state->cc != result_cc) {
+	if (get_cc(&isa_state->cc) != result_cc) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Cond. Codes (%s) != Pipeline Cond. Codes (%s)\n",
-		       cc_name(isa_state->cc), cc_name(result_cc));
+		       cc_name(get_cc(&isa_state->cc)), cc_name(result_cc));
 	    }
 	}
 	if (match) {
@@ -340,18 +437,71 @@ static void run_tty_sim()
 
 
 
+/*
+ * report_lockstep - report the outcome of a lockstep check (-k) that
+ * stopped after icount instructions, leaving condition codes result_cc
+ */
+static void report_lockstep(state_ptr s, word_t icount, cc_t result_cc)
+{
+    if (sim_diverged) {
+	/* SEQ retires one instruction per cycle */
+	printf("Lockstep Check Fails at instruction %lld, cycle %lld\n",
+	       icount, icount);
+	if (verbosity > 0) {
+	    printf("Pipeline: ");
+	    print_step(stdout, &sim_retired);
+	    printf("\nISA:      ");
+	    if (sim_expected.status == STAT_BUB)
+		printf("stopped");
+	    else
+		print_step(stdout, &sim_expected);
+	    printf("\n");
+	}
+	return;
+    }
+    /* Records hold no condition codes, so they are compared at the end.
+       Those of an instruction that stops with AOK are still in cc_in */
+    if (status == STAT_AOK)
+	result_cc = get_cc(&cc_in);
+    if (get_cc(&s->cc) != result_cc) {
+	printf("Lockstep Check Fails after %lld instructions\n", icount);
+	if (verbosity > 0)
+	    printf("ISA Cond. Codes (%s) != Pipeline Cond. Codes (%s)\n",
+		   cc_name(get_cc(&s->cc)), cc_name(result_cc));
+    } else
+	printf("Lockstep Check Succeeds\n");
+}
+
 /*
  * usage - print helpful diagnostic information
  */
 static void usage(char *name)
 {
-    printf("Usage: %s [-htg] [-l m] [-v n] file.yo\n", name);
+    printf("Usage: %s [-hHtgk] [-l m] [-m size] [-v n] [-r file@addr]\n"
+	   "          [-c file@addr] [-o file@addr:len] [-p file] [-x file]\n"
+	   "          file.yo\n",
+	   name);
     printf("file.yo required in GUI mode, optional in TTY mode (default stdin)\n");
     printf("   -h     Print this message\n");
     printf("   -g     Run in GUI mode instead of TTY mode (default TTY)\n");  
     printf("   -l m   Set instruction limit to m [TTY mode only] (default %lld)\n", instr_limit);
+    printf("   -m s   Set memory size to s, such as 64K or 1G (default %d)\n",
+	   MEM_SIZE);
     printf("   -v n   Set verbosity level to 0 <= n <= 2 [TTY mode only] (default %d)\n", verbosity);
     printf("   -t     Test result against ISA simulator (yis) [TTY mode only]\n");
+    printf("   -k     Test each instruction against ISA simulator (yis) running\n"
+	   "          on a second thread, stopping at the first difference\n"
+	   "          [TTY mode only]\n");
+    printf("   -H     Print a hash of the final state, equal to that of yis -H\n"
+	   "          for an equal state [TTY mode only]\n");
+    printf("   -r f@a Map host file f read-only at address a [TTY mode only]\n");
+    printf("   -c f@a Map host file f copy-on-write at address a [TTY mode only]\n");
+    printf("   -o f@a:n Save n bytes at address a to host file f at the end\n"
+	   "          [TTY mode only]\n");
+    printf("   -p f   Send stores to the output port at 0x%llx to file f\n"
+	   "          ('-' for standard output) [TTY mode only]\n", IO_BASE);
+    printf("   -x f   Write a binary trace of every instruction to file f,\n"
+	   "          for ytrace [TTY mode only]\n");
 #ifdef SNU
 	printf("   -s     Print output for automatic grading server\n");
 #endif
@@ -485,7 +635,7 @@ static void sim_report() {
 	if (!plusmode) {
 	    report_state("NPC", format_npc());
 	}
-	show_cc(cc);
+	show_cc(get_cc(&cc));
     }
 #endif /* HAS_GUI */
 
@@ -497,6 +647,12 @@ void sim_set_dumpfile(FILE *df)
     dumpfile = df;
 }
 
+/* If t set nonNULL, every instruction is added to trace t */
+void sim_set_trace(trace_t t)
+{
+    sim_trace = t;
+}
+
 /*
  * sim_log dumps a formatted string to the dumpfile, if it exists
  * accepts variable argument list
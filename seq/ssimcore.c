@@ -31,9 +31,9 @@ word_t minAddr = 0;
 word_t memCnt = 0;
 
 /* Other processor state */
-mem_t reg;               /* Register file */
-cc_t cc = DEFAULT_CC;    /* Condition code register */
-cc_t cc_in = DEFAULT_CC; /* Input to condition code register */
+reg_t reg;               /* Register file */
+lazy_cc_t cc = { CC_KNOWN, DEFAULT_CC };    /* Condition code register */
+lazy_cc_t cc_in = { CC_KNOWN, DEFAULT_CC }; /* Input to condition code register */
 
 /* 
  * SEQ+: Results computed by previous instruction.
@@ -121,6 +121,15 @@ word_t gen_new_pc();
 /* Log file */
 FILE *dumpfile = NULL;
 
+/* Trace of executed instructions */
+trace_t sim_trace = NULL;
+
+/* Lockstep check against the ISA model */
+check_t sim_check = NULL;
+bool_t sim_diverged = FALSE;
+trace_rec sim_retired;
+trace_rec sim_expected;
+
 #ifdef HAS_GUI
 /* Representations of digits */
 static char digits[16] =
@@ -138,7 +147,7 @@ void sim_init()
 
     /* Create memory and register files */
     initialized = 1;
-    mem = init_mem(MEM_SIZE);
+    mem = init_sparse_mem(MEM_SIZE, mem_size);
     reg = init_reg();
     sim_reset();
     clear_mem(mem);
@@ -148,7 +157,7 @@ void sim_reset()
 {
     if (!initialized)
 	sim_init();
-    clear_mem(reg);
+    clear_reg(reg);
     minAddr = 0;
     memCnt = 0;
 
@@ -171,8 +180,8 @@ void sim_reset()
     } else {
 	pc_in = 0;
     }
-    cc = DEFAULT_CC;
-    cc_in = DEFAULT_CC;
+    SET_CC(cc, DEFAULT_CC);
+    SET_CC(cc_in, DEFAULT_CC);
     destE = REG_NONE;
     destM = REG_NONE;
     mem_write = FALSE;
@@ -253,6 +262,42 @@ static void update_state()
     }
 }
 
+/* Describe in rec the instruction just executed.  Its writes are only
+   done by update_state at the start of the next step, and only if its
+   status is AOK.  Stores to the output port are not memory writes */
+static void retire_instr(trace_rec *rec)
+{
+    int n = 0;
+
+    rec->pc = pc;
+    rec->instr = imem_error ? 0 : instr;
+    rec->status = status;
+    rec->reg[0] = rec->reg[1] = REG_NONE;
+    rec->wrote = FALSE;
+    if (status == STAT_AOK) {
+	if (destE != REG_NONE) {
+	    rec->reg[n] = destE;
+	    rec->regval[n++] = vale;
+	}
+	if (destM != REG_NONE) {
+	    rec->reg[n] = destM;
+	    rec->regval[n++] = valm;
+	}
+	if (mem_write && !IS_PORT(mem, mem_addr)) {
+	    rec->wrote = TRUE;
+	    rec->addr = mem_addr;
+	    rec->word = mem_data;
+#ifdef SNU
+	    /* A byte write leaves the rest of the word */
+	    if (gen_mem_byte() == 1) {
+		get_word_val(mem, mem_addr, &rec->word);
+		rec->word = (rec->word & ~0xffLL) | (mem_data & 0xff);
+	    }
+#endif
+	}
+    }
+}
+
 /* Execute one instruction */
 /* Return resulting status */
 static byte_t sim_step()
@@ -330,7 +375,9 @@ static byte_t sim_step()
 	valb = 0;
     }
 
-    cond = cond_holds(cc, ifun);
+    /* The HCL may look at Cnd for any instruction.  get_cc computes
+       the condition codes left pending by the last one */
+    cond = cond_holds(get_cc(&cc), ifun);
 
     destE = gen_dstE();
     destM = gen_dstM();
@@ -341,7 +388,7 @@ static byte_t sim_step()
     vale = compute_alu(alufun, aluA, aluB);
     cc_in = cc;
     if (gen_set_cc())
-	cc_in = compute_cc(alufun, aluA, aluB);
+	DEFER_CC(cc_in, alufun, aluA, aluB, vale);
 
     bcond =  cond && (icode == I_JMP);
 
@@ -366,7 +413,9 @@ static byte_t sim_step()
     if (mem_write) {
       /* Do a test read of the data memory to make sure address is OK */
       word_t junk;
-      dmem_error = dmem_error || !get_word_val(mem, mem_addr, &junk);
+      if (!IS_PORT(mem, mem_addr))
+	  dmem_error = dmem_error || !get_word_val(mem, mem_addr, &junk) ||
+	      mem_read_only(mem, mem_addr, gen_mem_byte() == 1 ? 1 : 8);
       
     }
 
@@ -383,6 +432,16 @@ static byte_t sim_step()
 	/* Update PC */
 	pc_in = gen_new_pc();
     } 
+    if (sim_trace || sim_check) {
+	trace_rec rec;
+	retire_instr(&rec);
+	if (sim_trace)
+	    trace_step(sim_trace, &rec);
+	if (sim_check && !check_step(sim_check, &rec, &sim_expected)) {
+	    sim_retired = rec;
+	    sim_diverged = TRUE;
+	}
+    }
     sim_report();
     return status;
 }
@@ -392,6 +451,7 @@ static byte_t sim_step()
   Run processor until one of following occurs:
   - An error status is encountered in WB.
   - max_instr instructions have completed through WB
+  - An instruction differs from the ISA model, with sim_check on
 
   Return number of instructions executed.
   if statusp nonnull, then will be set to status of final instruction
@@ -404,13 +464,149 @@ word_t sim_run(word_t max_instr, byte_t *statusp, cc_t *ccp)
     while (icount < max_instr) {
 	run_status = sim_step();
 	icount++;
-	if (run_status != STAT_AOK)
+	if (run_status != STAT_AOK || sim_diverged)
 	    break;
     }
     if (statusp)
 	*statusp = run_status;
     if (ccp)
-	*ccp = cc;
+	*ccp = get_cc(&cc);
     return icount;
 }
 
+/* PC that the next step of SEQ+ would compute */
+static word_t next_plus_pc()
+{
+    byte_t icode = prev_icode, ifun = prev_ifun;
+    word_t valc = prev_valc, valm = prev_valm, valp = prev_valp;
+    bool_t bcond = prev_bcond;
+    word_t result;
+
+    prev_icode = prev_icode_in;
+    prev_ifun = prev_ifun_in;
+    prev_valc = prev_valc_in;
+    prev_valm = prev_valm_in;
+    prev_valp = prev_valp_in;
+    prev_bcond = prev_bcond_in;
+    result = gen_pc();
+    prev_icode = icode;
+    prev_ifun = ifun;
+    prev_valc = valc;
+    prev_valm = valm;
+    prev_valp = valp;
+    prev_bcond = bcond;
+    return result;
+}
+
+uword_t sim_state_hash()
+{
+    reg_rec r = *reg;
+    lazy_cc_t c = cc;
+    word_t next_pc = pc;
+    uword_t mem_hash;
+
+    if (!mem->hashing)
+	start_mem_hash(mem);
+    mem_hash = mem->hash;
+    if (status == STAT_AOK) {
+	/* The writes update_state has yet to do */
+	set_reg_val(&r, destE, vale);
+	set_reg_val(&r, destM, valm);
+	c = cc_in;
+	next_pc = plusmode ? next_plus_pc() : pc_in;
+	if (mem_write && !IS_PORT(mem, mem_addr)) {
+	    /* Do the store and take it back again */
+	    mem_snap_t snap = snapshot_mem(mem);
+	    if (gen_mem_byte() == 1)
+		set_byte_val(mem, mem_addr, (byte_t) mem_data);
+	    else
+		set_word_val(mem, mem_addr, mem_data);
+	    mem_hash = mem->hash;
+	    restore_mem(snap);
+	    free_mem_snap(snap);
+	}
+    }
+    return mem_hash + r.hash + hash_word(HASH_PC_KEY, next_pc) +
+	hash_word(HASH_CC_KEY, get_cc(&c));
+}
+
+/* Snapshots, newest first */
+static sim_snap_t snaps = NULL;
+
+sim_snap_t sim_snapshot(char *name)
+{
+    sim_snap_t snap = sim_find_snapshot(name);
+    if (snap)
+	sim_free_snapshot(snap);
+    snap = (sim_snap_t) malloc(sizeof(sim_snap_rec));
+    snap->name = strdup(name);
+    snap->pc = pc;
+    snap->cc = cc;
+    snap->status = status;
+    snap->prev_icode = prev_icode;
+    snap->prev_ifun = prev_ifun;
+    snap->prev_valc = prev_valc;
+    snap->prev_valm = prev_valm;
+    snap->prev_valp = prev_valp;
+    snap->prev_bcond = prev_bcond;
+    snap->minAddr = minAddr;
+    snap->memCnt = memCnt;
+    snap->r = *reg;
+    snap->m = snapshot_mem(mem);
+    snap->next = snaps;
+    snaps = snap;
+    return snap;
+}
+
+sim_snap_t sim_find_snapshot(char *name)
+{
+    sim_snap_t snap;
+    for (snap = snaps; snap; snap = snap->next)
+	if (!strcmp(snap->name, name))
+	    return snap;
+    return NULL;
+}
+
+void sim_restore(sim_snap_t snap)
+{
+    /* sim_step starts by applying the pending updates, so make them
+       reproduce the restored state */
+    pc = pc_in = snap->pc;
+    cc = cc_in = snap->cc;
+    status = snap->status;
+    prev_icode = prev_icode_in = snap->prev_icode;
+    prev_ifun = prev_ifun_in = snap->prev_ifun;
+    prev_valc = prev_valc_in = snap->prev_valc;
+    prev_valm = prev_valm_in = snap->prev_valm;
+    prev_valp = prev_valp_in = snap->prev_valp;
+    prev_bcond = prev_bcond_in = snap->prev_bcond;
+    destE = REG_NONE;
+    destM = REG_NONE;
+    mem_write = FALSE;
+    minAddr = snap->minAddr;
+    memCnt = snap->memCnt;
+    *reg = snap->r;
+    restore_mem(snap->m);
+#ifdef HAS_GUI
+    if (gui_mode) {
+	reg_id_t id;
+	signal_register_clear();
+	for (id = REG_RAX; id < REG_NONE; id++)
+	    if (get_reg_val(reg, id))
+		signal_register_update(id, get_reg_val(reg, id));
+	create_memory_display();
+	sim_report();
+    }
+#endif
+}
+
+void sim_free_snapshot(sim_snap_t snap)
+{
+    sim_snap_t *p;
+    for (p = &snaps; *p != snap; p = &(*p)->next)
+	;
+    *p = snap->next;
+    free_mem_snap(snap->m);
+    free((void *) snap->name);
+    free((void *) snap);
+}